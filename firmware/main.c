@@ -15,6 +15,7 @@
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/eeprom.h>
 #include <avr/pgmspace.h>
 #include <avr/wdt.h>
 
@@ -195,7 +196,8 @@ usbMsgLen_t usbFunctionSetup(uchar data[8]) {
 		uint8_t par  = data[4] & USBASP_UART_PARITY_MASK;
 		uint8_t stop = data[4] & USBASP_UART_STOP_MASK;
 		uint8_t bytes= data[4] & USBASP_UART_BYTES_MASK;
-		uart_config(baud, par, stop, bytes);
+		uint8_t loop = data[4] & USBASP_UART_LOOPBACK;
+		uart_config(baud, par, stop, bytes, loop);
 	}
 	else if(data[1]==USBASP_FUNC_UART_FLUSHTX){
 		uart_flush_tx();
@@ -223,7 +225,7 @@ usbMsgLen_t usbFunctionSetup(uchar data[8]) {
 		len=2;
 	}
 	else if (data[1] == USBASP_FUNC_GETCAPABILITIES) {
-		replyBuffer[0] = USBASP_CAP_0_TPI|USBASP_CAP_6_UART;
+		replyBuffer[0] = USBASP_CAP_0_TPI|USBASP_CAP_6_UART|USBASP_CAP_7_UART_LOOPBACK;
 		replyBuffer[1] = 0;
 		replyBuffer[2] = 0;
 		replyBuffer[3] = 0;
@@ -235,6 +237,42 @@ usbMsgLen_t usbFunctionSetup(uchar data[8]) {
 	return len;
 }
 
+/* Serial number, 4 bytes at EEPROM_SERIAL reported as 8 hex digits. Blank
+ * EEPROM gets one derived from power-up SRAM contents on first start, so
+ * boards on one host can be told apart without programming each of them. */
+#define EEPROM_SERIAL ((uint8_t *) 0)
+#define SERIAL_LEN 8
+
+static int serialDescriptor[1 + SERIAL_LEN];
+static uchar powerupNoise[64] __attribute__((section(".noinit")));
+
+static void serialInit(void) {
+	uchar id[4];
+	uchar i;
+
+	eeprom_read_block(id, EEPROM_SERIAL, sizeof(id));
+	if ((id[0] & id[1] & id[2] & id[3]) == 0xff) {
+		uint32_t h = 2166136261UL; /* FNV-1a */
+		for (i = 0; i < sizeof(powerupNoise); i++)
+			h = (h ^ powerupNoise[i]) * 16777619UL;
+		for (i = 0; i < sizeof(id); i++)
+			id[i] = h >> (8 * i);
+		eeprom_write_block(id, EEPROM_SERIAL, sizeof(id));
+	}
+
+	serialDescriptor[0] = USB_STRING_DESCRIPTOR_HEADER(SERIAL_LEN);
+	for (i = 0; i < SERIAL_LEN; i++) {
+		uchar d = (i & 1) ? id[i >> 1] & 0x0f : id[i >> 1] >> 4;
+		serialDescriptor[1 + i] = d < 10 ? '0' + d : 'A' + d - 10;
+	}
+}
+
+/* Only the serial number string is dynamic, see usbconfig.h. */
+usbMsgLen_t usbFunctionDescriptor(struct usbRequest *rq) {
+	usbMsgPtr = (uchar *) serialDescriptor;
+	return sizeof(serialDescriptor);
+}
+
 uchar usbFunctionRead(uchar *data, uchar len) {
 
 	uchar i;
@@ -390,6 +428,8 @@ int main(void) {
 
 	/* output SE0 for USB reset */
 	DDRB = ~0;
+	/* while host sees reset, EEPROM writes can't delay enumeration */
+	serialInit();
 	j = 0;
 	/* USB Reset by device only required on Watchdog Reset */
 	while (--j) {
@@ -413,7 +453,8 @@ int main(void) {
 	uart_config(155, 
 			USBASP_UART_PARITY_NONE,
 			USBASP_UART_STOP_1BIT,
-			USBASP_UART_BYTES_8B);
+			USBASP_UART_BYTES_8B,
+			0);
 	sei();
 	while(1){
 		_delay_ms(100);
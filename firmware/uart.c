@@ -7,7 +7,8 @@
 // This struct and its corresponding functions assume there
 // are two threads: writer and reader, at most one of each.
 //
-// For rx: reader is USB code, and writer is RXC interrupt.
+// For rx: reader is USB code, and writer is RXC interrupt
+// (or UDRE interrupt in loopback mode).
 // For tx: reader is UDRE interrupt, and reader is USB code.
 typedef struct ringBuffer{
 	volatile uint8_t* volatile write;
@@ -164,10 +165,17 @@ ISR(USART_RXC_vect, ISR_NAKED){
 	__asm__ volatile("rjmp __vector_usart_rxc_wrapped"::);
 }
 
+// When set, UDRE is the only writer of rx ringBuffer (RXC is off).
+static volatile uint8_t loopback;
+
 void __vector_usart_udre_wrapped() __attribute__ ((signal));
 void __vector_usart_udre_wrapped(){
 	if(!ringBufferEmpty(&tx)){
-		UDR=ringBufferRead(&tx);
+		uint8_t c=ringBufferRead(&tx);
+		UDR=c;
+		if(loopback && !ringBufferFull(&rx)){
+			ringBufferWrite(&rx, c);
+		}
 		UCSRB|=(1<<UDRIE); // Enable this interrupt back.
 	}
 }
@@ -282,8 +290,9 @@ void uart_flush_tx(){
 	tx.write=read;
 }
 
-void uart_config(uint16_t baud, uint8_t par, uint8_t stop, uint8_t bytes){
+void uart_config(uint16_t baud, uint8_t par, uint8_t stop, uint8_t bytes, uint8_t loop){
 	uart_disable();
+	loopback=loop;
 
 	PORTD|=1<<1; // Tx initially high.
 	DDRD |=1<<1; // Tx as output.
@@ -318,6 +327,13 @@ void uart_config(uint16_t baud, uint8_t par, uint8_t stop, uint8_t bytes){
 	UBRRL=baud&0xFF;
 	UBRRH=baud>>8;
 
+	if(loopback){
+		// Bytes still go out on Tx pin, so line timing is kept, but rx
+		// ringBuffer is filled by UDRE interrupt instead of the receiver.
+		UCSRB=(1<<TXEN);
+		return;
+	}
+
 	// Turn on RX/TX and RX interrupt.
 	UCSRB=(1<<RXCIE)|(1<<RXEN)|(1<<TXEN);
 }
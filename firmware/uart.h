@@ -7,7 +7,7 @@
 #define RINGBUFFER_TX_SIZE 256
 #define RINGBUFFER_RX_SIZE 256
 
-void uart_config(uint16_t baud, uint8_t par, uint8_t stop, uint8_t bytes);
+void uart_config(uint16_t baud, uint8_t par, uint8_t stop, uint8_t bytes, uint8_t loopback);
 void uart_disable();
 void uart_flush_tx();
 void uart_flush_rx();
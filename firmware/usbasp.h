@@ -47,6 +47,7 @@
 /* USBASP capabilities */
 #define USBASP_CAP_0_TPI    0x01
 #define USBASP_CAP_6_UART   (1U<<6)
+#define USBASP_CAP_7_UART_LOOPBACK (1U<<7)
 
 /* programming state */
 #define PROG_STATE_IDLE         0
@@ -95,6 +96,9 @@
 #define USBASP_UART_BYTES_8B    0b011000
 #define USBASP_UART_BYTES_9B    0b100000
 
+// Feed every byte sent by UDRE back into rx ring (Rx pin is ignored).
+#define USBASP_UART_LOOPBACK    0b1000000
+
 
 /* macros for gpio functions */
 #define ledRedOn()    PORTC &= ~(1 << PC1)
@@ -0,0 +1,1031 @@
+#include "bench.h"
+#include "usbasp_reactor.h"
+#include "filter.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+
+typedef std::chrono::high_resolution_clock bench_clock;
+
+// Chunks for pooled reads; a few are enough since each is released
+// before the next read.
+#define BENCH_POOL_CHUNKS 4
+
+// Counts heap allocations of the program's own code, so benchmarks can
+// show that streaming does not touch the heap. The makefile links with
+// --wrap for malloc, calloc, realloc and operator new (_Znwm, _Znam on
+// 64-bit), so their calls from the terminal and library objects come
+// here; those made inside libusb and libstdc++ are not seen.
+static std::atomic<uint64_t> heap_allocs(0);
+
+extern "C"{
+void* __real_malloc(size_t n);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void* p, size_t n);
+void* __real__Znwm(size_t n);
+void* __real__Znam(size_t n);
+
+void* __wrap_malloc(size_t n){
+	heap_allocs.fetch_add(1, std::memory_order_relaxed);
+	return __real_malloc(n);
+}
+void* __wrap_calloc(size_t n, size_t size){
+	heap_allocs.fetch_add(1, std::memory_order_relaxed);
+	return __real_calloc(n, size);
+}
+void* __wrap_realloc(void* p, size_t n){
+	heap_allocs.fetch_add(1, std::memory_order_relaxed);
+	return __real_realloc(p, n);
+}
+void* __wrap__Znwm(size_t n){
+	heap_allocs.fetch_add(1, std::memory_order_relaxed);
+	return __real__Znwm(n);
+}
+void* __wrap__Znam(size_t n){
+	heap_allocs.fetch_add(1, std::memory_order_relaxed);
+	return __real__Znam(n);
+}
+}
+
+uint64_t heapAllocs(){
+	return heap_allocs.load(std::memory_order_relaxed);
+}
+
+static long usSince(bench_clock::time_point start){
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+			bench_clock::now()-start).count();
+}
+
+void patternFill(uint8_t* buff, size_t offset, size_t len){
+	for(size_t i=0; i<len; i++){
+		buff[i]='a'+(offset+i)%26;
+	}
+}
+
+void countedFill(uint8_t* buff, size_t offset, size_t len){
+	for(size_t i=0; i<len; i++){
+		size_t at=offset+i;
+		unsigned place=at&3;
+		buff[i]=(uint8_t)(place<<6 | ((at>>2)>>(6*place)&0x3F));
+	}
+}
+
+static uint8_t countedByte(size_t at){
+	uint8_t c;
+	countedFill(&c, at, 1);
+	return c;
+}
+
+void PatternChecker::event(size_t at, int count){
+	if(events.size()<max_events){
+		events.push_back(LossEvent{at, count});
+	}
+}
+
+// Pending bytes were sent from at on: the difference to offset is a gap
+// or a repeat, pending bytes not matching there are corrupted.
+void PatternChecker::place(size_t at){
+	if(at>offset){
+		dropped+=at-offset;
+		event(offset, (int)(at-offset));
+	}
+	else if(at<offset){
+		duplicated+=offset-at;
+		event(offset, -(int)(offset-at));
+	}
+	for(size_t i=0; i<npending; i++){
+		if(pending[i]!=countedByte(at+i)){ corrupted++; }
+	}
+	offset=at+npending;
+	npending=0;
+}
+
+void PatternChecker::feedCounted(uint8_t c){
+	if(!npending && c==countedByte(offset)){
+		offset++;
+		return;
+	}
+	pending[npending++]=c;
+	// Four bytes tagged 0..3 in a row make a word and tell its position.
+	size_t i=npending-4;
+	if(npending>=4 && pending[i]>>6==0 && pending[i+1]>>6==1 && pending[i+2]>>6==2 &&
+			pending[i+3]>>6==3){
+		size_t word=0;
+		for(int k=0; k<4; k++){ word|=(size_t)(pending[i+k]&0x3F)<<(6*k); }
+		size_t at=word*4;
+		// Position only has 24 bits of words, the rest comes from offset.
+		at+=(offset&~(size_t)0x3FFFFFF);
+		if(at+0x2000000<offset){ at+=0x4000000; }
+		place(at>=i?at-i:0);
+	}
+	else if(npending==sizeof(pending)){
+		// No word in a whole buffer: all of it is garbage.
+		corrupted+=npending;
+		offset+=npending;
+		npending=0;
+	}
+}
+
+void PatternChecker::end(size_t size){
+	if(npending){
+		// The last bytes sent, no word came after them.
+		place(size>=npending?size-npending:0);
+	}
+	if(offset<size){
+		dropped+=size-offset;
+		event(offset, (int)(size-offset));
+		offset=size;
+	}
+}
+
+void PatternChecker::feed(const uint8_t* data, size_t len){
+	if(counted){
+		for(size_t i=0; i<len; i++){
+			received++;
+			feedCounted(data[i]);
+		}
+		return;
+	}
+	for(size_t i=0; i<len; i++){
+		uint8_t c=data[i];
+		received++;
+		if(c<'a' || c>'z'){
+			corrupted++;
+			offset++;
+			last=-1;
+			continue;
+		}
+		if(sync && received==1){
+			offset=c-'a';
+		}
+		int expected='a'+offset%26;
+		if(c==expected){
+			offset++;
+		}
+		else if(c==last){
+			duplicated++;
+			event(offset, -1);
+		}
+		else{
+			int lost=(c-expected+26)%26;
+			dropped+=lost;
+			event(offset, lost);
+			offset+=lost+1;
+		}
+		last=c;
+	}
+}
+
+class BenchReport;
+
+// Counts one direction of a streaming benchmark. Control transfers are
+// counted as well, empty ones are RX polls with no data or TX_FREE
+// queries that found no room.
+struct BenchMeter{
+	const char* dir;
+	BenchReport* report;
+	bench_clock::time_point start;
+	bench_clock::time_point window_start;
+	bench_clock::time_point last_data;
+	long end_us=0;
+	uint64_t bytes=0;
+	uint64_t transfers=0;
+	uint64_t empty=0;
+	uint64_t w_bytes=0;
+	uint64_t w_transfers=0;
+	uint64_t w_empty=0;
+	uint64_t allocs_mark=0;
+	uint64_t allocs=0;   // Heap allocations between begin() and finish().
+
+	BenchMeter(const char* dir, BenchReport* report): dir(dir), report(report){
+		begin();
+	}
+	void begin(){
+		start=window_start=last_data=bench_clock::now();
+		allocs_mark=heapAllocs();
+	}
+	void record(int len, int transfers);
+	void finish();
+};
+
+// Prints window samples as they are complete and totals at the end.
+// Shared by both directions of duplex test, hence the lock.
+class BenchReport{
+public:
+	BenchReport(const StreamConfig& cfg, const char* test): cfg(cfg){
+		if(cfg.format==BENCH_CSV){
+			printf("type,dir,t_ms,bytes,rate,transfers,empty,empty_ratio,"
+					"dropped,duplicated,corrupted,allocations\n");
+		}
+		else if(cfg.format==BENCH_JSON){
+			printf("{\n  \"test\": \"%s\",\n  \"size\": %zu,\n  \"window_ms\": %d,\n"
+					"  \"samples\": [", test, cfg.size, cfg.window_ms);
+		}
+	}
+
+	int windowMs() const { return cfg.window_ms; }
+
+	void sample(const BenchMeter& m, long t_us){
+		std::lock_guard<std::mutex> lock(mutex);
+		long w_us=std::chrono::duration_cast<std::chrono::microseconds>(
+				bench_clock::now()-m.window_start).count();
+		double rate=m.w_bytes/(w_us/1000000.0);
+		double ratio=m.w_transfers?m.w_empty/(double)m.w_transfers:0;
+		switch(cfg.format){
+		case BENCH_CSV:
+			printf("sample,%s,%ld,%llu,%.0f,%llu,%llu,%.3f,,,,\n", m.dir, t_us/1000,
+					(unsigned long long)m.w_bytes, rate,
+					(unsigned long long)m.w_transfers, (unsigned long long)m.w_empty, ratio);
+			break;
+		case BENCH_JSON:
+			printf("%s\n    {\"dir\": \"%s\", \"t_ms\": %ld, \"bytes\": %llu, \"rate\": %.0f, "
+					"\"transfers\": %llu, \"empty\": %llu, \"empty_ratio\": %.3f}",
+					first?"":",", m.dir, t_us/1000, (unsigned long long)m.w_bytes, rate,
+					(unsigned long long)m.w_transfers, (unsigned long long)m.w_empty, ratio);
+			first=false;
+			break;
+		default:
+			fprintf(stderr, "%s %6.1fs: %llu/%zu, %.0f B/s, %llu transfers, %.0f%% empty\n",
+					m.dir, t_us/1000000.0, (unsigned long long)m.bytes, cfg.size, rate,
+					(unsigned long long)m.w_transfers, 100*ratio);
+			break;
+		}
+		fflush(stdout);
+	}
+
+	void total(const BenchMeter& m, const PatternChecker* check){
+		totals.push_back(Total{m.dir, m.end_us, m.bytes, m.transfers, m.empty,
+				check?check->dropped:0, check?check->duplicated:0,
+				check?check->corrupted:0, check!=NULL, m.allocs});
+	}
+
+	// -1 when streaming allocated.
+	int finish(){
+		int rv=0;
+		if(cfg.format==BENCH_JSON){
+			printf("\n  ],\n  \"totals\": [");
+		}
+		for(size_t i=0; i<totals.size(); i++){
+			printTotal(totals[i], i==0);
+			if(totals[i].allocs){ rv=-1; }
+		}
+		if(cfg.format==BENCH_JSON){
+			printf("\n  ]\n}\n");
+		}
+		if(totals.size()==2 && cfg.format==BENCH_TEXT){
+			double a=rate(totals[0]), b=rate(totals[1]);
+			printf("Split: %.1f%% %s, %.1f%% %s\n", 100*a/(a+b), totals[0].dir,
+					100*b/(a+b), totals[1].dir);
+		}
+		return rv;
+	}
+
+private:
+	struct Total{
+		const char* dir;
+		long us;
+		uint64_t bytes, transfers, empty;
+		size_t dropped, duplicated, corrupted;
+		bool checked;
+		uint64_t allocs;
+	};
+
+	static double rate(const Total& t){
+		return t.us?t.bytes/(t.us/1000000.0):0;
+	}
+
+	void printTotal(const Total& t, bool first){
+		double ratio=t.transfers?t.empty/(double)t.transfers:0;
+		switch(cfg.format){
+		case BENCH_CSV:
+			printf("total,%s,%ld,%llu,%.0f,%llu,%llu,%.3f,", t.dir, t.us/1000,
+					(unsigned long long)t.bytes, rate(t), (unsigned long long)t.transfers,
+					(unsigned long long)t.empty, ratio);
+			if(t.checked){ printf("%zu,%zu,%zu,", t.dropped, t.duplicated, t.corrupted); }
+			else{ printf(",,,"); }
+			printf("%llu\n", (unsigned long long)t.allocs);
+			break;
+		case BENCH_JSON:
+			printf("%s\n    {\"dir\": \"%s\", \"ms\": %ld, \"bytes\": %llu, \"rate\": %.0f, "
+					"\"transfers\": %llu, \"empty\": %llu, \"empty_ratio\": %.3f",
+					first?"":",", t.dir, t.us/1000, (unsigned long long)t.bytes, rate(t),
+					(unsigned long long)t.transfers, (unsigned long long)t.empty, ratio);
+			if(t.checked){
+				printf(", \"dropped\": %zu, \"duplicated\": %zu, \"corrupted\": %zu",
+						t.dropped, t.duplicated, t.corrupted);
+			}
+			printf(", \"allocations\": %llu}", (unsigned long long)t.allocs);
+			break;
+		default:
+			printf("%llu bytes %s in %ldms\n", (unsigned long long)t.bytes,
+					strcmp(t.dir, "tx")?"received":"sent", t.us/1000);
+			printf("Average speed: %lf kB/s\n", rate(t)/1000.0);
+			printf("Transfers: %llu, empty: %llu (%.1f%%)\n", (unsigned long long)t.transfers,
+					(unsigned long long)t.empty, 100*ratio);
+			if(t.allocs){
+				printf("FAIL: %llu heap allocations while streaming\n",
+						(unsigned long long)t.allocs);
+			}
+			if(!t.checked){ break; }
+			if(t.dropped || t.duplicated || t.corrupted){
+				printf("Dropped %zu, duplicated %zu, corrupted %zu bytes\n",
+						t.dropped, t.duplicated, t.corrupted);
+			}
+			else{
+				printf("Data OK\n");
+			}
+			break;
+		}
+	}
+
+	const StreamConfig& cfg;
+	std::mutex mutex;
+	bool first=true;
+	std::vector<Total> totals;
+};
+
+void BenchMeter::record(int len, int xfers){
+	bytes+=len;
+	w_bytes+=len;
+	transfers+=xfers;
+	w_transfers+=xfers;
+	auto now=bench_clock::now();
+	if(len==0){
+		empty++;
+		w_empty++;
+	}
+	else{
+		last_data=now;
+	}
+	if(now-window_start>=std::chrono::milliseconds(report->windowMs())){
+		long t_us=std::chrono::duration_cast<std::chrono::microseconds>(now-start).count();
+		report->sample(*this, t_us);
+		window_start=now;
+		w_bytes=w_transfers=w_empty=0;
+	}
+}
+
+// Duration ends with last data, trailing empty polls don't count.
+void BenchMeter::finish(){
+	allocs=heapAllocs()-allocs_mark;
+	end_us=std::chrono::duration_cast<std::chrono::microseconds>(last_data-start).count();
+	if(w_transfers){
+		report->sample(*this, end_us);
+	}
+}
+
+// Writes cfg.size bytes made by fill, one TX_FREE credit at a time.
+static bool streamWrite(USBasp_UART* usbasp, const StreamConfig& cfg, BenchMeter& m,
+		void (*fill)(uint8_t*, size_t, size_t)){
+	uint8_t buff[255];
+	size_t sent=0;
+	while(sent<cfg.size){
+		size_t len=cfg.size-sent;
+		if(len>sizeof(buff)){ len=sizeof(buff); }
+		fill(buff, sent, len);
+		int rv=usbasp_uart_write(usbasp, buff, len);
+		if(rv<0){
+			fprintf(stderr, "Error %d while writing...\n", rv);
+			return false;
+		}
+		m.record(rv, rv?2:1);
+		sent+=rv;
+	}
+	m.finish();
+	return true;
+}
+
+int writeTest(USBasp_UART* usbasp, const StreamConfig& cfg){
+	BenchReport report(cfg, "write");
+	BenchMeter m("tx", &report);
+	if(streamWrite(usbasp, cfg, m, patternFill)){
+		report.total(m, NULL);
+	}
+	return report.finish();
+}
+
+int readTest(USBasp_UART* usbasp, const StreamConfig& cfg){
+	BenchReport report(cfg, "read");
+	BenchMeter m("rx", &report);
+	PatternChecker check;
+	check.sync=true;
+	USBasp_UART_Pool pool;
+	if(usbasp_uart_pool_init(&pool, BENCH_POOL_CHUNKS)!=0){
+		fprintf(stderr, "Cannot allocate chunk pool\n");
+		return -1;
+	}
+	while(check.received<cfg.size){
+		USBasp_UART_Chunk* raw;
+		int rv=usbasp_uart_read_chunk(usbasp, &pool, &raw);
+		USBasp_UART_ChunkPtr chunk(raw);
+		if(rv<0){
+			fprintf(stderr, "Error while reading, rv=%d\n", rv);
+			break;
+		}
+		if(check.received==0){
+			if(rv==0){ continue; } // Time is measured from first byte.
+			m.begin();
+		}
+		m.record(rv, 1);
+		if(chunk){ check.feed(chunk->data, chunk->len); }
+	}
+	m.finish();
+	usbasp_uart_pool_free(&pool);
+	report.total(m, &check);
+	return report.finish();
+}
+
+int duplexTest(USBasp_UART* usbasp, const StreamConfig& cfg){
+	BenchReport report(cfg, "duplex");
+	BenchMeter tx("tx", &report);
+	BenchMeter rx("rx", &report);
+	PatternChecker check;
+	check.counted=true;
+	USBasp_UART_Pool pool;
+	if(usbasp_uart_pool_init(&pool, BENCH_POOL_CHUNKS)!=0){
+		fprintf(stderr, "Cannot allocate chunk pool\n");
+		return -1;
+	}
+	std::atomic<bool> go(false), written(false);
+	tx.allocs_mark=rx.allocs_mark=heapAllocs();
+	std::thread writer([&]{
+		while(!go){ std::this_thread::yield(); }
+		streamWrite(usbasp, cfg, tx, countedFill);
+		written=true;
+	});
+	// Starting the thread allocates, streaming itself should not. The
+	// writer only reads its mark after go.
+	uint64_t spawn=heapAllocs()-rx.allocs_mark;
+	tx.allocs_mark+=spawn;
+	rx.allocs_mark+=spawn;
+	go=true;
+
+	while(check.offset<cfg.size){
+		USBasp_UART_Chunk* raw;
+		int rv=usbasp_uart_read_chunk(usbasp, &pool, &raw);
+		USBasp_UART_ChunkPtr chunk(raw);
+		if(rv<0){
+			fprintf(stderr, "Error while reading, rv=%d\n", rv);
+			break;
+		}
+		rx.record(rv, 1);
+		if(rv==0){
+			// Writer is done and nothing came for a second: the rest is lost.
+			if(written && bench_clock::now()-rx.last_data>std::chrono::seconds(1)){ break; }
+			continue;
+		}
+		check.feed(chunk->data, chunk->len);
+	}
+	rx.finish();
+	writer.join();
+	usbasp_uart_pool_free(&pool);
+	check.end(cfg.size);
+	report.total(tx, NULL);
+	report.total(rx, &check);
+	return report.finish();
+}
+
+// Bits on the wire per byte: start, data, parity and stop bits.
+static int frameBits(int flags){
+	int bits=1+5+((flags&USBASP_UART_BYTES_MASK)>>3);
+	if(flags&USBASP_UART_PARITY_MASK){ bits++; }
+	bits+=(flags&USBASP_UART_STOP_MASK)?2:1;
+	return bits;
+}
+
+struct SweepResult{
+	int baud;
+	int load;
+	double offered; // B/s
+	double tx;      // B/s achieved by writer.
+	double rx;      // B/s achieved by reader.
+	bool tx_error;
+	PatternChecker check;
+};
+
+// Writes cfg.size bytes paced at offered B/s (token bucket), while reading
+// them back on this thread.
+static SweepResult sweepStep(USBasp_UART* usbasp, const SweepConfig& cfg,
+		int baud, int load){
+	SweepResult r;
+	r.baud=baud;
+	r.load=load;
+	r.offered=baud/(double)frameBits(cfg.flags)*load/100.0;
+	r.tx=r.rx=0;
+	r.tx_error=false;
+	r.check.counted=true;
+
+	std::atomic<bool> written(false);
+	long write_us=1;
+	auto start=bench_clock::now();
+	std::thread writer([&]{
+		size_t sent=0;
+		uint8_t buff[254];
+		while(sent<cfg.size){
+			size_t allowed=(size_t)(r.offered*usSince(start)/1000000.0);
+			if(allowed<=sent){
+				usleep(100);
+				continue;
+			}
+			size_t len=allowed-sent;
+			if(len>sizeof(buff)){ len=sizeof(buff); }
+			if(len>cfg.size-sent){ len=cfg.size-sent; }
+			countedFill(buff, sent, len);
+			int rv=usbasp_uart_write(usbasp, buff, len);
+			if(rv<0){
+				r.tx_error=true;
+				break;
+			}
+			sent+=rv;
+		}
+		write_us=usSince(start);
+		written=true;
+	});
+
+	auto last_data=bench_clock::now();
+	while(r.check.offset<cfg.size){
+		uint8_t buff[254];
+		int rv=usbasp_uart_read(usbasp, buff, sizeof(buff));
+		if(rv<0){ break; }
+		if(rv==0){
+			if(written && bench_clock::now()-last_data>std::chrono::milliseconds(500)){
+				break;
+			}
+			continue;
+		}
+		last_data=bench_clock::now();
+		r.check.feed(buff, rv);
+	}
+	long read_us=std::chrono::duration_cast<std::chrono::microseconds>(
+			last_data-start).count();
+	writer.join();
+	r.check.end(cfg.size);
+	r.tx=cfg.size/(write_us/1000000.0);
+	r.rx=r.check.received/(read_us/1000000.0);
+	return r;
+}
+
+static void printResult(const SweepResult& r, BenchFormat format, bool first){
+	const PatternChecker& c=r.check;
+	switch(format){
+	case BENCH_CSV:
+		printf("%d,%d,%.0f,%.0f,%.0f,%zu,%zu,%zu,%zu,%s\n", r.baud, r.load,
+				r.offered, r.tx, r.rx, c.received, c.dropped, c.duplicated,
+				c.corrupted, c.events.empty()?"":std::to_string(c.events[0].offset).c_str());
+		break;
+	case BENCH_JSON:
+		printf("%s\n    {\"baud\": %d, \"load\": %d, \"offered\": %.0f, \"tx\": %.0f, "
+				"\"rx\": %.0f, \"received\": %zu, \"dropped\": %zu, \"duplicated\": %zu, "
+				"\"corrupted\": %zu, \"events\": [", first?"":",", r.baud, r.load,
+				r.offered, r.tx, r.rx, c.received, c.dropped, c.duplicated, c.corrupted);
+		for(size_t i=0; i<c.events.size(); i++){
+			printf("%s{\"offset\": %zu, \"count\": %d}", i?", ":"",
+					c.events[i].offset, c.events[i].count);
+		}
+		printf("]}");
+		break;
+	default:
+		printf("baud %7d load %3d%%: offered %7.0f B/s, tx %7.0f B/s, rx %7.0f B/s",
+				r.baud, r.load, r.offered, r.tx, r.rx);
+		if(c.clean() && !r.tx_error){
+			printf(", OK\n");
+			break;
+		}
+		printf(", dropped %zu, duplicated %zu, corrupted %zu%s\n", c.dropped,
+				c.duplicated, c.corrupted, r.tx_error?", write error":"");
+		for(auto& e : c.events){
+			if(e.count>0){ printf("    %d dropped at %zu\n", e.count, e.offset); }
+			else{ printf("    duplicate at %zu\n", e.offset); }
+		}
+		break;
+	}
+}
+
+static void sweepRun(USBasp_UART* usbasp, const SweepConfig& cfg){
+	double best_tx=0, best_rx=0;
+	int best_tx_baud=0, best_rx_baud=0;
+	bool first=true;
+
+	if(cfg.format==BENCH_CSV){
+		printf("baud,load,offered,tx,rx,received,dropped,duplicated,corrupted,first_loss\n");
+	}
+	else if(cfg.format==BENCH_JSON){
+		printf("{\n  \"steps\": [");
+	}
+	for(int baud : cfg.bauds){
+		int rv=usbasp_uart_config(usbasp, baud, cfg.flags|USBASP_UART_LOOPBACK);
+		if(rv<0){
+			fprintf(stderr, "Error %d while configuring baud %d\n", rv, baud);
+			if(rv==USBASP_NO_CAPS){
+				fprintf(stderr, "USBasp has no UART loopback capability.\n");
+			}
+			return;
+		}
+		for(int load : cfg.loads){
+			usbasp_uart_flushtx(usbasp);
+			usbasp_uart_flushrx(usbasp);
+			SweepResult r=sweepStep(usbasp, cfg, baud, load);
+			printResult(r, cfg.format, first);
+			fflush(stdout);
+			first=false;
+			if(!r.check.clean() || r.tx_error){
+				continue;
+			}
+			if(r.tx>best_tx){ best_tx=r.tx; best_tx_baud=baud; }
+			if(r.rx>best_rx){ best_rx=r.rx; best_rx_baud=baud; }
+		}
+	}
+	switch(cfg.format){
+	case BENCH_CSV:
+		// Summary would break CSV, so it goes to stderr.
+		fprintf(stderr, "Highest loss-free: tx %.0f B/s (baud %d), rx %.0f B/s (baud %d)\n",
+				best_tx, best_tx_baud, best_rx, best_rx_baud);
+		break;
+	case BENCH_JSON:
+		printf("\n  ],\n  \"best\": {\"tx\": %.0f, \"tx_baud\": %d, \"rx\": %.0f, \"rx_baud\": %d}\n}\n",
+				best_tx, best_tx_baud, best_rx, best_rx_baud);
+		break;
+	default:
+		printf("Highest loss-free: tx %.0f B/s (baud %d), rx %.0f B/s (baud %d)\n",
+				best_tx, best_tx_baud, best_rx, best_rx_baud);
+		break;
+	}
+}
+
+// Sweeping leaves loopback on at the last baud, so the configuration
+// found is set again afterwards.
+void sweepTest(USBasp_UART* usbasp, const SweepConfig& cfg){
+	int baud=usbasp->baud, flags=usbasp->flags;
+	sweepRun(usbasp, cfg);
+	int rv=usbasp_uart_config(usbasp, baud, flags);
+	if(rv<0){
+		fprintf(stderr, "Error %d while restoring baud %d after sweep\n", rv, baud);
+	}
+}
+
+static const char* pollName(int mode){
+	switch(mode){
+	case USBASP_POLL_SLEEP: return "sleep";
+	case USBASP_POLL_BACKOFF: return "backoff";
+	default: return "busy";
+	}
+}
+
+struct LatencyResult{
+	PollStrategy poll;
+	int done;
+	int timeouts;
+	std::vector<uint64_t> ns; // Sorted.
+	int hist[32];             // Log2 buckets of microseconds.
+
+	uint64_t pct(double p) const {
+		if(ns.empty()){ return 0; }
+		size_t i=(size_t)(p*(ns.size()-1)+0.5);
+		return ns[i];
+	}
+};
+
+static LatencyResult latencyRun(USBasp_UART* usbasp, const LatencyConfig& cfg,
+		PollStrategy poll){
+	LatencyResult r;
+	r.poll=poll;
+	r.done=0;
+	r.timeouts=0;
+	for(int& h : r.hist){ h=0; }
+	r.ns.reserve(cfg.iterations);
+
+	usbasp_uart_set_poll(usbasp, poll.mode, poll.interval_us);
+	std::vector<uint8_t> out(cfg.frame), in(cfg.frame);
+	size_t offset=0;
+	for(int it=0; it<cfg.iterations; it++){
+		patternFill(out.data(), offset, cfg.frame);
+		offset+=cfg.frame;
+		uint64_t start=usbasp_uart_now_ns();
+		if(usbasp_uart_write_all(usbasp, out.data(), cfg.frame)<0){
+			fprintf(stderr, "Error while writing\n");
+			break;
+		}
+		size_t got=0;
+		while(got<cfg.frame){
+			int rv=usbasp_uart_read_wait(usbasp, in.data()+got, cfg.frame-got, 1000);
+			if(rv<=0){ break; }
+			got+=rv;
+		}
+		uint64_t finish=usbasp_uart_now_ns();
+		if(got<cfg.frame){
+			r.timeouts++;
+			usbasp_uart_flushrx(usbasp);
+			continue;
+		}
+		uint64_t ns=finish-start;
+		r.ns.push_back(ns);
+		int b=0;
+		for(uint64_t us=ns/1000; us>1 && b<31; us>>=1){ b++; }
+		r.hist[b]++;
+		r.done++;
+	}
+	std::sort(r.ns.begin(), r.ns.end());
+	return r;
+}
+
+static void printLatency(const LatencyResult& r, BenchFormat format, bool first){
+	double p50=r.pct(0.5)/1000.0;
+	double p99=r.pct(0.99)/1000.0;
+	double p999=r.pct(0.999)/1000.0;
+	double max=r.ns.empty()?0:r.ns.back()/1000.0;
+	double min=r.ns.empty()?0:r.ns.front()/1000.0;
+	switch(format){
+	case BENCH_CSV:
+		printf("%s,%d,%d,%d,%.1f,%.1f,%.1f,%.1f,%.1f\n", pollName(r.poll.mode),
+				r.poll.interval_us, r.done, r.timeouts, min, p50, p99, p999, max);
+		break;
+	case BENCH_JSON:
+		printf("%s\n    {\"poll\": \"%s\", \"interval_us\": %d, \"done\": %d, "
+				"\"timeouts\": %d, \"min_us\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+				"\"p999_us\": %.1f, \"max_us\": %.1f, \"hist\": [", first?"":",",
+				pollName(r.poll.mode), r.poll.interval_us, r.done, r.timeouts,
+				min, p50, p99, p999, max);
+		for(int i=0; i<32; i++){
+			printf("%s%d", i?", ":"", r.hist[i]);
+		}
+		printf("]}");
+		break;
+	default:
+		printf("Poll %s (%dus): %d round trips, %d timeouts\n", pollName(r.poll.mode),
+				r.poll.interval_us, r.done, r.timeouts);
+		printf("  min %.1fus, p50 %.1fus, p99 %.1fus, p999 %.1fus, max %.1fus\n",
+				min, p50, p99, p999, max);
+		for(int i=0; i<32; i++){
+			if(!r.hist[i]){ continue; }
+			printf("  %8dus-%8dus: %d\n", i?1<<i:0, 2<<i, r.hist[i]);
+		}
+		break;
+	}
+}
+
+void latencyTest(USBasp_UART* usbasp, const LatencyConfig& cfg){
+	if(cfg.format==BENCH_CSV){
+		printf("poll,interval_us,done,timeouts,min_us,p50_us,p99_us,p999_us,max_us\n");
+	}
+	else if(cfg.format==BENCH_JSON){
+		printf("{\n  \"frame\": %zu,\n  \"runs\": [", cfg.frame);
+	}
+	bool first=true;
+	for(auto& poll : cfg.polls){
+		usbasp_uart_flushrx(usbasp);
+		printLatency(latencyRun(usbasp, cfg, poll), cfg.format, first);
+		fflush(stdout);
+		first=false;
+	}
+	if(cfg.format==BENCH_JSON){
+		printf("\n  ]\n}\n");
+	}
+}
+
+static void discard(void*, USBasp_UART_Chunk* chunk){
+	usbasp_uart_chunk_release(chunk);
+}
+
+int jitterTest(USBasp_UART* usbasp, USBasp_Sched* sched, int seconds){
+	USBasp_UART_Pool pool;
+	if(usbasp_uart_pool_init(&pool, BENCH_POOL_CHUNKS)!=0){
+		fprintf(stderr, "Cannot allocate chunk pool\n");
+		return -1;
+	}
+	sched->on_chunk=discard;
+	sched->pool=&pool;
+	if(usbasp_sched_start(sched, usbasp)!=0){
+		fprintf(stderr, "Cannot start scheduler\n");
+		usbasp_uart_pool_free(&pool);
+		return -1;
+	}
+	uint64_t allocs=heapAllocs();
+	std::this_thread::sleep_for(std::chrono::seconds(seconds));
+	allocs=heapAllocs()-allocs;
+	usbasp_sched_stop(sched);
+	// sched is used again after the test, e.g. by -r.
+	sched->on_chunk=NULL;
+	sched->pool=NULL;
+	usbasp_uart_pool_free(&pool);
+	usbasp_sched_print(sched, stdout);
+	if(allocs){
+		printf("FAIL: %llu heap allocations while streaming\n", (unsigned long long)allocs);
+		return -1;
+	}
+	return 0;
+}
+
+static int discardChunk(void*, const uint8_t*, size_t){
+	return 0;
+}
+
+static uint64_t cpuNs(){
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return (uint64_t)(ru.ru_utime.tv_sec+ru.ru_stime.tv_sec)*1000000000+
+			(uint64_t)(ru.ru_utime.tv_usec+ru.ru_stime.tv_usec)*1000;
+}
+
+void fleetTest(const std::vector<USBasp_UART*>& devs, const FleetTestConfig& cfg){
+	if(cfg.format==BENCH_CSV){
+		printf("devices,bytes,rate,rate_per_device,cpu_pct,cpu_pct_per_device,wakeups\n");
+	}
+	else if(cfg.format==BENCH_JSON){
+		printf("{\n  \"seconds\": %d,\n  \"steps\": [", cfg.seconds);
+	}
+	std::vector<size_t> counts;
+	for(size_t n=1; n<devs.size(); n*=2){ counts.push_back(n); }
+	counts.push_back(devs.size());
+	bool first=true;
+	for(size_t n : counts){
+		if(n>USBASP_REACTOR_MAX_DEVS){
+			fprintf(stderr, "Cannot poll more than %d devices from one reactor\n",
+					USBASP_REACTOR_MAX_DEVS);
+			break;
+		}
+		USBasp_Reactor reactor;
+		memset(&reactor, 0, sizeof(reactor));
+		reactor.poll_us=cfg.poll_us;
+		reactor.threads=cfg.threads;
+		std::vector<USBasp_Reactor_Dev> rdevs(n);
+		for(size_t i=0; i<n; i++){
+			memset(&rdevs[i], 0, sizeof(rdevs[i]));
+			rdevs[i].name="fleet";
+			rdevs[i].usbasp=devs[i];
+			rdevs[i].write=discardChunk;
+			usbasp_uart_flushrx(devs[i]);
+			if(usbasp_reactor_add(&reactor, &rdevs[i])!=0){ break; }
+		}
+		if(reactor.count!=(int)n){
+			fprintf(stderr, "Cannot poll device %d, it is not open\n", reactor.count);
+			break;
+		}
+		auto start=bench_clock::now();
+		uint64_t cpu=cpuNs();
+		if(usbasp_reactor_start(&reactor)!=0){
+			fprintf(stderr, "Cannot start reactor\n");
+			break;
+		}
+		std::this_thread::sleep_for(std::chrono::seconds(cfg.seconds));
+		usbasp_reactor_stop(&reactor);
+		double s=usSince(start)/1000000.0;
+		double cpu_pct=100*(cpuNs()-cpu)/1e9/s;
+		uint64_t bytes=0;
+		for(auto& d : rdevs){ bytes+=d.rx_bytes; }
+		double rate=bytes/s;
+		switch(cfg.format){
+		case BENCH_CSV:
+			printf("%zu,%llu,%.0f,%.0f,%.2f,%.3f,%llu\n", n, (unsigned long long)bytes,
+					rate, rate/n, cpu_pct, cpu_pct/n, (unsigned long long)reactor.wakeups);
+			break;
+		case BENCH_JSON:
+			printf("%s\n    {\"devices\": %zu, \"bytes\": %llu, \"rate\": %.0f, "
+					"\"rate_per_device\": %.0f, \"cpu_pct\": %.2f, \"cpu_pct_per_device\": %.3f, "
+					"\"wakeups\": %llu}", first?"":",", n, (unsigned long long)bytes, rate,
+					rate/n, cpu_pct, cpu_pct/n, (unsigned long long)reactor.wakeups);
+			break;
+		default:
+			printf("%3zu devices: %.0f B/s (%.0f B/s each), CPU %.1f%% (%.2f%% per device), "
+					"%llu wakeups\n", n, rate, rate/n, cpu_pct, cpu_pct/n,
+					(unsigned long long)reactor.wakeups);
+			break;
+		}
+		fflush(stdout);
+		first=false;
+	}
+	if(cfg.format==BENCH_JSON){
+		printf("\n  ]\n}\n");
+	}
+}
+
+static uint64_t threadCpuNs(){
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+}
+
+// Kernel-style log, about one line in 500 has ERROR and one in 200 a
+// three digit temperature.
+static std::string logLines(size_t size){
+	static const char* const subsystems[]={"usb", "net", "mmc", "i2c", "spi", "adc"};
+	static const char* const texts[]={"transfer done", "link up", "retry", "queue drained",
+			"sample ready", "irq handled"};
+	std::string s;
+	uint32_t seed=1;
+	for(unsigned n=0; s.size()<size; n++){
+		seed=seed*1103515245+12345;
+		char line[128];
+		int len=snprintf(line, sizeof(line), "[%6u.%06u] %s: %s%s temp=%u\n", n/1000, seed%1000000,
+				subsystems[(seed>>8)%6], texts[(seed>>12)%6], (seed>>16)%500==0?" ERROR":"",
+				(seed>>20)%200==0?100+(seed>>4)%900:(seed>>4)%100);
+		s.append(line, len);
+	}
+	return s;
+}
+
+int filterTest(LineFilter& filter, size_t size, BenchFormat format){
+	std::string log=logLines(1<<20);
+	std::string out;
+	out.reserve(1<<16);
+	// One pass first, so buffers have grown to what lines need.
+	for(size_t at=0; at<log.size(); at+=USBASP_CHUNK_SIZE){
+		out.clear();
+		filter.feed((const uint8_t*)log.data()+at, std::min(log.size()-at, (size_t)USBASP_CHUNK_SIZE), out);
+	}
+	// Literal prefilter must not lose a line plain regexec() would match.
+	uint64_t expected=0;
+	std::string line;
+	for(size_t at=0; at<log.size(); ){
+		size_t end=log.find('\n', at);
+		line.assign(log, at, end-at);
+		expected+=filter.check(line);
+		at=end+1;
+	}
+	if(filter.matched!=expected){
+		fprintf(stderr, "FAIL: filter matched %llu lines, regexec() %llu\n",
+				(unsigned long long)filter.matched, (unsigned long long)expected);
+		return -1;
+	}
+	// The prefilter's regex parsing on its own, whatever -g gave.
+	static const char* const probes[]={"re:temp=[[:digit:]]{3}", "re:[]x] (usb|net): ",
+			"re:[^[:space:]]+ ERROR", "re:[[.-.][=e=]]mp=9"};
+	for(const char* probe : probes){
+		LineFilter f;
+		f.add(probe);
+		for(size_t at=0; at<log.size(); at+=USBASP_CHUNK_SIZE){
+			out.clear();
+			f.feed((const uint8_t*)log.data()+at, std::min(log.size()-at, (size_t)USBASP_CHUNK_SIZE), out);
+		}
+		uint64_t want=0;
+		for(size_t at=0; at<log.size(); ){
+			size_t end=log.find('\n', at);
+			line.assign(log, at, end-at);
+			want+=f.check(line);
+			at=end+1;
+		}
+		if(!want || f.matched!=want){
+			fprintf(stderr, "FAIL: %s matched %llu lines, regexec() %llu\n", probe,
+					(unsigned long long)f.matched, (unsigned long long)want);
+			return -1;
+		}
+	}
+	filter.bytes=filter.candidates=filter.matched=0;
+	size_t done=0;
+	size_t passed=0;
+	uint64_t allocs=heapAllocs();
+	uint64_t cpu=threadCpuNs();
+	auto start=bench_clock::now();
+	while(done<size){
+		for(size_t at=0; at<log.size() && done<size; at+=USBASP_CHUNK_SIZE){
+			size_t len=log.size()-at;
+			if(len>USBASP_CHUNK_SIZE){ len=USBASP_CHUNK_SIZE; }
+			out.clear();
+			filter.feed((const uint8_t*)log.data()+at, len, out);
+			passed+=out.size();
+			done+=len;
+		}
+	}
+	double s=usSince(start)/1000000.0;
+	cpu=threadCpuNs()-cpu;
+	allocs=heapAllocs()-allocs;
+	double mb=done/1e6;
+	double rate=done/s;
+	double cpu_ms=cpu/1e6/mb;
+	// 10 bits per byte on the line, 1.5Mbaud is the most firmware can do.
+	double baud=rate*10;
+	switch(format){
+	case BENCH_CSV:
+		printf("bytes,seconds,rate,cpu_ms_per_mb,candidates,matched,passed,max_baud,allocs\n");
+		printf("%zu,%.3f,%.0f,%.3f,%llu,%llu,%zu,%.0f,%llu\n", done, s, rate, cpu_ms,
+				(unsigned long long)filter.candidates, (unsigned long long)filter.matched,
+				passed, baud, (unsigned long long)allocs);
+		break;
+	case BENCH_JSON:
+		printf("{\"bytes\": %zu, \"seconds\": %.3f, \"rate\": %.0f, \"cpu_ms_per_mb\": %.3f, "
+				"\"candidates\": %llu, \"matched\": %llu, \"passed\": %zu, \"max_baud\": %.0f, "
+				"\"allocs\": %llu}\n", done, s, rate, cpu_ms,
+				(unsigned long long)filter.candidates, (unsigned long long)filter.matched,
+				passed, baud, (unsigned long long)allocs);
+		break;
+	default:
+		printf("Filtered %.1f MB in %.3fs: %.1f MB/s, %.3f ms CPU per MB\n", mb, s, rate/1e6, cpu_ms);
+		printf("Candidate lines %llu, matched %llu, passed %zu bytes\n",
+				(unsigned long long)filter.candidates, (unsigned long long)filter.matched, passed);
+		printf("Keeps up with %.0f baud, %.0fx the 1500000 maximum\n", baud, baud/1500000);
+		if(allocs){
+			printf("FAIL: %llu heap allocations while filtering\n", (unsigned long long)allocs);
+		}
+		break;
+	}
+	return allocs?-1:0;
+}
@@ -0,0 +1,140 @@
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include "usbasp_uart.h"
+#include "usbasp_sched.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Benchmarks talking to a target send cyclic 'a'..'z' pattern, the same
+// one that test MCU in README sends.
+void patternFill(uint8_t* buff, size_t offset, size_t len);
+// Where the host gets its own data back (duplex, sweep), the counted
+// stream is sent instead: bits 7-6 of each byte are its place in a
+// 4-byte word, bits 5-0 a quarter of the word's 24-bit number, so any 4
+// bytes in a row tell their position and the stream repeats only every
+// 64MB.
+void countedFill(uint8_t* buff, size_t offset, size_t len);
+
+// Number of malloc, calloc, realloc and operator new calls so far, made
+// by the program's own objects (not libusb). Streaming benchmarks report
+// how many happened while streaming.
+uint64_t heapAllocs();
+
+struct LossEvent{
+	size_t offset; // Position in sent stream.
+	int count;     // >0: bytes dropped, <0: bytes duplicated.
+};
+
+// Verifies received stream against the pattern, byte by byte. Since
+// the pattern has period of 26, drops are detected modulo 26. A counted
+// stream is checked exactly: after a mismatch the checker waits for a
+// whole word to learn where the stream went on, and reports the gap or
+// repeat at its position in the sent stream.
+struct PatternChecker{
+	size_t offset=0;     // Sent-stream position of next expected byte.
+	size_t received=0;
+	size_t dropped=0;
+	size_t duplicated=0;
+	size_t corrupted=0;
+	size_t max_events=16;
+	bool sync=false;     // Align to first byte (free-running sender).
+	bool counted=false;  // Stream from countedFill().
+	std::vector<LossEvent> events;
+
+	// Reserved up front, so losses don't allocate while streaming.
+	PatternChecker(){ events.reserve(max_events); }
+	void feed(const uint8_t* data, size_t len);
+	// Stream of size bytes was sent, nothing more will come: places bytes
+	// still waiting for a word and reports a lost tail.
+	void end(size_t size);
+	bool clean() const { return dropped==0 && duplicated==0 && corrupted==0; }
+
+private:
+	int last=-1;
+	uint8_t pending[64]; // Counted bytes received since a mismatch.
+	size_t npending=0;
+	void event(size_t at, int count);
+	void feedCounted(uint8_t c);
+	void place(size_t at);
+};
+
+enum BenchFormat{
+	BENCH_TEXT,
+	BENCH_CSV,
+	BENCH_JSON,
+};
+
+struct StreamConfig{
+	size_t size;
+	int window_ms; // Throughput is sampled over windows this long.
+	BenchFormat format;
+};
+
+// Streaming benchmarks. Data is generated and verified chunk by chunk, so
+// memory use does not depend on size. They return -1 when streaming
+// allocated.
+int writeTest(USBasp_UART* usbasp, const StreamConfig& cfg);
+int readTest(USBasp_UART* usbasp, const StreamConfig& cfg);
+// Writes and reads at the same time. Meant to be used with loopback (-L),
+// or with TX wired to RX, so that the same stream comes back.
+int duplexTest(USBasp_UART* usbasp, const StreamConfig& cfg);
+
+struct SweepConfig{
+	std::vector<int> bauds;
+	std::vector<int> loads; // Percent of UART line rate.
+	int flags;              // Parity, bits and stop, loopback is added.
+	size_t size;            // Bytes per step.
+	BenchFormat format;
+};
+
+// Steps through bauds and offered loads using loopback mode, and reports
+// highest loss-free rate per direction. The baud and flags configured
+// before are restored at the end.
+void sweepTest(USBasp_UART* usbasp, const SweepConfig& cfg);
+
+struct PollStrategy{
+	int mode;
+	int interval_us;
+};
+
+struct LatencyConfig{
+	int iterations;
+	size_t frame;                     // Bytes sent per iteration.
+	std::vector<PollStrategy> polls; // Each one is measured in turn.
+	BenchFormat format;
+};
+
+// Sends small frames and waits for them to come back (target echo or
+// loopback), reporting round-trip latency percentiles per poll strategy.
+void latencyTest(USBasp_UART* usbasp, const LatencyConfig& cfg);
+
+// Polls RX on scheduler thread for given time, with whatever priority and
+// pinning sched asks for, and reports gaps between transfers: how quickly
+// host gets to the next poll after each transfer completes. -1 when
+// polling allocated.
+int jitterTest(USBasp_UART* usbasp, USBasp_Sched* sched, int seconds);
+
+struct FleetTestConfig{
+	int seconds;        // Per step.
+	int poll_us;
+	int threads;
+	BenchFormat format;
+};
+
+// Polls 1, 2, 4... of the given configured devices from one reactor
+// thread, data is discarded by sink threads, and reports aggregate
+// throughput and process CPU time per device at every step.
+void fleetTest(const std::vector<USBasp_UART*>& devs, const FleetTestConfig& cfg);
+
+// Feeds size bytes of generated log lines through filter in 254 byte
+// chunks, as they come from RX, and reports throughput, CPU time per MB
+// and the highest baud it keeps up with. No device needed. Fails when
+// the filter's matches differ from regexec() run on every line, or when
+// filtering allocated.
+struct LineFilter;
+int filterTest(LineFilter& filter, size_t size, BenchFormat format);
+
+#endif
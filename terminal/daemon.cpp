@@ -0,0 +1,581 @@
+#include "daemon.h"
+#include "usbasp_ring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct DaemonClient{
+	int fd;
+	std::string in;        // Received, not parsed yet.
+	size_t payload=0;      // Bytes of write command still to come.
+	size_t total=0;        // Length of that write command.
+	int error=0;           // Why its data is being discarded, see writeError().
+	bool waiting=false;    // Payload did not fit TX queue, not read meanwhile.
+};
+
+enum{ WRITE_OK, WRITE_BUSY, WRITE_SUSPENDED, WRITE_FAILED };
+
+struct Daemon{
+	USBasp_UART* usbasp;
+	USBasp_Sched* sched;
+	DaemonConfig config;
+	USBasp_Ring* ring;
+	std::string ring_name;
+	size_t ring_bytes;
+	int ep;
+	int wake;              // eventfd, signalled when TX queue has room.
+	std::vector<DaemonClient*> clients;
+	DaemonClient* session=NULL;  // Client holding programming session.
+	bool suspended=false;
+	int baud;
+	int flags;
+};
+
+// Called on scheduler thread, the only writer of the ring.
+static void daemonRx(void* ctx, const uint8_t* data, int len){
+	usbasp_ring_write(((Daemon*)ctx)->ring, data, len);
+}
+
+// Called on scheduler thread when waiting payloads may fit.
+static void daemonTxRoom(void* ctx){
+	uint64_t one=1;
+	if(write(((Daemon*)ctx)->wake, &one, sizeof(one))<0){}
+}
+
+// Replies are short, so they go out at once or not at all.
+static void reply(DaemonClient* c, const char* fmt, ...){
+	char line[320];
+	va_list ap;
+	va_start(ap, fmt);
+	int n=vsnprintf(line, sizeof(line)-1, fmt, ap);
+	va_end(ap);
+	if(n<0){ return; }
+	if(n>(int)sizeof(line)-2){ n=sizeof(line)-2; }
+	line[n++]='\n';
+	if(send(c->fd, line, n, MSG_NOSIGNAL)<0){}
+}
+
+static void setState(Daemon* d, uint32_t state){
+	__atomic_store_n(&d->ring->state, state, __ATOMIC_RELEASE);
+	usbasp_ring_wake(d->ring);
+}
+
+// Firmware disables UART on ISP connect anyway; closing the device lets
+// the programmer open it.
+static void suspendUart(Daemon* d){
+	usbasp_sched_drain(d->sched);
+	usbasp_sched_stop(d->sched);
+	usbasp_uart_suspend(d->usbasp);
+	d->suspended=true;
+	setState(d, USBASP_RING_SUSPENDED);
+	daemonTxRoom(d);  // Waiting payloads are discarded now.
+	if(verbose){
+		fprintf(stderr, "UART suspended for programming\n");
+	}
+}
+
+static int resumeUart(Daemon* d){
+	int rv=usbasp_uart_resume(d->usbasp);
+	if(rv<0){
+		fprintf(stderr, "Cannot resume UART: rv=%d\n", rv);
+		return rv;
+	}
+	if(usbasp_sched_start(d->sched, d->usbasp)!=0){
+		fprintf(stderr, "Cannot start scheduler\n");
+		return -1;
+	}
+	d->suspended=false;
+	setState(d, USBASP_RING_RUNNING);
+	if(verbose){
+		fprintf(stderr, "UART resumed\n");
+	}
+	return 0;
+}
+
+static const char* writeError(int error){
+	switch(error){
+	case WRITE_BUSY:      return "busy";
+	case WRITE_SUSPENDED: return "suspended";
+	default:              return "failed";
+	}
+}
+
+// Others may only read the ring while a client holds a session.
+static bool allowed(Daemon* d, DaemonClient* c){
+	if(d->session && d->session!=c){
+		reply(c, "err busy");
+		return false;
+	}
+	if(d->suspended){
+		reply(c, "err suspended");
+		return false;
+	}
+	return true;
+}
+
+static void command(Daemon* d, DaemonClient* c, const std::string& line){
+	char cmd[16]="";
+	char arg[16]="";
+	sscanf(line.c_str(), "%15s %15s", cmd, arg);
+	std::string name=cmd;
+	if(name=="ring"){
+		reply(c, "ok %s %u %llu", d->ring_name.c_str(), d->ring->size,
+				(unsigned long long)__atomic_load_n(&d->ring->head, __ATOMIC_ACQUIRE));
+	}
+	else if(name=="write"){
+		c->total=c->payload=strtoul(arg, NULL, 10);
+		c->error=WRITE_OK;
+		if(d->session && d->session!=c){ c->error=WRITE_BUSY; }
+		else if(d->suspended){ c->error=WRITE_SUSPENDED; }
+		if(!c->payload){
+			reply(c, "ok 0");
+		}
+	}
+	else if(name=="config"){
+		int baud=0, flags=0;
+		if(sscanf(line.c_str(), "config %d %d", &baud, &flags)!=2 || baud<=0){
+			reply(c, "err usage: config BAUD FLAGS");
+			return;
+		}
+		if(!allowed(d, c)){ return; }
+		usbasp_sched_drain(d->sched);
+		int rv=usbasp_sched_config(d->sched, baud, flags);
+		if(rv<0){
+			reply(c, "err %d", rv);
+			return;
+		}
+		d->baud=baud;
+		d->flags=flags;
+		reply(c, "ok %d %d", baud, flags);
+	}
+	else if(name=="flush"){
+		if(!allowed(d, c)){ return; }
+		std::string what=arg;
+		if(what=="rx"){ usbasp_sched_flushrx(d->sched); }
+		else if(what=="tx"){ usbasp_sched_flushtx(d->sched); }
+		else{
+			reply(c, "err usage: flush rx|tx");
+			return;
+		}
+		reply(c, "ok");
+	}
+	else if(name=="program"){
+		if(d->session && d->session!=c){
+			reply(c, "err busy");
+			return;
+		}
+		if(!d->suspended){
+			suspendUart(d);
+		}
+		d->session=c;
+		reply(c, "ok");
+	}
+	else if(name=="resume"){
+		if(d->session && d->session!=c){
+			reply(c, "err busy");
+			return;
+		}
+		d->session=NULL;
+		if(d->suspended && resumeUart(d)<0){
+			reply(c, "err cannot reopen device");
+			return;
+		}
+		reply(c, "ok");
+	}
+	else{
+		reply(c, "err unknown command %s", cmd);
+	}
+}
+
+static void setEvents(Daemon* d, DaemonClient* c){
+	struct epoll_event ev;
+	ev.events=0;
+	if(!c->waiting){ ev.events|=EPOLLIN; }
+	ev.data.ptr=c;
+	epoll_ctl(d->ep, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+// Write payloads go to scheduler as they come, anything else is parsed
+// as lines. A payload is queued without blocking the loop: until the
+// rest of it fits, it stays in c->in and the client isn't read, so
+// socket flow control holds it back. Returns <0 when scheduler failed.
+static int parseClient(Daemon* d, DaemonClient* c){
+	size_t at=0;
+	int rv=0;
+	bool waited=c->waiting;
+	c->waiting=false;
+	while(at<c->in.size()){
+		if(c->payload){
+			size_t n=std::min(c->payload, c->in.size()-at);
+			// A session may have started while the payload waited.
+			if(c->error==WRITE_OK && d->session && d->session!=c){ c->error=WRITE_BUSY; }
+			else if(c->error==WRITE_OK && d->suspended){ c->error=WRITE_SUSPENDED; }
+			if(c->error==WRITE_OK){
+				rv=usbasp_sched_try_write(d->sched, (const uint8_t*)c->in.data()+at, n);
+				if(rv<0){ c->error=WRITE_FAILED; }
+				else if((size_t)rv<n){
+					c->payload-=rv;
+					at+=rv;
+					c->waiting=true;
+					break;
+				}
+			}
+			c->payload-=n;
+			at+=n;
+			if(!c->payload){
+				if(c->error==WRITE_OK){ reply(c, "ok %zu", c->total); }
+				else{ reply(c, "err %s", writeError(c->error)); }
+			}
+			continue;
+		}
+		size_t end=c->in.find('\n', at);
+		if(end==std::string::npos){ break; }
+		command(d, c, c->in.substr(at, end-at));
+		at=end+1;
+	}
+	c->in.erase(0, at);
+	if(c->waiting!=waited){ setEvents(d, c); }
+	return rv<0?rv:0;
+}
+
+static void dropClient(Daemon* d, DaemonClient* c){
+	epoll_ctl(d->ep, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	d->clients.erase(std::find(d->clients.begin(), d->clients.end(), c));
+	// A programmer that died must not keep UART down.
+	if(d->session==c){
+		d->session=NULL;
+		resumeUart(d);
+	}
+	delete c;
+}
+
+static void acceptClient(Daemon* d, int listener){
+	int fd=accept(listener, NULL, NULL);
+	if(fd<0){ return; }
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL)|O_NONBLOCK);
+	DaemonClient* c=new DaemonClient();
+	c->fd=fd;
+	struct epoll_event ev;
+	ev.events=EPOLLIN;
+	ev.data.ptr=c;
+	epoll_ctl(d->ep, EPOLL_CTL_ADD, fd, &ev);
+	d->clients.push_back(c);
+	if(verbose){
+		fprintf(stderr, "Client %d connected\n", fd);
+	}
+}
+
+static int readClient(Daemon* d, DaemonClient* c, uint32_t events){
+	if(c->waiting){
+		// Not polled for input meanwhile, so it hung up.
+		if(events & (EPOLLHUP|EPOLLERR)){ dropClient(d, c); }
+		return 0;
+	}
+	char buff[4096];
+	int len=recv(c->fd, buff, sizeof(buff), 0);
+	if(len==0 || (len<0 && errno!=EAGAIN && errno!=EINTR)){
+		dropClient(d, c);
+		return 0;
+	}
+	if(len<0){ return 0; }
+	c->in.append(buff, len);
+	return parseClient(d, c);
+}
+
+// Ring name follows socket path, so one left by a killed daemon is
+// replaced next time.
+static bool createRing(Daemon* d){
+	std::string name="/usbasp-uart";
+	for(const char* p=d->config.socket; *p; p++){
+		name+=*p=='/'?'-':*p;
+	}
+	d->ring_name=name.substr(0, 250);
+	size_t size=4096;
+	while(size<d->config.ring_size){ size*=2; }
+	d->ring_bytes=USBASP_RING_HEADER+size;
+	shm_unlink(d->ring_name.c_str());
+	int fd=shm_open(d->ring_name.c_str(), O_RDWR|O_CREAT|O_EXCL, 0644);
+	if(fd<0 || ftruncate(fd, d->ring_bytes)!=0){
+		fprintf(stderr, "Cannot create shared memory %s: %s\n", d->ring_name.c_str(), strerror(errno));
+		if(fd>=0){ close(fd); }
+		return false;
+	}
+	void* map=mmap(NULL, d->ring_bytes, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map==MAP_FAILED){
+		shm_unlink(d->ring_name.c_str());
+		return false;
+	}
+	// Touch it now, so pages aren't faulted in on the scheduler thread.
+	memset(map, 0, d->ring_bytes);
+	d->ring=(USBasp_Ring*)map;
+	usbasp_ring_init(d->ring, size);
+	return true;
+}
+
+int serveDaemon(USBasp_UART* usbasp, USBasp_Sched* sched, const DaemonConfig& config){
+	Daemon d;
+	d.usbasp=usbasp;
+	d.sched=sched;
+	d.config=config;
+	d.baud=config.baud;
+	d.flags=config.flags;
+	if(!createRing(&d)){
+		return -1;
+	}
+
+	int listener=socket(AF_UNIX, SOCK_STREAM, 0);
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family=AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", config.socket);
+	unlink(config.socket);
+	if(bind(listener, (struct sockaddr*)&addr, sizeof(addr))!=0 || listen(listener, 16)!=0){
+		fprintf(stderr, "Cannot listen on %s: %s\n", config.socket, strerror(errno));
+		close(listener);
+		munmap(d.ring, d.ring_bytes);
+		shm_unlink(d.ring_name.c_str());
+		return -1;
+	}
+	fprintf(stderr, "UART is available at %s, received data in %s\n",
+			config.socket, d.ring_name.c_str());
+
+	// Blocked before scheduler thread starts, so it inherits the mask and
+	// signals come only through signalfd.
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	int sigfd=signalfd(-1, &set, SFD_NONBLOCK);
+
+	d.ep=epoll_create1(0);
+	d.wake=eventfd(0, EFD_NONBLOCK);
+	struct epoll_event ev;
+	ev.events=EPOLLIN;
+	ev.data.ptr=&listener;
+	epoll_ctl(d.ep, EPOLL_CTL_ADD, listener, &ev);
+	ev.data.ptr=&sigfd;
+	epoll_ctl(d.ep, EPOLL_CTL_ADD, sigfd, &ev);
+	ev.data.ptr=&d.wake;
+	epoll_ctl(d.ep, EPOLL_CTL_ADD, d.wake, &ev);
+
+	sched->on_rx=daemonRx;
+	sched->on_tx_room=daemonTxRoom;
+	sched->ctx=&d;
+	int rv=0;
+	if(usbasp_sched_start(sched, usbasp)!=0){
+		fprintf(stderr, "Cannot start scheduler\n");
+		rv=-1;
+	}
+	bool quit=false;
+	struct epoll_event events[16];
+	while(!quit && rv>=0 && (d.suspended || sched->running)){
+		int n=epoll_wait(d.ep, events, 16, 200);
+		if(n<0 && errno!=EINTR){ break; }
+		for(int i=0; i<n && rv>=0; i++){
+			void* ptr=events[i].data.ptr;
+			if(ptr==&listener){
+				acceptClient(&d, listener);
+			}
+			else if(ptr==&sigfd){
+				quit=true;
+			}
+			else if(ptr==&d.wake){
+				uint64_t count;
+				if(read(d.wake, &count, sizeof(count))<0){}
+				for(size_t k=0; k<d.clients.size() && rv>=0; k++){
+					if(d.clients[k]->waiting){ rv=parseClient(&d, d.clients[k]); }
+				}
+			}
+			else{
+				rv=readClient(&d, (DaemonClient*)ptr, events[i].events);
+			}
+		}
+	}
+	if(rv>=0 && !quit && !sched->running){
+		rv=usbasp_sched_wait(sched);
+	}
+	usbasp_sched_stop(sched);
+	setState(&d, USBASP_RING_CLOSED);
+	while(!d.clients.empty()){
+		DaemonClient* c=d.clients.back();
+		d.clients.pop_back();
+		close(c->fd);
+		delete c;
+	}
+	close(d.ep);
+	close(d.wake);
+	close(sigfd);
+	close(listener);
+	unlink(config.socket);
+	munmap(d.ring, d.ring_bytes);
+	shm_unlink(d.ring_name.c_str());
+	return rv;
+}
+
+static bool sendAll(int fd, const void* data, size_t len){
+	const char* p=(const char*)data;
+	while(len){
+		int rv=send(fd, p, len, MSG_NOSIGNAL);
+		if(rv<0 && errno==EINTR){ continue; }
+		if(rv<=0){ return false; }
+		p+=rv;
+		len-=rv;
+	}
+	return true;
+}
+
+static bool readLine(int fd, std::string& line){
+	line.clear();
+	char ch;
+	while(1){
+		int rv=recv(fd, &ch, 1, 0);
+		if(rv<0 && errno==EINTR){ continue; }
+		if(rv<=0){ return false; }
+		if(ch=='\n'){ return true; }
+		line+=ch;
+	}
+}
+
+// Sends command, returns whether daemon answered ok.
+static bool request(int fd, const std::string& cmd, std::string& answer){
+	std::string line=cmd+"\n";
+	if(!sendAll(fd, line.data(), line.size()) || !readLine(fd, answer)){
+		answer="daemon gone";
+		return false;
+	}
+	return !answer.compare(0, 2, "ok");
+}
+
+// Runs on its own thread, the only one talking over the socket after setup.
+static void clientWriter(int fd){
+	char buff[4096];
+	while(1){
+		int n=read(STDIN_FILENO, buff, sizeof(buff));
+		if(n<0 && errno==EINTR){ continue; }
+		if(n<=0){ return; }
+		char head[32];
+		int len=snprintf(head, sizeof(head), "write %d\n", n);
+		std::string answer;
+		if(!sendAll(fd, head, len) || !sendAll(fd, buff, n) || !readLine(fd, answer)){
+			return;
+		}
+		if(answer.compare(0, 2, "ok")){
+			fprintf(stderr, "write: %s\n", answer.c_str());
+		}
+	}
+}
+
+int runClient(const ClientConfig& config){
+	int fd=socket(AF_UNIX, SOCK_STREAM, 0);
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family=AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", config.socket);
+	if(connect(fd, (struct sockaddr*)&addr, sizeof(addr))!=0){
+		fprintf(stderr, "Cannot connect to %s: %s\n", config.socket, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	std::string answer;
+	if(config.program){
+		if(!request(fd, "program", answer)){
+			fprintf(stderr, "Cannot start programming session: %s\n", answer.c_str());
+			close(fd);
+			return -1;
+		}
+		int status=system(config.program);
+		if(!request(fd, "resume", answer)){
+			fprintf(stderr, "Cannot resume UART: %s\n", answer.c_str());
+		}
+		close(fd);
+		return WIFEXITED(status)?WEXITSTATUS(status):-1;
+	}
+
+	char name[256];
+	unsigned size=0;
+	unsigned long long head=0;
+	if(!request(fd, "ring", answer) ||
+			sscanf(answer.c_str(), "ok %255s %u %llu", name, &size, &head)!=3){
+		fprintf(stderr, "Bad answer from daemon: %s\n", answer.c_str());
+		close(fd);
+		return -1;
+	}
+	int shm=shm_open(name, O_RDONLY, 0);
+	size_t bytes=USBASP_RING_HEADER+size;
+	void* map=shm<0?MAP_FAILED:mmap(NULL, bytes, PROT_READ, MAP_SHARED, shm, 0);
+	if(shm>=0){ close(shm); }
+	if(map==MAP_FAILED){
+		fprintf(stderr, "Cannot map %s: %s\n", name, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	const USBasp_Ring* ring=(const USBasp_Ring*)map;
+	if(ring->magic!=USBASP_RING_MAGIC || ring->size!=size){
+		fprintf(stderr, "%s is not a USBasp ring\n", name);
+		munmap(map, bytes);
+		close(fd);
+		return -1;
+	}
+	std::thread(clientWriter, fd).detach();
+
+	// Data is copied out of shared memory and only written once the
+	// copy is known intact, as the daemon may overwrite it any time.
+	uint64_t pos=head;
+	uint64_t lost_total=0;
+	static uint8_t copy[64*1024];
+	while(1){
+		const uint8_t* data;
+		uint64_t lost;
+		size_t n=usbasp_ring_peek(ring, &pos, &data, &lost);
+		lost_total+=lost;
+		if(n){
+			if(n>sizeof(copy)){ n=sizeof(copy); }
+			memcpy(copy, data, n);
+			if(!usbasp_ring_intact(ring, pos)){
+				lost_total+=n;
+				pos+=n;
+				continue;
+			}
+			for(size_t done=0; done<n; ){
+				int rv=write(STDOUT_FILENO, copy+done, n-done);
+				if(rv<0 && errno==EINTR){ continue; }
+				if(rv<=0){ n=0; break; }
+				done+=rv;
+			}
+			if(!n){ break; }
+			pos+=n;
+			continue;
+		}
+		if(__atomic_load_n(&ring->state, __ATOMIC_ACQUIRE)==USBASP_RING_CLOSED){
+			break;
+		}
+		usbasp_ring_wait(ring, pos, 200);
+	}
+	if(lost_total){
+		fprintf(stderr, "Note: %llu received bytes lost or overwritten, reader was too slow\n",
+				(unsigned long long)lost_total);
+	}
+	munmap(map, bytes);
+	close(fd);
+	return 0;
+}
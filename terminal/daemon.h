@@ -0,0 +1,38 @@
+#ifndef DAEMON_H_
+#define DAEMON_H_
+
+#include "usbasp_uart.h"
+#include "usbasp_sched.h"
+
+struct DaemonConfig{
+	const char* socket;        // Unix socket path.
+	int baud;
+	int flags;                 // usbasp_uart_config() flags in effect.
+	size_t ring_size=1<<20;    // Shared RX ring, power of two.
+};
+
+// Owns the device for other processes until scheduler fails or SIGINT or
+// SIGTERM comes. Received data goes to a shared memory ring (see
+// usbasp_ring.h) that clients map and read from. Clients send
+// line commands over the Unix socket, each answered by "ok ..." or
+// "err ...":
+//   ring              name, size and current head of the ring
+//   write N           followed by N bytes to send
+//   config BAUD FLAGS reconfigure UART
+//   flush rx|tx
+//   program           stop UART and close the device, so a programmer can
+//                     use it; only this client may talk until it says
+//   resume            or disconnects, then UART goes on as configured.
+int serveDaemon(USBasp_UART* usbasp, USBasp_Sched* sched, const DaemonConfig& config);
+
+struct ClientConfig{
+	const char* socket;
+	const char* program=NULL;  // Command run in a programming session.
+};
+
+// Without program, copies ring to stdout and stdin to UART until daemon
+// quits. With program, runs it in a programming session and returns its
+// exit status.
+int runClient(const ClientConfig& config);
+
+#endif
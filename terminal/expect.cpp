@@ -0,0 +1,464 @@
+#include "expect.h"
+#include "usbasp_nb.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#define EXPECT_BUFFER (64*1024)  // Unmatched data kept between expects.
+
+enum StepKind{ STEP_SEND, STEP_EXPECT, STEP_TIMEOUT, STEP_SLEEP, STEP_GOTO, STEP_LOG, STEP_EXIT };
+
+struct Step{
+	StepKind kind;
+	int line;
+	std::string text;
+	std::vector<std::string> patterns;
+	std::vector<std::string> labels;  // Per pattern, empty goes on.
+	std::vector<int> targets;
+	std::string label;                // Of goto, or expect timing out.
+	int target=-1;
+	int value=0;                      // Milliseconds or exit code.
+};
+
+// Aho-Corasick automaton over the patterns of one expect, as a full
+// transition table, so every byte costs one lookup. State is kept
+// between calls, so matches spanning chunks are found. While in the root
+// state, bytes that cannot start any pattern are skipped with memchr()
+// (one possible first byte) or a table scan.
+class MultiMatcher{
+public:
+	explicit MultiMatcher(const std::vector<std::string>& patterns){
+		nodes_.push_back(Node());
+		for(size_t i=0; i<patterns.size(); i++){
+			int s=0;
+			for(unsigned char c : patterns[i]){
+				if(!nodes_[s].next[c]){
+					nodes_[s].next[c]=nodes_.size();
+					nodes_.push_back(Node());
+				}
+				s=nodes_[s].next[c];
+			}
+			if(nodes_[s].out<0){ nodes_[s].out=i; }
+			first_[(unsigned char)patterns[i][0]]=1;
+		}
+		// Breadth first, so fail links point at finished states.
+		std::deque<int> queue;
+		for(int c=0; c<256; c++){
+			if(nodes_[0].next[c]){ queue.push_back(nodes_[0].next[c]); }
+		}
+		while(!queue.empty()){
+			int s=queue.front();
+			queue.pop_front();
+			int f=nodes_[s].fail;
+			if(nodes_[f].out>=0 && (nodes_[s].out<0 || nodes_[f].out<nodes_[s].out)){
+				nodes_[s].out=nodes_[f].out;
+			}
+			for(int c=0; c<256; c++){
+				int t=nodes_[s].next[c];
+				if(t){
+					nodes_[t].fail=nodes_[f].next[c];
+					queue.push_back(t);
+				}
+				else{
+					nodes_[s].next[c]=nodes_[f].next[c];
+				}
+			}
+		}
+		for(int c=0; c<256; c++){
+			if(first_[c]){
+				firsts_++;
+				only_=c;
+			}
+		}
+	}
+
+	// Scans data from where the last call stopped. Returns bytes consumed
+	// up to the end of the first match and its pattern in *which, or all
+	// of len with *which=-1.
+	size_t feed(const uint8_t* data, size_t len, int* which){
+		size_t i=0;
+		while(i<len){
+			if(state_==0){
+				if(firsts_==1){
+					const void* at=memchr(data+i, only_, len-i);
+					if(!at){ break; }
+					i=(const uint8_t*)at-data;
+				}
+				else{
+					while(i<len && !first_[data[i]]){ i++; }
+					if(i==len){ break; }
+				}
+			}
+			state_=nodes_[state_].next[data[i++]];
+			if(nodes_[state_].out>=0){
+				*which=nodes_[state_].out;
+				state_=0;
+				return i;
+			}
+		}
+		*which=-1;
+		return len;
+	}
+
+private:
+	struct Node{
+		int next[256];
+		int fail=0;
+		int out=-1;  // Lowest pattern ending here.
+		Node(){ memset(next, 0, sizeof(next)); }
+	};
+	std::vector<Node> nodes_;
+	uint8_t first_[256]={};
+	int firsts_=0;
+	int only_=0;
+	int state_=0;
+};
+
+// Splits a line into words and quoted strings, with escapes resolved.
+// Quoted ones are marked by a leading '"'.
+static bool tokenize(const std::string& line, std::vector<std::string>& out){
+	size_t i=0;
+	while(i<line.size()){
+		if(isspace((unsigned char)line[i])){
+			i++;
+			continue;
+		}
+		if(line[i]=='#'){ break; }
+		if(line[i]!='"'){
+			size_t end=i;
+			while(end<line.size() && !isspace((unsigned char)line[end])){ end++; }
+			out.push_back(line.substr(i, end-i));
+			i=end;
+			continue;
+		}
+		std::string s="\"";
+		for(i++; i<line.size() && line[i]!='"'; i++){
+			if(line[i]!='\\' || i+1==line.size()){
+				s+=line[i];
+				continue;
+			}
+			char c=line[++i];
+			switch(c){
+			case 'r': s+='\r'; break;
+			case 'n': s+='\n'; break;
+			case 't': s+='\t'; break;
+			case 'e': s+='\x1b'; break;
+			case 'x':
+				if(i+2<line.size() && isxdigit((unsigned char)line[i+1]) && isxdigit((unsigned char)line[i+2])){
+					s+=(char)strtol(line.substr(i+1, 2).c_str(), NULL, 16);
+					i+=2;
+					break;
+				}
+				return false;
+			default: s+=c; break;
+			}
+		}
+		if(i==line.size()){ return false; }
+		out.push_back(s);
+		i++;
+	}
+	return true;
+}
+
+static bool quoted(const std::string& s){ return !s.empty() && s[0]=='"'; }
+
+static int parseMs(const std::string& s){
+	return (int)(atof(s.c_str())*1000);
+}
+
+static bool parseScript(FILE* f, std::vector<Step>& steps){
+	std::map<std::string, int> labels;
+	char buff[4096];
+	int line=0;
+	while(fgets(buff, sizeof(buff), f)){
+		line++;
+		std::vector<std::string> t;
+		if(!tokenize(buff, t)){
+			fprintf(stderr, "script:%d: unterminated string or bad escape\n", line);
+			return false;
+		}
+		if(t.empty()){ continue; }
+		Step step;
+		step.line=line;
+		const std::string& cmd=t[0];
+		bool ok=true;
+		if(t.size()==1 && cmd.size()>1 && cmd.back()==':'){
+			labels[cmd.substr(0, cmd.size()-1)]=steps.size();
+			continue;
+		}
+		else if((cmd=="send" || cmd=="log") && t.size()==2 && quoted(t[1])){
+			step.kind=cmd=="send"?STEP_SEND:STEP_LOG;
+			step.text=t[1].substr(1);
+		}
+		else if(cmd=="expect"){
+			step.kind=STEP_EXPECT;
+			for(size_t i=1; i<t.size() && ok; i++){
+				if(quoted(t[i]) && t[i].size()>1){
+					step.patterns.push_back(t[i].substr(1));
+					step.labels.push_back("");
+				}
+				else if(t[i]=="->" && i+1<t.size() && !step.patterns.empty()){
+					step.labels.back()=t[++i];
+				}
+				else if(t[i]=="timeout" && i+2<t.size() && t[i+1]=="->"){
+					step.label=t[i+2];
+					i+=2;
+				}
+				else{
+					ok=false;
+				}
+			}
+			ok=ok && !step.patterns.empty();
+		}
+		else if((cmd=="timeout" || cmd=="sleep") && t.size()==2){
+			step.kind=cmd=="timeout"?STEP_TIMEOUT:STEP_SLEEP;
+			step.value=parseMs(t[1]);
+		}
+		else if(cmd=="goto" && t.size()==2){
+			step.kind=STEP_GOTO;
+			step.label=t[1];
+		}
+		else if(cmd=="exit" && t.size()<=2){
+			step.kind=STEP_EXIT;
+			step.value=t.size()==2?atoi(t[1].c_str()):0;
+		}
+		else{
+			ok=false;
+		}
+		if(!ok){
+			fprintf(stderr, "script:%d: cannot parse \"%s\"\n", line, cmd.c_str());
+			return false;
+		}
+		steps.push_back(step);
+	}
+	for(Step& step : steps){
+		std::vector<std::string> names=step.labels;
+		names.push_back(step.label);
+		for(size_t i=0; i<names.size(); i++){
+			int target=-1;
+			if(!names[i].empty()){
+				if(!labels.count(names[i])){
+					fprintf(stderr, "script:%d: no label %s\n", step.line, names[i].c_str());
+					return false;
+				}
+				target=labels[names[i]];
+			}
+			if(i<step.labels.size()){ step.targets.push_back(target); }
+			else{ step.target=target; }
+		}
+	}
+	return true;
+}
+
+struct Session{
+	USBasp_UART* usbasp;
+	ExpectConfig config;
+	std::string pending;           // Received, not consumed by a match yet.
+	uint64_t base=0;               // Stream offset of pending[0].
+	// Stream offset and arrival time of every read still in pending.
+	std::deque<std::pair<uint64_t, uint64_t> > arrivals;
+	uint64_t dropped=0;
+};
+
+static uint64_t arrival(const Session& s, uint64_t offset){
+	uint64_t ns=0;
+	for(const auto& a : s.arrivals){
+		if(a.first>offset){ break; }
+		ns=a.second;
+	}
+	return ns;
+}
+
+static void consume(Session& s, size_t len){
+	s.pending.erase(0, len);
+	s.base+=len;
+	while(s.arrivals.size()>1 && s.arrivals[1].first<=s.base){
+		s.arrivals.pop_front();
+	}
+}
+
+// Waits for the handle until deadline, queueing what arrives. Returns
+// bytes received, 0 on deadline, <0 on device error.
+static int receive(Session& s, uint64_t deadline_ns){
+	uint8_t buff[USBASP_NB_QUEUE];
+	while(1){
+		int rv=usbasp_uart_try_read(s.usbasp, buff, sizeof(buff));
+		if(rv<0){ return rv; }
+		if(rv>0){
+			uint64_t now=usbasp_uart_now_ns();
+			if(s.config.echo && write(STDOUT_FILENO, buff, rv)<0){}
+			s.arrivals.push_back(std::make_pair(s.base+s.pending.size(), now));
+			s.pending.append((const char*)buff, rv);
+			if(s.pending.size()>EXPECT_BUFFER){
+				size_t drop=s.pending.size()-EXPECT_BUFFER;
+				s.dropped+=drop;
+				consume(s, drop);
+			}
+			return rv;
+		}
+		uint64_t now=usbasp_uart_now_ns();
+		if(now>=deadline_ns){ return 0; }
+		struct pollfd pfd;
+		pfd.fd=usbasp_uart_nb_fd(s.usbasp);
+		pfd.events=POLLIN;
+		uint64_t left_ms=(deadline_ns-now+999999)/1000000;
+		if(poll(&pfd, 1, left_ms>INT32_MAX?-1:(int)left_ms)<0 && errno!=EINTR){
+			return -errno;
+		}
+		if(pfd.revents && (rv=usbasp_uart_nb_dispatch(s.usbasp))<0){
+			return rv;
+		}
+	}
+}
+
+// Queues all of text, receiving meanwhile if TX queue is full.
+static int send(Session& s, const std::string& text){
+	size_t done=0;
+	while(done<text.size()){
+		int rv=usbasp_uart_try_write(s.usbasp, (const uint8_t*)text.data()+done, text.size()-done);
+		if(rv<0){ return rv; }
+		done+=rv;
+		if(done<text.size() && (rv=receive(s, usbasp_uart_now_ns()+1000000))<0){
+			return rv;
+		}
+	}
+	return 0;
+}
+
+static std::string printable(const std::string& s){
+	std::string out;
+	for(unsigned char c : s){
+		char tmp[8];
+		if(c=='\r'){ out+="\\r"; }
+		else if(c=='\n'){ out+="\\n"; }
+		else if(c<32 || c>126){
+			snprintf(tmp, sizeof(tmp), "\\x%02x", c);
+			out+=tmp;
+		}
+		else{ out+=c; }
+	}
+	return out;
+}
+
+// Returns index of the pattern found, -1 on timeout, or device error.
+static int expect(Session& s, const Step& step, int timeout_ms, uint64_t sent_ns, int* error){
+	MultiMatcher matcher(step.patterns);
+	uint64_t start=usbasp_uart_now_ns();
+	uint64_t deadline=start+(uint64_t)timeout_ms*1000000;
+	uint64_t scanned_to=s.base;  // Stream offset, pending may lose its oldest bytes.
+	*error=0;
+	while(1){
+		int which;
+		size_t scanned=scanned_to>s.base?scanned_to-s.base:0;
+		scanned+=matcher.feed((const uint8_t*)s.pending.data()+scanned, s.pending.size()-scanned, &which);
+		scanned_to=s.base+scanned;
+		if(which>=0){
+			uint64_t now=usbasp_uart_now_ns();
+			uint64_t first=arrival(s, s.base+scanned-step.patterns[which].size());
+			fprintf(stderr, "Matched \"%s\" after %.2fms", printable(step.patterns[which]).c_str(),
+					(now-start)/1e6);
+			if(sent_ns && first>sent_ns){
+				fprintf(stderr, ", %.2fms from send to its first byte", (first-sent_ns)/1e6);
+			}
+			fprintf(stderr, ", %.2fms from its first byte\n", (now-first)/1e6);
+			consume(s, scanned);
+			return which;
+		}
+		int rv=receive(s, deadline);
+		if(rv<0){
+			*error=rv;
+			return -1;
+		}
+		if(rv==0){ return -1; }
+	}
+}
+
+int runScript(USBasp_UART* usbasp, const ExpectConfig& config){
+	FILE* f=strcmp(config.script, "-")?fopen(config.script, "r"):stdin;
+	if(!f){
+		fprintf(stderr, "Cannot open %s: %s\n", config.script, strerror(errno));
+		return -1;
+	}
+	std::vector<Step> steps;
+	bool parsed=parseScript(f, steps);
+	if(f!=stdin){ fclose(f); }
+	if(!parsed){ return -1; }
+
+	int rv=usbasp_uart_nb_enable(usbasp, config.poll_us);
+	if(rv<0){ return rv; }
+	Session s;
+	s.usbasp=usbasp;
+	s.config=config;
+	int timeout_ms=config.timeout_ms;
+	uint64_t sent_ns=0;   // Last send, to time the answer.
+	int code=0;
+	size_t pc=0;
+	while(pc<steps.size()){
+		const Step& step=steps[pc++];
+		switch(step.kind){
+		case STEP_SEND:
+			sent_ns=usbasp_uart_now_ns();
+			rv=send(s, step.text);
+			break;
+		case STEP_EXPECT:{
+			int which=expect(s, step, timeout_ms, sent_ns, &rv);
+			sent_ns=0;
+			if(rv<0){ break; }
+			if(which>=0){
+				if(step.targets[which]>=0){ pc=step.targets[which]; }
+				break;
+			}
+			if(step.target>=0){
+				pc=step.target;
+				break;
+			}
+			std::string all;
+			for(const std::string& p : step.patterns){
+				all+=(all.empty()?"\"":", \"")+printable(p)+"\"";
+			}
+			fprintf(stderr, "script:%d: timeout waiting for %s\n", step.line, all.c_str());
+			code=1;
+			pc=steps.size();
+			break;
+		}
+		case STEP_TIMEOUT:
+			timeout_ms=step.value;
+			break;
+		case STEP_SLEEP:{
+			uint64_t until=usbasp_uart_now_ns()+(uint64_t)step.value*1000000;
+			while((rv=receive(s, until))>0){}
+			break;
+		}
+		case STEP_GOTO:
+			pc=step.target;
+			break;
+		case STEP_LOG:
+			fprintf(stderr, "%s\n", step.text.c_str());
+			break;
+		case STEP_EXIT:
+			code=step.value;
+			pc=steps.size();
+			break;
+		}
+		if(rv<0){ break; }
+	}
+	// Let what was sent reach firmware before disabling.
+	while(rv>=0 && usbasp_uart_nb_pending(usbasp)){
+		rv=receive(s, usbasp_uart_now_ns()+10000000);
+	}
+	if(s.dropped){
+		fprintf(stderr, "Note: %llu unmatched bytes dropped from expect buffer\n",
+				(unsigned long long)s.dropped);
+	}
+	usbasp_uart_nb_disable(usbasp);
+	return rv<0?rv:code;
+}
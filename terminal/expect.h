@@ -0,0 +1,31 @@
+#ifndef EXPECT_H_
+#define EXPECT_H_
+
+#include "usbasp_uart.h"
+
+struct ExpectConfig{
+	const char* script;        // Script file, - for stdin.
+	int timeout_ms=10000;      // Until the script sets one.
+	int poll_us=0;             // RX poll interval, see usbasp_uart_nb_enable().
+	bool echo=false;           // Copy received data to stdout.
+};
+
+// Runs a script against the live stream, one step per line:
+//   send TEXT                         queue TEXT for TX at once
+//   expect PAT [-> LABEL] ... [timeout -> LABEL]
+//                                     wait for the first of the patterns,
+//                                     go on after it or jump to its label
+//   timeout SECS                      time limit of following expects
+//   sleep SECS
+//   goto LABEL
+//   LABEL:
+//   log TEXT                          print TEXT to stderr
+//   exit [CODE]
+// TEXT and PAT are double quoted, with \r \n \t \e \xHH escapes. An
+// expect without a timeout label failing ends the script with 1. The
+// device is driven in non-blocking mode from the calling thread, so
+// matching and the reply it triggers need no thread handoff. Returns the
+// script's exit code, or <0 on script or device error.
+int runScript(USBasp_UART* usbasp, const ExpectConfig& config);
+
+#endif
@@ -0,0 +1,280 @@
+#include "filter.h"
+
+#include <ctype.h>
+#include <string.h>
+
+#define FILTER_MAX_LINE (64*1024)  // Longer lines are judged in pieces.
+
+// Index after the ']' closing the bracket expression at i, npos when it
+// cannot be told. ']' right after '[' or "[^" belongs to the class, as
+// does the one ending [:class:], [.coll.] or [=equiv=].
+static size_t bracketEnd(const std::string& re, size_t i){
+	size_t end=i+1;
+	if(end<re.size() && re[end]=='^'){ end++; }
+	if(end<re.size() && re[end]==']'){ end++; }
+	while(end<re.size() && re[end]!=']'){
+		if(re[end]=='[' && end+1<re.size() && strchr(":.=", re[end+1])){
+			const char close[]={re[end+1], ']', 0};
+			size_t at=re.find(close, end+2);
+			if(at==std::string::npos){ return std::string::npos; }
+			end=at+2;
+		}
+		else{
+			end++;
+		}
+	}
+	return end<re.size()?end+1:std::string::npos;
+}
+
+// Longest run of characters every match of an extended regex contains.
+// Conservative: nothing with alternation, classes and quantified
+// characters only end a run, and nothing inside a group counts, as the
+// group may be optional or repeated.
+static std::string requiredLiteral(const std::string& re){
+	if(re.find('|')!=std::string::npos){ return ""; }
+	std::string best, run;
+	int depth=0;
+	for(size_t i=0; i<re.size(); ){
+		char c=re[i];
+		size_t next=i+1;
+		bool literal=true;
+		if(c=='\\' && i+1<re.size()){
+			c=re[i+1];
+			next=i+2;
+			literal=!isalnum((unsigned char)c);  // \w, \b... are classes.
+		}
+		else if(strchr(".^$*+?{}()[", c)){
+			literal=false;
+			if(c=='['){
+				next=bracketEnd(re, i);
+				if(next==std::string::npos){ return ""; }
+			}
+			else if(c=='{'){
+				size_t end=re.find('}', i);
+				next=end==std::string::npos?re.size():end+1;
+			}
+			else if(c=='('){ depth++; }
+			else if(c==')' && depth>0){ depth--; }
+		}
+		char q=next<re.size()?re[next]:0;
+		if(literal && (q=='*' || q=='?' || q=='{')){
+			literal=false;                   // Optional, or repeated some times.
+		}
+		if(literal && !depth){ run+=c; }
+		if(!literal || depth || q=='+'){
+			if(run.size()>best.size()){ best=run; }
+			run.clear();
+		}
+		i=next;
+	}
+	return run.size()>best.size()?run:best;
+}
+
+LineFilter::~LineFilter(){
+	for(Pattern* p : patterns){
+		if(p->is_regex){ regfree(&p->re); }
+		delete p;
+	}
+}
+
+bool LineFilter::add(const char* spec){
+	Pattern* p=new Pattern();
+	if(!strncmp(spec, "re:", 3)){
+		if(regcomp(&p->re, spec+3, REG_EXTENDED|REG_NOSUB)!=0){
+			delete p;
+			return false;
+		}
+		p->is_regex=true;
+		p->literal=requiredLiteral(spec+3);
+	}
+	else{
+		p->literal=spec;
+	}
+	if(!p->is_regex && p->literal.empty()){
+		delete p;
+		return false;
+	}
+	patterns.push_back(p);
+	return true;
+}
+
+bool LineFilter::matchLine(const char* line, size_t len){
+	candidates++;
+	size_t text=len && line[len-1]=='\n'?len-1:len;
+	for(Pattern* p : patterns){
+		if(!p->literal.empty() && !memmem(line, len, p->literal.data(), p->literal.size())){
+			continue;
+		}
+		if(!p->is_regex){ return true; }
+#ifdef REG_STARTEND
+		regmatch_t m;
+		m.rm_so=0;
+		m.rm_eo=text;
+		if(regexec(&p->re, line, 1, &m, REG_STARTEND)==0){ return true; }
+#else
+		scratch.assign(line, text);
+		if(regexec(&p->re, scratch.c_str(), 0, NULL, 0)==0){ return true; }
+#endif
+	}
+	return false;
+}
+
+// Earliest position from pos on that may be in a matching line. A regex
+// without literal makes every line a candidate.
+size_t LineFilter::candidate(const char* d, size_t pos, size_t len){
+	size_t best=len;
+	for(Pattern* p : patterns){
+		if(p->literal.empty()){ return pos; }
+		if(!p->known || (p->next<pos && p->next!=len)){
+			const void* at=memmem(d+pos, len-pos, p->literal.data(), p->literal.size());
+			p->next=at?(const char*)at-d:len;
+			p->known=true;
+		}
+		if(p->next<best){ best=p->next; }
+	}
+	return best;
+}
+
+void LineFilter::emit(const char* d, size_t len, uint64_t abs, std::string& out){
+	if(!len){ return; }
+	if(context>0 && emitted && abs!=emitted_to){
+		out+="--\n";
+	}
+	out.append(d, len);
+	emitted=true;
+	emitted_to=abs+len;
+}
+
+// Start of the line n lines before end, not before lo.
+static size_t linesBack(const char* d, size_t lo, size_t end, int n){
+	for(int k=0; k<n && end>lo; k++){
+		const void* nl=end-1>lo?memrchr(d+lo, '\n', end-1-lo):NULL;
+		end=nl?(const char*)nl-d+1:lo;
+	}
+	return end;
+}
+
+void LineFilter::emitBefore(const char* d, size_t printed, size_t start, uint64_t abs, bool any,
+		std::string& out){
+	if(!context){ return; }
+	size_t from=linesBack(d, printed, start, context);
+	if(from==0 && !any && !tail.empty()){
+		int have=0;
+		for(size_t i=0; i<start; ){
+			const void* nl=memchr(d+i, '\n', start-i);
+			i=nl?(const char*)nl-d+1:start;
+			have++;
+		}
+		if(have<context){
+			size_t t=linesBack(tail.data(), 0, tail.size(), context-have);
+			emit(tail.data()+t, tail.size()-t, tail_abs+t, out);
+		}
+	}
+	emit(d+from, start-from, abs+from, out);
+}
+
+// Keeps last context lines not passed on, for a match early in the next region.
+void LineFilter::keepTail(const char* d, size_t printed, size_t len, uint64_t abs, bool any){
+	if(!context){ return; }
+	size_t from=linesBack(d, printed, len, context);
+	if(any || from>printed || tail.empty()){
+		tail.clear();
+		tail_abs=abs+from;
+	}
+	tail.append(d+from, len-from);
+	size_t keep=linesBack(tail.data(), 0, tail.size(), context);
+	tail.erase(0, keep);
+	tail_abs+=keep;
+}
+
+// d holds whole lines, the last one may lack its newline.
+void LineFilter::region(const char* d, size_t len, uint64_t abs, std::string& out){
+	size_t pos=0, printed=0;
+	bool any=false;
+	for(Pattern* p : patterns){ p->known=false; }
+	while(pos<len){
+		const void* nl;
+		if(after>0){
+			nl=memchr(d+pos, '\n', len-pos);
+			size_t end=nl?(const char*)nl-d+1:len;
+			if(matchLine(d+pos, end-pos)){
+				matched++;
+				after=context;
+			}
+			else{
+				after--;
+			}
+			emit(d+pos, end-pos, abs+pos, out);
+			pos=printed=end;
+			any=true;
+			continue;
+		}
+		size_t hit=candidate(d, pos, len);
+		if(hit>=len){ break; }
+		nl=hit>pos?memrchr(d+pos, '\n', hit-pos):NULL;
+		size_t start=nl?(const char*)nl-d+1:pos;
+		nl=memchr(d+hit, '\n', len-hit);
+		size_t end=nl?(const char*)nl-d+1:len;
+		pos=end;
+		if(!matchLine(d+start, end-start)){ continue; }
+		matched++;
+		emitBefore(d, printed, start, abs, any, out);
+		emit(d+start, end-start, abs+start, out);
+		after=context;
+		printed=end;
+		any=true;
+	}
+	keepTail(d, printed, len, abs, any);
+}
+
+void LineFilter::feed(const uint8_t* data, size_t len, std::string& out){
+	const char* d=(const char*)data;
+	bytes+=len;
+	if(!carry.empty()){
+		const char* nl=(const char*)memchr(d, '\n', len);
+		size_t n=nl?nl-d+1:len;
+		carry.append(d, n);
+		d+=n;
+		len-=n;
+		stream+=n;
+		if(!nl && carry.size()<FILTER_MAX_LINE){ return; }
+		region(carry.data(), carry.size(), carry_abs, out);
+		carry.clear();
+	}
+	const char* last=len?(const char*)memrchr(d, '\n', len):NULL;
+	if(last){
+		size_t n=last-d+1;
+		region(d, n, stream, out);
+		d+=n;
+		len-=n;
+		stream+=n;
+	}
+	if(len){
+		carry_abs=stream;
+		carry.assign(d, len);
+		stream+=len;
+	}
+}
+
+void LineFilter::finish(std::string& out){
+	if(!carry.empty()){
+		region(carry.data(), carry.size(), carry_abs, out);
+		carry.clear();
+	}
+}
+
+bool LineFilter::check(const std::string& line) const{
+	for(const Pattern* p : patterns){
+		if(p->is_regex?regexec(&p->re, line.c_str(), 0, NULL, 0)==0:
+				strstr(line.c_str(), p->literal.c_str())!=NULL){
+			return true;
+		}
+	}
+	return false;
+}
+
+void LineFilter::print(FILE* f) const{
+	fprintf(f, "Filter: %llu bytes, %llu candidate lines, %llu matched\n",
+			(unsigned long long)bytes, (unsigned long long)candidates,
+			(unsigned long long)matched);
+}
@@ -0,0 +1,69 @@
+#ifndef FILTER_H_
+#define FILTER_H_
+
+#include <regex.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+// Passes on only lines of a stream that contain one of the patterns,
+// with grep-like context lines around them. Whole stretches without a
+// candidate are skipped by memmem() on each pattern's literal (all of a
+// literal pattern, the longest run of plain characters a regex must
+// contain); lines are only split out around candidates, with memchr()
+// and memrchr(). Once warmed up, feeding does not allocate.
+struct LineFilter{
+	int context=0;             // Lines passed before and after each match.
+
+	LineFilter(){}
+	~LineFilter();
+	LineFilter(const LineFilter&)=delete;
+	LineFilter& operator=(const LineFilter&)=delete;
+
+	// TEXT, or re:REGEX for a POSIX extended regex. False on bad regex.
+	bool add(const char* spec);
+	bool empty() const{ return patterns.empty(); }
+	// Appends lines to pass to out; a line is only judged once complete.
+	void feed(const uint8_t* data, size_t len, std::string& out);
+	// Judges the last line even without newline.
+	void finish(std::string& out);
+	void print(FILE* f) const;
+	// Judges one line by regexec() or strstr() alone, without the literal
+	// prefilter; slow, for checking feed().
+	bool check(const std::string& line) const;
+
+	uint64_t bytes=0;
+	uint64_t matched=0;        // Matching lines.
+	uint64_t candidates=0;     // Lines checked against the patterns.
+
+private:
+	struct Pattern{
+		std::string literal;   // Every match contains it, empty if none known.
+		bool is_regex=false;
+		regex_t re;
+		size_t next=0;         // Next literal occurrence in region.
+		bool known=false;      // next is valid for current region.
+	};
+
+	void region(const char* d, size_t len, uint64_t abs, std::string& out);
+	size_t candidate(const char* d, size_t pos, size_t len);
+	bool matchLine(const char* line, size_t len);
+	void emit(const char* d, size_t len, uint64_t abs, std::string& out);
+	void emitBefore(const char* d, size_t printed, size_t start, uint64_t abs, bool any,
+			std::string& out);
+	void keepTail(const char* d, size_t printed, size_t len, uint64_t abs, bool any);
+
+	std::vector<Pattern*> patterns;
+	std::string carry;         // Incomplete last line.
+	uint64_t carry_abs=0;
+	uint64_t stream=0;         // Stream offset of next byte fed.
+	std::string tail;          // Last unprinted lines, for context before.
+	uint64_t tail_abs=0;
+	int after=0;               // Context lines still to pass.
+	bool emitted=false;
+	uint64_t emitted_to=0;     // Stream offset after last line passed.
+	std::string scratch;       // NUL terminated line for regexec().
+};
+
+#endif
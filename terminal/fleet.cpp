@@ -0,0 +1,122 @@
+#include "fleet.h"
+#include "sinks.h"
+#include "usbasp_reactor.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+
+struct Found{
+	std::vector<std::string> selects;
+	std::vector<std::string> names;
+};
+
+static void found(void* ctx, const char* path, const char* serial){
+	Found* f=(Found*)ctx;
+	f->selects.push_back(std::string("path:")+path);
+	f->names.push_back(serial[0]?serial:path);
+}
+
+std::vector<FleetDevice*> openFleet(const char* list, int baud, int flags){
+	Found f;
+	if(!strcmp(list, "all")){
+		usbasp_uart_enumerate(found, &f);
+	}
+	else{
+		for(const char* s=list; *s; ){
+			const char* comma=strchr(s, ',');
+			std::string select=comma?std::string(s, comma-s):std::string(s);
+			f.selects.push_back(select);
+			f.names.push_back(select.compare(0, 5, "path:")==0?select.substr(5):
+					select.compare(0, 7, "serial:")==0?select.substr(7):select);
+			if(!comma){ break; }
+			s=comma+1;
+		}
+	}
+	std::vector<FleetDevice*> devs;
+	for(size_t i=0; i<f.selects.size(); i++){
+		FleetDevice* dev=new FleetDevice();
+		dev->select=f.selects[i];
+		dev->name=f.names[i];
+		dev->usbasp.select=dev->select.c_str();
+		devs.push_back(dev);
+		int rv=usbasp_uart_config(&dev->usbasp, baud, flags);
+		if(rv<0){
+			fprintf(stderr, "Error %d while initializing USBasp %s\n", rv, dev->name.c_str());
+			closeFleet(devs);
+			break;
+		}
+	}
+	return devs;
+}
+
+void closeFleet(std::vector<FleetDevice*>& devs){
+	for(FleetDevice* dev : devs){
+		if(dev->usbasp.usbhandle){
+			usbasp_uart_disable(&dev->usbasp);
+		}
+		delete dev;
+	}
+	devs.clear();
+}
+
+// Replaces every %s in spec with name.
+static std::string sinkSpec(const char* spec, const std::string& name){
+	std::string s=spec;
+	for(size_t at=s.find("%s"); at!=std::string::npos; at=s.find("%s", at+name.size())){
+		s.replace(at, 2, name);
+	}
+	return s;
+}
+
+int monitorFleet(std::vector<FleetDevice*>& devs, const FleetConfig& config){
+	// Blocked before threads start, so they all inherit it.
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	USBasp_Reactor reactor;
+	memset(&reactor, 0, sizeof(reactor));
+	reactor.poll_us=config.poll_us;
+	reactor.threads=config.threads;
+	std::vector<USBasp_Reactor_Dev> rdevs(devs.size());
+	std::vector<USBasp_Tee_Sink*> sinks;
+	int rv=0;
+	for(size_t i=0; i<devs.size() && rv==0; i++){
+		USBasp_Tee_Sink* sink=makeSink(sinkSpec(config.sink, devs[i]->name).c_str());
+		if(!sink){
+			rv=-1;
+			break;
+		}
+		sinks.push_back(sink);
+		memset(&rdevs[i], 0, sizeof(rdevs[i]));
+		rdevs[i].name=devs[i]->name.c_str();
+		rdevs[i].usbasp=&devs[i]->usbasp;
+		rdevs[i].write=sink->write;
+		rdevs[i].ctx=sink->ctx;
+		if(usbasp_reactor_add(&reactor, &rdevs[i])!=0){
+			fprintf(stderr, "Cannot poll %s, not open or more than %d devices\n",
+					devs[i]->name.c_str(), USBASP_REACTOR_MAX_DEVS);
+			rv=-1;
+		}
+	}
+	if(rv==0 && usbasp_reactor_start(&reactor)!=0){
+		fprintf(stderr, "Cannot start reactor\n");
+		rv=-1;
+	}
+	if(rv==0){
+		int sig;
+		sigwait(&set, &sig);
+		usbasp_reactor_stop(&reactor);
+		if(config.stats){
+			usbasp_reactor_print(&reactor, stderr);
+		}
+		rv=reactor.error;
+	}
+	for(USBasp_Tee_Sink* sink : sinks){
+		freeSink(sink);
+	}
+	return rv;
+}
@@ -0,0 +1,32 @@
+#ifndef FLEET_H_
+#define FLEET_H_
+
+#include "usbasp_uart.h"
+
+#include <string>
+#include <vector>
+
+struct FleetDevice{
+	std::string select;     // Selector it was opened with.
+	std::string name;       // Serial, or path when there is none.
+	USBasp_UART usbasp;
+};
+
+// Opens and configures USBasps given as comma separated serials and
+// path:BUS-PORT selectors, or all of them for "all". Returns empty vector
+// if any of them fails.
+std::vector<FleetDevice*> openFleet(const char* list, int baud, int flags);
+void closeFleet(std::vector<FleetDevice*>& devs);
+
+struct FleetConfig{
+	const char* sink;       // Sink spec, %s is replaced with device name.
+	int poll_us;
+	int threads;
+	bool stats;
+};
+
+// Logs every device to its own sink from one reactor thread until SIGINT
+// or SIGTERM.
+int monitorFleet(std::vector<FleetDevice*>& devs, const FleetConfig& config);
+
+#endif
@@ -1,92 +1,205 @@
 #include "usbasp_uart.h"
+#include "usbasp_sched.h"
+#include "bench.h"
+#include "pty.h"
+#include "server.h"
+#include "sinks.h"
+#include "fleet.h"
+#include "daemon.h"
+#include "usbasp_nb.h"
+#include "expect.h"
+#include "filter.h"
 
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <signal.h>
+#include <sched.h>
+#include <string.h>
 #include <unistd.h>
-#include <chrono>
-#include <fstream>
+#include <sys/mman.h>
+#include <string>
 #include <thread>
 #include <vector>
 
 int verbose=0;
 
-void writeTest(USBasp_UART* usbasp, int size){
-	std::string s;
-	char c='a';
-	for(int i=0; i<size; i++){
-		s+=c;
-		c++;
-		if(c>'z'){ c='a'; }
-	}
-	auto start=std::chrono::high_resolution_clock::now();
-	int rv;
-	if((rv=usbasp_uart_write_all(usbasp, (uint8_t*)s.c_str(), s.size()))<0){
-		fprintf(stderr, "Error %d while writing...\n", rv);
-		return;
-	}
-	auto finish=std::chrono::high_resolution_clock::now();
-	auto us=std::chrono::duration_cast<std::chrono::microseconds>(finish-start).count();
-	printf("%zu bytes sent in %zums\n", s.size(), us/1000);
-	printf("Average speed: %lf kB/s\n", s.size()/1000.0/(us/1000000.0));
-}
+static USBasp_UART_Stats stats;
+static USBasp_Sched sched;
+static USBasp_Tee tee;
+static LineFilter filter;
+// Held by whoever stops the stream, until the process ends.
+static pthread_mutex_t stopping=PTHREAD_MUTEX_INITIALIZER;
 
-void readTest(USBasp_UART* usbasp, size_t size){
-	auto start=std::chrono::high_resolution_clock::now();
-	int us;
-	std::string s;
-	while(1){
-		if(s.size()==0){
-			start=std::chrono::high_resolution_clock::now();
-		}
-		if(s.size()>=size){
-			auto finish=std::chrono::high_resolution_clock::now();
-			us=std::chrono::duration_cast<std::chrono::microseconds>(finish-start).count();
-			break;
-		}
-		uint8_t buff[300];
-		int rv=usbasp_uart_read(usbasp, buff, sizeof(buff));
-		if(rv==0){ continue; } // Nothing is available for now.
-		else if(rv<0){
-			fprintf(stderr, "Error while reading, rv=%d\n", rv);
-			return;
-		}
-		else{
-			s+=std::string((char*)buff, rv);
-			fprintf(stderr, "%zu/%zu\n", s.size(), size);
-		}
+// Stops polling and sink threads, so nothing uses the filter any more,
+// and passes on its last line.
+static void stop_stream(){
+	usbasp_sched_halt(&sched);
+	usbasp_tee_stop(&tee);
+	// Only then is the filter a sink, -N feeds it from the main thread.
+	if(tee.count && !filter.empty()){
+		std::string rest;
+		filter.finish(rest);
+		if(write(STDOUT_FILENO, rest.data(), rest.size())<0){}
 	}
-	printf("Whole received text:\n");
-	printf("%s\n", s.c_str());
-	printf("%zu bytes received in %dms\n", s.size(), us/1000);
-	printf("Average speed: %lf kB/s\n", s.size()/1000.0/(us/1000000.0));
 }
 
-void read_forever(USBasp_UART* usbasp){
+// Signals are blocked in all threads and handled here, so stats can be
+// printed with plain stdio. SIGUSR1 dumps them, SIGINT/SIGTERM stop the
+// stream, dump them, finish the trace file and quit.
+static void signals_forever(USBasp_UART* usbasp, sigset_t set){
 	while(1){
-		uint8_t buff[300];
-		int rv=usbasp_uart_read(usbasp, buff, sizeof(buff));
-		if(rv<0){
-			fprintf(stderr, "read: rv=%d\n", rv);
-			return;
+		int sig;
+		if(sigwait(&set, &sig)!=0){ return; }
+		if(sig!=SIGUSR1){
+			pthread_mutex_lock(&stopping);
+			stop_stream();
 		}
-		for(int i=0;i<rv;i++){
-			printf("%c",buff[i]);
+		if(usbasp->stats){
+			USBasp_UART_Stats snapshot;
+			usbasp_uart_stats_get(usbasp, &snapshot);
+			usbasp_uart_stats_print(&snapshot, stderr);
+			usbasp_uart_timing_print(usbasp, stderr);
+			if(sched.txq){
+				usbasp_sched_print(&sched, stderr);
+			}
+			usbasp_tee_print(&tee, stderr);
+			// Sink thread counts these until stopped.
+			if(tee.count && !filter.empty() && sig!=SIGUSR1){
+				filter.print(stderr);
+			}
+		}
+		if(sig!=SIGUSR1){
+			usbasp_uart_trace_close(usbasp);
+			exit(128+sig);
 		}
-		fflush(stdout);
 	}
 }
 
-void write_forever(USBasp_UART* usbasp){
+void write_forever(USBasp_Sched* sched){
 	uint8_t buff[1024];
 	while(1){
 		int rv=read(STDIN_FILENO, buff, sizeof(buff));
-		if(rv==0){ return; }
+		if(rv==0){ break; }
 		else if(rv<0){
 			fprintf(stderr, "write: read from stdin returned %d\n", rv);
+			break;
+		}
+		else if((rv=usbasp_sched_write(sched, buff, rv))<0){
+			fprintf(stderr, "write: rv=%d\n", rv);
 			return;
 		}
-		else{
-			usbasp_uart_write_all(usbasp, buff, rv);
+	}
+	usbasp_sched_drain(sched);
+}
+
+// Copies stdin to UART and UART to stdout, through the filter if it has
+// patterns, from one thread, waiting in a single poll() on stdin and the
+// handle's non-blocking fd.
+static int poll_forever(USBasp_UART* usbasp, bool should_read, bool should_write){
+	int rv=usbasp_uart_nb_enable(usbasp, usbasp->poll_interval_us);
+	if(rv<0){ return rv; }
+	uint8_t in[1024];
+	uint8_t out[USBASP_NB_QUEUE];
+	std::string lines;
+	size_t in_len=0, in_off=0;
+	bool eof=!should_write;
+	while(!eof || should_read || in_off<in_len || usbasp_uart_nb_pending(usbasp)){
+		struct pollfd fds[2];
+		fds[0].fd=usbasp_uart_nb_fd(usbasp);
+		fds[0].events=POLLIN;
+		fds[1].fd=(!eof && in_off==in_len)?STDIN_FILENO:-1;
+		fds[1].events=POLLIN;
+		if(poll(fds, 2, -1)<0){
+			if(errno==EINTR){ continue; }
+			rv=-errno;
+			break;
+		}
+		if(fds[1].revents){
+			int n=read(STDIN_FILENO, in, sizeof(in));
+			if(n<=0){ eof=true; }
+			else{
+				in_len=n;
+				in_off=0;
+			}
+		}
+		if(fds[0].revents && (rv=usbasp_uart_nb_dispatch(usbasp))<0){
+			break;
+		}
+		if(in_off<in_len){
+			if((rv=usbasp_uart_try_write(usbasp, in+in_off, in_len-in_off))<0){ break; }
+			in_off+=rv;
+		}
+		if((rv=usbasp_uart_try_read(usbasp, out, sizeof(out)))<0){ break; }
+		if(!should_read || rv==0){ continue; }
+		const void* pass=out;
+		size_t len=rv;
+		if(!filter.empty()){
+			lines.clear();
+			filter.feed(out, rv, lines);
+			pass=lines.data();
+			len=lines.size();
+		}
+		if(write(STDOUT_FILENO, pass, len)!=(ssize_t)len){
+			rv=-errno;
+			break;
 		}
 	}
+	usbasp_uart_nb_disable(usbasp);
+	if(!filter.empty()){
+		lines.clear();
+		filter.finish(lines);
+		if(write(STDOUT_FILENO, lines.data(), lines.size())<0){}
+	}
+	return rv<0?rv:0;
+}
+
+// Parses "rx", "weighted:RX:TX" or "bulk".
+static void parsePolicy(const char* s, USBasp_Sched* sched){
+	if(!strncmp(s, "weighted", 8)){
+		sched->policy=USBASP_SCHED_WEIGHTED;
+		sched->rx_weight=sched->tx_weight=1;
+		sscanf(s, "weighted:%d:%d", &sched->rx_weight, &sched->tx_weight);
+	}
+	else if(!strcmp(s, "bulk")){
+		sched->policy=USBASP_SCHED_TX_BULK;
+	}
+	else{
+		sched->policy=USBASP_SCHED_RX_PRIORITY;
+	}
+}
+
+static std::vector<int> parseList(const char* s){
+	std::vector<int> v;
+	while(*s){
+		int x;
+		if(sscanf(s, "%d", &x)==1){ v.push_back(x); }
+		const char* comma=strchr(s, ',');
+		if(!comma){ break; }
+		s=comma+1;
+	}
+	return v;
+}
+
+// Parses "busy,sleep:200,backoff:1000" or "all".
+static std::vector<PollStrategy> parsePolls(const char* s){
+	std::vector<PollStrategy> v;
+	if(!strcmp(s, "all")){
+		return {{USBASP_POLL_BUSY, 0}, {USBASP_POLL_SLEEP, 100}, {USBASP_POLL_BACKOFF, 1000}};
+	}
+	while(*s){
+		PollStrategy p={USBASP_POLL_BUSY, 0};
+		if(!strncmp(s, "sleep", 5)){ p.mode=USBASP_POLL_SLEEP; p.interval_us=100; }
+		else if(!strncmp(s, "backoff", 7)){ p.mode=USBASP_POLL_BACKOFF; p.interval_us=1000; }
+		const char* colon=strchr(s, ':');
+		const char* comma=strchr(s, ',');
+		if(colon && (!comma || colon<comma)){ sscanf(colon+1, "%d", &p.interval_us); }
+		v.push_back(p);
+		if(!comma){ break; }
+		s=comma+1;
+	}
+	return v;
 }
 
 void usage(const char* name){
@@ -95,13 +208,65 @@ void usage(const char* name){
 	fprintf(stderr, "Options:\n");
 	fprintf(stderr, "  -r        copy UART to stdout\n");
 	fprintf(stderr, "  -w        copy stdin to UART\n");
+	fprintf(stderr, "  -e SINK   send UART to SINK instead of stdout, may be repeated: stdout, file:PATH,\n");
+	fprintf(stderr, "            tcp:HOST:PORT or match:TEXT, optionally with /drop or /block when full\n");
+	fprintf(stderr, "  -g PAT    with -r, pass to stdout only lines containing PAT, or matching regex\n");
+	fprintf(stderr, "            re:REGEX, may be repeated\n");
+	fprintf(stderr, "  -K LINES  with -g, also pass LINES lines before and after each match\n");
+	fprintf(stderr, "  -z MB     perform filter test: run -g patterns over MB of generated log\n");
+	fprintf(stderr, "  -y        bridge UART to a new pseudo-terminal, for minicom, picocom etc.\n");
+	fprintf(stderr, "  -Y LINK   same as -y, also create symlink LINK to the pseudo-terminal\n");
+	fprintf(stderr, "  -n [ADDR:]PORT  share UART over TCP (raw or RFC 2217), first client writes,\n");
+	fprintf(stderr, "            others observe, ADDR defaults to 127.0.0.1\n");
+	fprintf(stderr, "  -U SOCK   own USBasp for other processes: received data goes to a shared memory\n");
+	fprintf(stderr, "            ring, commands and data to send come over Unix socket SOCK\n");
+	fprintf(stderr, "  -C SOCK   connect to daemon at SOCK, copy UART to stdout and stdin to UART\n");
+	fprintf(stderr, "  -E CMD    with -C, run CMD (e.g. avrdude) while UART is suspended for programming\n");
 	fprintf(stderr, "  -R        perform read test (read 10kB from UART and output average speed)\n");
 	fprintf(stderr, "  -W        perform write test (write 10kB to UART and output average speed)\n");
+	fprintf(stderr, "  -D        perform full-duplex test (write and read 10kB at once, use with -L)\n");
+	fprintf(stderr, "  -L        loop transmitted bytes back to receiver inside USBasp\n");
 	fprintf(stderr, "  -S SIZE   set different r/w test size (in bytes)\n");
+	fprintf(stderr, "  -i MS     set r/w test sampling window, default 1000\n");
+	fprintf(stderr, "  -X BAUDS  sweep comma separated bauds and loads in loopback, report loss-free rates\n");
+	fprintf(stderr, "  -l LOADS  set sweep loads in percent of line rate, default 25,50,75,100\n");
+	fprintf(stderr, "  -T ITERS  perform round-trip latency test (needs target echo or -L)\n");
+	fprintf(stderr, "  -F SIZE   set latency test frame size, default 1\n");
+	fprintf(stderr, "  -P POLLS  set RX poll strategy: busy, sleep[:US], backoff[:US], comma separated\n");
+	fprintf(stderr, "            list or all (latency test measures each, -r uses the first)\n");
+	fprintf(stderr, "  -f FORMAT set test output format: text (default), csv or json\n");
+	fprintf(stderr, "  -Q POLICY set -rw bus sharing: rx (RX priority, default), weighted:RX:TX\n");
+	fprintf(stderr, "            (transfer ratio) or bulk (TX first, RX only when needed)\n");
+	fprintf(stderr, "  -d US     poll RX at least every US microseconds under any policy, default 5000\n");
+	fprintf(stderr, "  -o US     with -r alone, write received data out at least every US microseconds,\n");
+	fprintf(stderr, "            batching everything received meanwhile, default 10000\n");
+	fprintf(stderr, "  -Z POLICY run I/O thread as fifo[:PRIO] or rr[:PRIO] real-time thread (needs root)\n");
+	fprintf(stderr, "  -c CPUS   pin I/O thread to comma separated CPUs\n");
+	fprintf(stderr, "  -M        lock all memory with mlockall, so the I/O path never page faults\n");
+	fprintf(stderr, "  -J SECS   perform jitter test: poll RX for SECS seconds, report gaps between transfers\n");
+	fprintf(stderr, "  -H US     hold small writes up to US microseconds to send them together, newline\n");
+	fprintf(stderr, "            sends at once, 0 disables, default 1000\n");
 	fprintf(stderr, "  -b BAUD   set baud, default 9600\n");
 	fprintf(stderr, "  -p PARITY set parity (default 0=none, 1=even, 2=odd)\n");
 	fprintf(stderr, "  -B BITS   set byte size in bits, default 8\n");
 	fprintf(stderr, "  -s BITS   set stop bit count, default 1\n");
+	fprintf(stderr, "  -t        collect transfer stats, print them on exit or SIGUSR1\n");
+	fprintf(stderr, "  -x FILE   record every USB transfer to trace FILE (see usbasp_trace)\n");
+	fprintf(stderr, "  -u DEV    use USBasp with serial DEV, serial:DEV or bus/port path:DEV, e.g.\n");
+	fprintf(stderr, "            path:1-2.4; -u list lists connected ones\n");
+	fprintf(stderr, "  -k FILE   remember device in FILE and try it first next time, skipping the scan;\n");
+	fprintf(stderr, "            -t reports open time and time to first byte\n");
+	fprintf(stderr, "  -a SECS   when USBasp is unplugged or resets, wait up to SECS (0 forever) for it\n");
+	fprintf(stderr, "            to come back, configure it again and go on\n");
+	fprintf(stderr, "  -m DEVS   log comma separated USBasps (as for -u) or all from one thread, each to\n");
+	fprintf(stderr, "            first -e SINK with %%s replaced by its serial, default file:usbasp-%%s.log\n");
+	fprintf(stderr, "  -G SECS   perform fleet test: poll 1, 2, 4... of -m devices (default all) for SECS\n");
+	fprintf(stderr, "            seconds each, report throughput and CPU per device\n");
+	fprintf(stderr, "  -A SCRIPT run send/expect SCRIPT (- for stdin) against the stream, exit with its\n");
+	fprintf(stderr, "            code; with -r also copy UART to stdout\n");
+	fprintf(stderr, "  -N        with -r and/or -w, serve stdin, stdout and USBasp from one poll() loop\n");
+	fprintf(stderr, "            through non-blocking mode instead of scheduler threads; -g applies\n");
+	fprintf(stderr, "  -O MS     give up a USB transfer after MS milliseconds, default 5000\n");
 	fprintf(stderr, "  -v        increase verbosity\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "If you want to use it as interactive terminal, use %s -rw -b 9600\n", name);
@@ -119,14 +284,50 @@ int main(int argc, char** argv){
 	
 	bool should_test_read=false;
 	bool should_test_write=false;
+	bool should_test_duplex=false;
+	int loopback=0;
 	bool should_read=false;
 	bool should_write=false;
+	PtyConfig pty;
+	bool should_pty=false;
+	ServerConfig server;
+	std::vector<const char*> sinks;
+	std::string server_addr;
+	bool should_stat=false;
+	bool should_lock=false;
+	int jitter_seconds=0;
+	const char* trace_path=NULL;
+	const char* device=NULL;
+	const char* cache=NULL;
+	int reconnect_ms=0;
+	int timeout_ms=0;
+	bool should_poll=false;
+	ExpectConfig expect;
+	expect.script=NULL;
+	int status=0;
+	int filter_mb=0;
+	DaemonConfig daemon;
+	daemon.socket=NULL;
+	ClientConfig client;
+	client.socket=NULL;
+	const char* fleet=NULL;
+	int fleet_seconds=0;
 	int test_size=(10*1024);
+	int window_ms=1000;
+	BenchFormat format=BENCH_TEXT;
+	SweepConfig sweep;
+	sweep.loads={25, 50, 75, 100};
+	LatencyConfig latency;
+	latency.iterations=0;
+	latency.frame=1;
+	latency.polls={{USBASP_POLL_BUSY, 0}};
+	sched.tx_hold_us=1000;
+	int out_latency_us=10000;
 
 	opterr=0;
 	int c;
 
-	while( (c=getopt(argc, argv, "rwRWS:b:p:B:s:v"))!=-1){
+	while( (c=getopt(argc, argv, "rwe:yY:n:RWDLS:i:X:l:T:F:P:f:Q:d:Z:c:MJ:H:o:b:p:B:s:tx:u:k:a:m:G:U:C:E:NO:A:g:K:z:v"))!=-1){
 		switch(c){
 		case 'r':
 			should_read=true;
@@ -134,15 +335,91 @@ int main(int argc, char** argv){
 		case 'w':
 			should_write=true;
 			break;
+		case 'Y':
+			pty.link=optarg;
+			// fallthrough
+		case 'y':
+			should_pty=true;
+			break;
+		case 'e':
+			sinks.push_back(optarg);
+			should_read=true;
+			break;
+		case 'n':
+			if(strchr(optarg, ':')){
+				server_addr.assign(optarg, strchr(optarg, ':'));
+				server.addr=server_addr.c_str();
+			}
+			sscanf(strchr(optarg, ':')?strchr(optarg, ':')+1:optarg, "%d", &server.port);
+			break;
 		case 'R':
 			should_test_read=true;
 			break;
 		case 'W':
 			should_test_write=true;
 			break;
+		case 'D':
+			should_test_duplex=true;
+			break;
+		case 'L':
+			loopback=USBASP_UART_LOOPBACK;
+			break;
 		case 'S':
 			sscanf(optarg, "%d", &test_size);
 			break;
+		case 'X':
+			sweep.bauds=parseList(optarg);
+			break;
+		case 'l':
+			sweep.loads=parseList(optarg);
+			break;
+		case 'T':
+			sscanf(optarg, "%d", &latency.iterations);
+			break;
+		case 'F':
+			sscanf(optarg, "%zu", &latency.frame);
+			break;
+		case 'P':
+			latency.polls=parsePolls(optarg);
+			break;
+		case 'f':
+			if(!strcmp(optarg, "csv")){ format=BENCH_CSV; }
+			else if(!strcmp(optarg, "json")){ format=BENCH_JSON; }
+			else{ format=BENCH_TEXT; }
+			break;
+		case 'i':
+			sscanf(optarg, "%d", &window_ms);
+			break;
+		case 'Q':
+			parsePolicy(optarg, &sched);
+			break;
+		case 'd':
+			sscanf(optarg, "%d", &sched.rx_deadline_us);
+			break;
+		case 'o':
+			sscanf(optarg, "%d", &out_latency_us);
+			break;
+		case 'Z':
+			if(!strncmp(optarg, "fifo", 4)){ sched.rt_policy=SCHED_FIFO; }
+			else if(!strncmp(optarg, "rr", 2)){ sched.rt_policy=SCHED_RR; }
+			else{ fprintf(stderr, "Bad scheduling policy, keeping default.\n"); }
+			sched.rt_priority=sched_get_priority_min(SCHED_FIFO);
+			if(strchr(optarg, ':')){ sscanf(strchr(optarg, ':')+1, "%d", &sched.rt_priority); }
+			break;
+		case 'c':
+			for(int cpu : parseList(optarg)){
+				if(cpu>=0 && cpu<64){ sched.cpu_mask|=1ULL<<cpu; }
+			}
+			break;
+		case 'M':
+			should_lock=true;
+			break;
+		case 'J':
+			sscanf(optarg, "%d", &jitter_seconds);
+			break;
+		case 'H':
+			sscanf(optarg, "%d", &sched.tx_hold_us);
+			break;
 		case 'b':
 			sscanf(optarg, "%d", &baud);
 			break;
@@ -174,6 +451,58 @@ int main(int argc, char** argv){
 			case 2: stop=USBASP_UART_STOP_2BIT;	break;
 			}
 			break;
+		case 't':
+			should_stat=true;
+			break;
+		case 'x':
+			trace_path=optarg;
+			break;
+		case 'u':
+			device=optarg;
+			break;
+		case 'k':
+			cache=optarg;
+			break;
+		case 'a':
+			reconnect_ms=atoi(optarg)*1000;
+			if(reconnect_ms==0){ reconnect_ms=-1; }
+			break;
+		case 'm':
+			fleet=optarg;
+			break;
+		case 'G':
+			fleet_seconds=atoi(optarg);
+			break;
+		case 'U':
+			daemon.socket=optarg;
+			break;
+		case 'C':
+			client.socket=optarg;
+			break;
+		case 'E':
+			client.program=optarg;
+			break;
+		case 'g':
+			if(!filter.add(optarg)){
+				fprintf(stderr, "Bad pattern %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'K':
+			filter.context=atoi(optarg);
+			break;
+		case 'z':
+			filter_mb=atoi(optarg);
+			break;
+		case 'A':
+			expect.script=optarg;
+			break;
+		case 'N':
+			should_poll=true;
+			break;
+		case 'O':
+			timeout_ms=atoi(optarg);
+			break;
 		case 'v':
 			verbose++;
 			break;
@@ -183,31 +512,218 @@ int main(int argc, char** argv){
 		}
 	}
 
-	USBasp_UART usbasp;
+	if(should_lock && mlockall(MCL_CURRENT|MCL_FUTURE)!=0){
+		fprintf(stderr, "Note: cannot lock memory: %s\n", strerror(errno));
+	}
+	if(device && !strcmp(device, "list")){
+		return usbasp_uart_list(stdout)>0?0:-1;
+	}
+	if(client.socket){
+		return runClient(client);
+	}
+	if(filter_mb>0){
+		if(filter.empty()){
+			filter.add("ERROR");
+			filter.add("re:temp=[0-9]{3}");
+		}
+		return filterTest(filter, (size_t)filter_mb*1000000, format);
+	}
+	if(fleet || fleet_seconds>0){
+		std::vector<FleetDevice*> devs=openFleet(fleet?fleet:"all", baud,
+				parity | bits | stop | loopback);
+		if(devs.empty()){
+			fprintf(stderr, "No USBasp to use\n");
+			return -1;
+		}
+		if(fleet_seconds>0){
+			FleetTestConfig cfg;
+			cfg.seconds=fleet_seconds;
+			cfg.poll_us=latency.polls.empty()?0:latency.polls[0].interval_us;
+			cfg.threads=0;
+			cfg.format=format;
+			std::vector<USBasp_UART*> uarts;
+			for(FleetDevice* dev : devs){ uarts.push_back(&dev->usbasp); }
+			fprintf(stderr, "Measuring %zu devices...\n", devs.size());
+			fleetTest(uarts, cfg);
+		}
+		else{
+			FleetConfig cfg;
+			cfg.sink=sinks.empty()?"file:usbasp-%s.log":sinks[0];
+			cfg.poll_us=latency.polls.empty()?0:latency.polls[0].interval_us;
+			cfg.threads=0;
+			cfg.stats=should_stat;
+			int rv=monitorFleet(devs, cfg);
+			if(rv<0){
+				fprintf(stderr, "fleet: rv=%d\n", rv);
+			}
+		}
+		closeFleet(devs);
+		return 0;
+	}
+	USBasp_UART usbasp={};
+	usbasp.select=device;
+	usbasp.cache=cache;
+	usbasp.reconnect_ms=reconnect_ms;
+	usbasp.timeout_ms=timeout_ms;
+	if(should_stat){
+		usbasp_uart_stats_enable(&usbasp, &stats);
+	}
+	if(trace_path && usbasp_uart_trace_open(&usbasp, trace_path)!=0){
+		fprintf(stderr, "Cannot open trace file %s\n", trace_path);
+		return -1;
+	}
+	if(should_stat || trace_path){
+		sigset_t set;
+		sigemptyset(&set);
+		sigaddset(&set, SIGUSR1);
+		sigaddset(&set, SIGINT);
+		sigaddset(&set, SIGTERM);
+		pthread_sigmask(SIG_BLOCK, &set, NULL);
+		// Still blocked for the daemon and the PTY bridge, which take
+		// them through a signalfd and shut down themselves.
+		if(!expect.script && (daemon.socket || (server.port<=0 && should_pty))){
+			sigdelset(&set, SIGINT);
+			sigdelset(&set, SIGTERM);
+		}
+		std::thread([&usbasp, set]{signals_forever(&usbasp, set);}).detach();
+	}
 	int rv;
-	if((rv=usbasp_uart_config(&usbasp, baud, parity | bits | stop)) < 0){
+	if((rv=usbasp_uart_config(&usbasp, baud, parity | bits | stop | loopback)) < 0){
 		fprintf(stderr, "Error %d while initializing USBasp\n", rv);
 		if(rv==USBASP_NO_CAPS){
 			fprintf(stderr, "USBasp has no UART capabilities.\n");
 		}
 		return -1;
 	}
+	StreamConfig stream;
+	stream.size=test_size;
+	stream.window_ms=window_ms;
+	stream.format=format;
 	if(should_test_write){
 		fprintf(stderr, "Writing...\n");
-		writeTest(&usbasp, test_size);
+		if(writeTest(&usbasp, stream)<0){ status=-1; }
 	}
 	if(should_test_read){
 		fprintf(stderr, "Reading...\n");
-		readTest(&usbasp, test_size);
+		if(readTest(&usbasp, stream)<0){ status=-1; }
+	}
+	if(should_test_duplex){
+		fprintf(stderr, "Writing and reading...\n");
+		if(duplexTest(&usbasp, stream)<0){ status=-1; }
+	}
+	if(!sweep.bauds.empty()){
+		fprintf(stderr, "Sweeping...\n");
+		sweep.flags=parity | bits | stop;
+		sweep.size=test_size;
+		sweep.format=format;
+		sweepTest(&usbasp, sweep);
+	}
+	if(latency.iterations>0){
+		fprintf(stderr, "Measuring latency...\n");
+		latency.format=format;
+		latencyTest(&usbasp, latency);
+	}
+	if(!latency.polls.empty()){
+		usbasp_uart_set_poll(&usbasp, latency.polls[0].mode, latency.polls[0].interval_us);
+	}
+	if(jitter_seconds>0){
+		fprintf(stderr, "Measuring jitter...\n");
+		if(jitterTest(&usbasp, &sched, jitter_seconds)<0){ status=-1; }
+	}
+	if(expect.script){
+		expect.echo=should_read;
+		expect.poll_us=usbasp.poll_interval_us;
+		if((status=runScript(&usbasp, expect))<0){
+			fprintf(stderr, "script: rv=%d\n", status);
+		}
+	}
+	else if(daemon.socket){
+		daemon.baud=baud;
+		daemon.flags=parity | bits | stop | loopback;
+		if((rv=serveDaemon(&usbasp, &sched, daemon))<0){
+			fprintf(stderr, "daemon: rv=%d\n", rv);
+		}
+	}
+	else if(server.port>0){
+		server.baud=baud;
+		server.flags=parity | bits | stop | loopback;
+		if((rv=serveTcp(&usbasp, &sched, server))<0){
+			fprintf(stderr, "server: rv=%d\n", rv);
+		}
+	}
+	else if(should_pty){
+		pty.baud=baud;
+		pty.flags=parity | bits | stop | loopback;
+		if((rv=ptyBridge(&usbasp, &sched, pty))<0){
+			fprintf(stderr, "pty: rv=%d\n", rv);
+		}
 	}
-	std::vector<std::thread> threads;
-	if(should_read){
-		threads.push_back(std::thread([&]{read_forever(&usbasp);}));
+	else if(should_poll && (should_read || should_write)){
+		if((rv=poll_forever(&usbasp, should_read, should_write))<0){
+			fprintf(stderr, "poll: rv=%d\n", rv);
+		}
+	}
+	// Without reading there is nothing to share the bus with, so stdin
+	// goes to UART without scheduler and without copying.
+	else if(should_write && !should_read){
+		int64_t sent=usbasp_uart_send_fd(&usbasp, STDIN_FILENO);
+		if(sent<0){
+			fprintf(stderr, "write: rv=%lld\n", (long long)sent);
+		}
+	}
+	// Same for reading: RX goes to stdout in batches, without stdio.
+	else if(should_read && !should_write && sinks.empty() && filter.empty()){
+		if((rv=usbasp_uart_recv_fd(&usbasp, STDOUT_FILENO, out_latency_us))<0){
+			fprintf(stderr, "read: rv=%d\n", rv);
+		}
 	}
-	if(should_write){
-		threads.push_back(std::thread([&]{write_forever(&usbasp);}));
+	// One scheduler thread owns the device, stdin is only queued and
+	// received data is passed to sink threads, so none of them can stall
+	// polling.
+	else if(should_read || should_write){
+		if(should_read){
+			if(sinks.empty() && filter.empty()){
+				sinks.push_back("stdout");
+			}
+			for(const char* spec : sinks){
+				if(!addSink(&tee, spec)){
+					return -1;
+				}
+			}
+			if(!filter.empty() && !addFilterSink(&tee, &filter)){
+				return -1;
+			}
+			sched.on_rx=usbasp_tee_push;
+			sched.ctx=&tee;
+		}
+		if(usbasp_sched_start(&sched, &usbasp)!=0){
+			fprintf(stderr, "Cannot start scheduler\n");
+			return -1;
+		}
+		if(should_write){
+			write_forever(&sched);
+		}
+		if(should_read){
+			if((rv=usbasp_sched_wait(&sched))<0){
+				fprintf(stderr, "read: rv=%d\n", rv);
+			}
+		}
+		// Kept to the end, so a late signal doesn't exit meanwhile.
+		pthread_mutex_lock(&stopping);
+		stop_stream();
+		usbasp_sched_stop(&sched);
 	}
-	for(auto& thr : threads){
-		thr.join();
+	if(should_stat){
+		usbasp_uart_stats_print(&stats, stderr);
+		usbasp_uart_timing_print(&usbasp, stderr);
+		if(should_read || should_pty || server.port>0 || daemon.socket){
+			usbasp_sched_print(&sched, stderr);
+		}
+		usbasp_tee_print(&tee, stderr);
+		if(!filter.empty()){
+			filter.print(stderr);
+		}
 	}
+	usbasp_uart_trace_close(&usbasp);
+	return status;
 }
@@ -0,0 +1,233 @@
+#include "pty.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <termios.h>
+#include <unistd.h>
+
+static const struct{
+	speed_t speed;
+	int baud;
+} bauds[]={
+	{B300, 300}, {B600, 600}, {B1200, 1200}, {B2400, 2400}, {B4800, 4800},
+	{B9600, 9600}, {B19200, 19200}, {B38400, 38400}, {B57600, 57600},
+	{B115200, 115200}, {B230400, 230400},
+#ifdef B460800
+	{B460800, 460800}, {B500000, 500000}, {B576000, 576000}, {B921600, 921600},
+	{B1000000, 1000000}, {B1152000, 1152000}, {B1500000, 1500000},
+#endif
+};
+
+static int baudOf(speed_t speed){
+	for(auto& b : bauds){
+		if(b.speed==speed){ return b.baud; }
+	}
+	return 0;
+}
+
+static speed_t speedOf(int baud){
+	for(auto& b : bauds){
+		if(b.baud==baud){ return b.speed; }
+	}
+	return B9600;
+}
+
+// Line settings of termios as usbasp_uart_config() flags.
+static int flagsOf(const struct termios& t){
+	int flags=0;
+	if(t.c_cflag & PARENB){
+		flags|=(t.c_cflag & PARODD)?USBASP_UART_PARITY_ODD:USBASP_UART_PARITY_EVEN;
+	}
+	flags|=(t.c_cflag & CSTOPB)?USBASP_UART_STOP_2BIT:USBASP_UART_STOP_1BIT;
+	switch(t.c_cflag & CSIZE){
+	case CS5: flags|=USBASP_UART_BYTES_5B; break;
+	case CS6: flags|=USBASP_UART_BYTES_6B; break;
+	case CS7: flags|=USBASP_UART_BYTES_7B; break;
+	default:  flags|=USBASP_UART_BYTES_8B; break;
+	}
+	return flags;
+}
+
+static void setFlags(struct termios& t, int flags){
+	t.c_cflag&=~(PARENB|PARODD|CSTOPB|CSIZE);
+	switch(flags & USBASP_UART_PARITY_MASK){
+	case USBASP_UART_PARITY_EVEN: t.c_cflag|=PARENB; break;
+	case USBASP_UART_PARITY_ODD:  t.c_cflag|=PARENB|PARODD; break;
+	}
+	if((flags & USBASP_UART_STOP_MASK)==USBASP_UART_STOP_2BIT){ t.c_cflag|=CSTOPB; }
+	switch(flags & USBASP_UART_BYTES_MASK){
+	case USBASP_UART_BYTES_5B: t.c_cflag|=CS5; break;
+	case USBASP_UART_BYTES_6B: t.c_cflag|=CS6; break;
+	case USBASP_UART_BYTES_7B: t.c_cflag|=CS7; break;
+	default:                   t.c_cflag|=CS8; break;
+	}
+}
+
+struct PtyState{
+	int master;
+	uint64_t dropped;  // Received bytes nobody was reading.
+};
+
+// Called on scheduler thread. Master is non-blocking, so a slave nobody
+// reads loses data like a real port instead of stalling RX polling.
+static void ptyRx(void* ctx, const uint8_t* data, int len){
+	PtyState* state=(PtyState*)ctx;
+	while(len>0){
+		int rv=write(state->master, data, len);
+		if(rv<=0){
+			if(rv<0 && errno==EINTR){ continue; }
+			state->dropped+=len;
+			return;
+		}
+		data+=rv;
+		len-=rv;
+	}
+}
+
+int ptyBridge(USBasp_UART* usbasp, USBasp_Sched* sched, const PtyConfig& config){
+	int master=posix_openpt(O_RDWR|O_NOCTTY);
+	if(master<0 || grantpt(master)!=0 || unlockpt(master)!=0){
+		fprintf(stderr, "Cannot create pseudo-terminal: %s\n", strerror(errno));
+		return -1;
+	}
+	const char* name=ptsname(master);
+	// Keeping slave open ourselves: master doesn't hang up between clients.
+	int slave=open(name, O_RDWR|O_NOCTTY);
+	if(slave<0){
+		fprintf(stderr, "Cannot open %s: %s\n", name, strerror(errno));
+		close(master);
+		return -1;
+	}
+	// Raw like a real port, so nothing is echoed back to UART. EXTPROC
+	// makes kernel report tcsetattr() on slave as a packet on master.
+	struct termios t;
+	tcgetattr(slave, &t);
+	cfmakeraw(&t);
+	t.c_lflag|=EXTPROC;
+	cfsetispeed(&t, speedOf(config.baud));
+	cfsetospeed(&t, speedOf(config.baud));
+	setFlags(t, config.flags);
+	tcsetattr(slave, TCSANOW, &t);
+	int one=1;
+	ioctl(master, TIOCPKT, &one);
+	fcntl(master, F_SETFL, fcntl(master, F_GETFL)|O_NONBLOCK);
+
+	// Blocked before scheduler thread starts, so it inherits the mask and
+	// SIGINT or SIGTERM end the loop below, which removes the link.
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	int sigfd=signalfd(-1, &set, SFD_NONBLOCK);
+
+	if(config.link){
+		unlink(config.link);
+		if(symlink(name, config.link)!=0){
+			fprintf(stderr, "Cannot create %s: %s\n", config.link, strerror(errno));
+		}
+	}
+	fprintf(stderr, "UART is available at %s\n", config.link?config.link:name);
+
+	PtyState state={master, 0};
+	sched->on_rx=ptyRx;
+	sched->ctx=&state;
+	if(usbasp_sched_start(sched, usbasp)!=0){
+		fprintf(stderr, "Cannot start scheduler\n");
+		close(sigfd);
+		close(slave);
+		close(master);
+		if(config.link){
+			unlink(config.link);
+		}
+		return -1;
+	}
+
+	int ep=epoll_create1(0);
+	struct epoll_event ev;
+	ev.events=EPOLLIN;
+	ev.data.fd=master;
+	epoll_ctl(ep, EPOLL_CTL_ADD, master, &ev);
+	ev.data.fd=sigfd;
+	epoll_ctl(ep, EPOLL_CTL_ADD, sigfd, &ev);
+
+	// Device is reconfigured when settings on slave change, so baud or
+	// 9-bit bytes given on command line stay until client sets its own.
+	// Its baud is kept apart from the slave's speed: one missing from the
+	// termios table shows as 9600 there, and a client then asking for
+	// 9600 must still reconfigure the device.
+	int seen_speed=cfgetospeed(&t);
+	int seen_flags=flagsOf(t);
+	int device_baud=config.baud;
+	int device_flags=config.flags & ~USBASP_UART_LOOPBACK;
+	uint8_t buff[4096+1];
+	int rv=0;
+	while(sched->running){
+		// Timeout also catches tcsetattr() of clients which clear EXTPROC.
+		int n=epoll_wait(ep, &ev, 1, 200);
+		if(n<0 && errno!=EINTR){ break; }
+		if(n>0 && ev.data.fd==sigfd){ break; }
+		bool set_by_client=false;
+		if(n>0){
+			int len=read(master, buff, sizeof(buff));
+			if(len<=0){ continue; }
+			// In packet mode first byte tells what follows.
+			if(buff[0]==TIOCPKT_DATA){
+				if((rv=usbasp_sched_write(sched, buff+1, len-1))<0){ break; }
+				continue;
+			}
+			if(buff[0] & TIOCPKT_FLUSHREAD){
+				usbasp_sched_flushrx(sched);
+			}
+			set_by_client=buff[0] & TIOCPKT_IOCTL;
+		}
+		struct termios now;
+		if(tcgetattr(slave, &now)!=0){ continue; }
+		int speed=cfgetospeed(&now);
+		int flags=flagsOf(now);
+		if(!set_by_client && speed==seen_speed && flags==seen_flags){ continue; }
+		seen_speed=speed;
+		seen_flags=flags;
+		int baud=baudOf(speed);
+		if(baud==0){
+			fprintf(stderr, "Unsupported baud on %s, ignoring settings\n", name);
+			continue;
+		}
+		if(baud==device_baud && flags==device_flags){ continue; }
+		// Bytes queued so far were meant for the old settings.
+		usbasp_sched_drain(sched);
+		rv=usbasp_sched_config(sched, baud, flags | (config.flags & USBASP_UART_LOOPBACK));
+		if(rv<0){
+			fprintf(stderr, "Cannot set baud %d: rv=%d\n", baud, rv);
+			break;
+		}
+		device_baud=baud;
+		device_flags=flags;
+		if(verbose){
+			fprintf(stderr, "Reconfigured to baud %d, flags 0x%x\n", baud, flags);
+		}
+	}
+	if(rv>=0 && !sched->running){
+		rv=usbasp_sched_wait(sched);
+	}
+	usbasp_sched_stop(sched);
+	if(state.dropped){
+		fprintf(stderr, "%llu received bytes dropped, nobody was reading %s\n",
+				(unsigned long long)state.dropped, name);
+	}
+	close(ep);
+	close(sigfd);
+	close(slave);
+	close(master);
+	if(config.link){
+		unlink(config.link);
+	}
+	return rv;
+}
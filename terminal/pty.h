@@ -0,0 +1,19 @@
+#ifndef PTY_H_
+#define PTY_H_
+
+#include "usbasp_uart.h"
+#include "usbasp_sched.h"
+
+struct PtyConfig{
+	int baud;
+	int flags;              // usbasp_uart_config() flags in effect.
+	const char* link=NULL;  // Symlink to create for slave name, or NULL.
+};
+
+// Exposes UART as a pseudo-terminal until scheduler fails or SIGINT or
+// SIGTERM comes, then removes the link. Data moves
+// between PTY master and scheduler, baud, parity, byte size and stop
+// bits set on the slave with tcsetattr() reconfigure the device.
+int ptyBridge(USBasp_UART* usbasp, USBasp_Sched* sched, const PtyConfig& config);
+
+#endif
@@ -0,0 +1,461 @@
+#include "server.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+// Telnet (RFC 854) and COM-PORT-OPTION (RFC 2217) codes.
+enum{
+	TN_SE=240, TN_SB=250, TN_WILL=251, TN_WONT=252, TN_DO=253, TN_DONT=254, TN_IAC=255,
+	TN_BINARY=0, TN_SGA=3, TN_COM_PORT=44,
+	CP_SET_BAUDRATE=1, CP_SET_DATASIZE=2, CP_SET_PARITY=3, CP_SET_STOPSIZE=4,
+	CP_PURGE_DATA=12, CP_SERVER=100, // Server replies with command+100.
+};
+
+enum ParseState{ PS_DATA, PS_IAC, PS_OPTION, PS_SB, PS_SB_IAC };
+
+struct Client{
+	int fd;
+	bool started=false;  // First byte decided between raw and telnet.
+	bool telnet=false;   // Set under Server::lock, read by scheduler thread.
+	ParseState state=PS_DATA;
+	uint8_t verb=0;
+	std::vector<uint8_t> sb;
+	// Send queue, guarded by Server::lock.
+	std::vector<uint8_t> queue;
+	size_t head=0;
+	size_t len=0;
+	bool polling_out=false;
+	uint64_t dropped=0;
+	// Writer's data the TX queue had no room for; not read further meanwhile.
+	std::vector<uint8_t> pending;
+};
+
+struct Server{
+	USBasp_UART* usbasp;
+	USBasp_Sched* sched;
+	ServerConfig config;
+	int ep;
+	int wake;            // eventfd, signalled when client queues got data or TX queue room.
+	std::mutex lock;
+	std::vector<Client*> clients; // In order of connection, first one writes.
+	int baud;
+	int flags;
+};
+
+// Called with lock held. Whole chunk is dropped when it doesn't fit, so
+// the client sees a gap rather than a torn chunk.
+static void enqueue(Client* c, const uint8_t* data, size_t len, bool escape){
+	size_t need=len;
+	if(escape && c->telnet){
+		need+=std::count(data, data+len, TN_IAC);
+	}
+	size_t size=c->queue.size();
+	if(size-c->len<need){
+		c->dropped+=len;
+		return;
+	}
+	for(size_t i=0; i<len; i++){
+		c->queue[(c->head+c->len++)%size]=data[i];
+		if(escape && c->telnet && data[i]==TN_IAC){
+			c->queue[(c->head+c->len++)%size]=TN_IAC;
+		}
+	}
+}
+
+// Called on scheduler thread; never blocks on a slow client.
+static void serverRx(void* ctx, const uint8_t* data, int len){
+	Server* s=(Server*)ctx;
+	{
+		std::lock_guard<std::mutex> guard(s->lock);
+		for(Client* c : s->clients){
+			enqueue(c, data, len, true);
+		}
+	}
+	uint64_t one=1;
+	if(write(s->wake, &one, sizeof(one))<0){}
+}
+
+// Called on scheduler thread when the writer's pending data may fit.
+static void serverTxRoom(void* ctx){
+	Server* s=(Server*)ctx;
+	uint64_t one=1;
+	if(write(s->wake, &one, sizeof(one))<0){}
+}
+
+static void setEvents(Server* s, Client* c){
+	struct epoll_event ev;
+	ev.events=0;
+	if(c->pending.empty()){ ev.events|=EPOLLIN; }
+	if(c->polling_out){ ev.events|=EPOLLOUT; }
+	ev.data.ptr=c;
+	epoll_ctl(s->ep, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void setPollOut(Server* s, Client* c, bool on){
+	if(c->polling_out==on){ return; }
+	c->polling_out=on;
+	setEvents(s, c);
+}
+
+// Called with lock held.
+static void flushClient(Server* s, Client* c){
+	size_t size=c->queue.size();
+	while(c->len){
+		size_t n=std::min(c->len, size-c->head);
+		int rv=send(c->fd, c->queue.data()+c->head, n, MSG_NOSIGNAL);
+		if(rv<=0){ break; }
+		c->head=(c->head+rv)%size;
+		c->len-=rv;
+	}
+	setPollOut(s, c, c->len>0);
+}
+
+static void reply(Server* s, Client* c, const uint8_t* data, size_t len){
+	std::lock_guard<std::mutex> guard(s->lock);
+	enqueue(c, data, len, false);
+	flushClient(s, c);
+}
+
+static void replyCom(Server* s, Client* c, uint8_t cmd, const uint8_t* value, size_t len){
+	std::vector<uint8_t> msg={TN_IAC, TN_SB, TN_COM_PORT, (uint8_t)(cmd+CP_SERVER)};
+	for(size_t i=0; i<len; i++){
+		msg.push_back(value[i]);
+		if(value[i]==TN_IAC){ msg.push_back(TN_IAC); }
+	}
+	msg.push_back(TN_IAC);
+	msg.push_back(TN_SE);
+	reply(s, c, msg.data(), msg.size());
+}
+
+static bool reconfigure(Server* s, int baud, int flags){
+	if(baud==s->baud && flags==s->flags){ return true; }
+	usbasp_sched_drain(s->sched);
+	int rv=usbasp_sched_config(s->sched, baud, flags);
+	if(rv<0){
+		fprintf(stderr, "Cannot set baud %d: rv=%d\n", baud, rv);
+		return false;
+	}
+	s->baud=baud;
+	s->flags=flags;
+	if(verbose){
+		fprintf(stderr, "Reconfigured to baud %d, flags 0x%x\n", baud, flags);
+	}
+	return true;
+}
+
+// Only the writer may change settings, others just get current ones.
+static void comPortCommand(Server* s, Client* c, bool writer){
+	if(c->sb.size()<2 || c->sb[0]!=TN_COM_PORT){ return; }
+	uint8_t cmd=c->sb[1];
+	const uint8_t* arg=c->sb.data()+2;
+	size_t len=c->sb.size()-2;
+	int baud=s->baud;
+	int flags=s->flags;
+	uint8_t value[4];
+	switch(cmd){
+	case CP_SET_BAUDRATE:
+		if(len==4){
+			uint32_t b=((uint32_t)arg[0]<<24)|(arg[1]<<16)|(arg[2]<<8)|arg[3];
+			if(b && writer){ baud=b; }
+		}
+		if(!reconfigure(s, baud, flags)){ return; }
+		value[0]=s->baud>>24; value[1]=s->baud>>16; value[2]=s->baud>>8; value[3]=s->baud;
+		replyCom(s, c, cmd, value, 4);
+		break;
+	case CP_SET_DATASIZE:
+		if(len==1 && arg[0]>=5 && arg[0]<=8 && writer){
+			flags=(flags & ~USBASP_UART_BYTES_MASK)|((arg[0]-5)<<3);
+		}
+		if(!reconfigure(s, baud, flags)){ return; }
+		value[0]=5+((s->flags & USBASP_UART_BYTES_MASK)>>3);
+		replyCom(s, c, cmd, value, 1);
+		break;
+	case CP_SET_PARITY:
+		if(len==1 && writer){
+			int parity=-1;
+			switch(arg[0]){
+			case 1: parity=USBASP_UART_PARITY_NONE; break;
+			case 2: parity=USBASP_UART_PARITY_ODD; break;
+			case 3: parity=USBASP_UART_PARITY_EVEN; break;
+			default: break; // Query; mark and space aren't supported, reply tells what is set.
+			}
+			if(parity>=0){ flags=(flags & ~USBASP_UART_PARITY_MASK)|parity; }
+		}
+		if(!reconfigure(s, baud, flags)){ return; }
+		switch(s->flags & USBASP_UART_PARITY_MASK){
+		case USBASP_UART_PARITY_ODD:  value[0]=2; break;
+		case USBASP_UART_PARITY_EVEN: value[0]=3; break;
+		default:                      value[0]=1; break;
+		}
+		replyCom(s, c, cmd, value, 1);
+		break;
+	case CP_SET_STOPSIZE:
+		if(len==1 && writer && (arg[0]==1 || arg[0]==2)){
+			flags=(flags & ~USBASP_UART_STOP_MASK)|
+				(arg[0]==2?USBASP_UART_STOP_2BIT:USBASP_UART_STOP_1BIT);
+		}
+		if(!reconfigure(s, baud, flags)){ return; }
+		value[0]=(s->flags & USBASP_UART_STOP_MASK)==USBASP_UART_STOP_2BIT?2:1;
+		replyCom(s, c, cmd, value, 1);
+		break;
+	case CP_PURGE_DATA:
+		if(len==1 && writer){
+			if(arg[0]==1 || arg[0]==3){ usbasp_sched_flushrx(s->sched); }
+			if(arg[0]==2 || arg[0]==3){ usbasp_sched_flushtx(s->sched); }
+		}
+		replyCom(s, c, cmd, arg, len);
+		break;
+	default:
+		// Flow control, modem lines and notifications: acknowledge as is.
+		replyCom(s, c, cmd, arg, len);
+		break;
+	}
+}
+
+// Agree to binary, suppress-go-ahead and COM-PORT-OPTION, refuse the rest.
+static void negotiate(Server* s, Client* c, uint8_t verb, uint8_t option){
+	bool ok=option==TN_BINARY || option==TN_SGA || option==TN_COM_PORT;
+	uint8_t answer;
+	switch(verb){
+	case TN_WILL: answer=ok?TN_DO:TN_DONT; break;
+	case TN_DO:   answer=ok?TN_WILL:TN_WONT; break;
+	default: return;
+	}
+	uint8_t msg[3]={TN_IAC, answer, option};
+	reply(s, c, msg, 3);
+}
+
+// Strips telnet commands from data in place, returns length of data left.
+static size_t parseTelnet(Server* s, Client* c, uint8_t* data, size_t len, bool writer){
+	size_t out=0;
+	for(size_t i=0; i<len; i++){
+		uint8_t b=data[i];
+		switch(c->state){
+		case PS_DATA:
+			if(b==TN_IAC){ c->state=PS_IAC; }
+			else{ data[out++]=b; }
+			break;
+		case PS_IAC:
+			c->state=PS_DATA;
+			if(b==TN_IAC){ data[out++]=b; }
+			else if(b==TN_SB){
+				c->sb.clear();
+				c->state=PS_SB;
+			}
+			else if(b>=TN_WILL){
+				c->verb=b;
+				c->state=PS_OPTION;
+			}
+			break;
+		case PS_OPTION:
+			negotiate(s, c, c->verb, b);
+			c->state=PS_DATA;
+			break;
+		case PS_SB:
+			if(b==TN_IAC){ c->state=PS_SB_IAC; }
+			else if(c->sb.size()<64){ c->sb.push_back(b); }
+			break;
+		case PS_SB_IAC:
+			if(b==TN_SE){
+				comPortCommand(s, c, writer);
+				c->state=PS_DATA;
+			}
+			else{
+				if(c->sb.size()<64){ c->sb.push_back(b); }
+				c->state=PS_SB;
+			}
+			break;
+		}
+	}
+	return out;
+}
+
+static void dropClient(Server* s, Client* c){
+	epoll_ctl(s->ep, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	{
+		std::lock_guard<std::mutex> guard(s->lock);
+		s->clients.erase(std::find(s->clients.begin(), s->clients.end(), c));
+	}
+	if(c->dropped){
+		fprintf(stderr, "Client %d dropped %llu received bytes, it was too slow\n",
+				c->fd, (unsigned long long)c->dropped);
+	}
+	delete c;
+}
+
+static void acceptClient(Server* s, int listener){
+	int fd=accept(listener, NULL, NULL);
+	if(fd<0){ return; }
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL)|O_NONBLOCK);
+	int one=1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	Client* c=new Client();
+	c->fd=fd;
+	c->queue.resize(s->config.queue_size);
+	struct epoll_event ev;
+	ev.events=EPOLLIN;
+	ev.data.ptr=c;
+	epoll_ctl(s->ep, EPOLL_CTL_ADD, fd, &ev);
+	std::lock_guard<std::mutex> guard(s->lock);
+	s->clients.push_back(c);
+	if(verbose){
+		fprintf(stderr, "Client %d connected as %s\n", fd,
+				s->clients.size()==1?"writer":"observer");
+	}
+}
+
+// Queues writer's pending data without blocking the loop. Until all of it
+// fits the client isn't read, so TCP flow control holds it back. Returns
+// <0 when scheduler failed.
+static int sendPending(Server* s, Client* c){
+	if(c->pending.empty()){ return 0; }
+	int rv=usbasp_sched_try_write(s->sched, c->pending.data(), c->pending.size());
+	if(rv<0){ return rv; }
+	c->pending.erase(c->pending.begin(), c->pending.begin()+rv);
+	if(c->pending.empty()){
+		std::lock_guard<std::mutex> guard(s->lock);
+		setEvents(s, c);
+	}
+	return 0;
+}
+
+// Returns <0 when scheduler failed.
+static int readClient(Server* s, Client* c, uint32_t events){
+	if(!c->pending.empty()){
+		// Not polled for input meanwhile, so it hung up.
+		if(events & (EPOLLHUP|EPOLLERR)){ dropClient(s, c); }
+		return 0;
+	}
+	uint8_t buff[4096];
+	int len=recv(c->fd, buff, sizeof(buff), 0);
+	if(len==0 || (len<0 && errno!=EAGAIN && errno!=EINTR)){
+		dropClient(s, c);
+		return 0;
+	}
+	if(len<0){ return 0; }
+	bool writer;
+	{
+		// Scheduler thread reads telnet when escaping received data.
+		std::lock_guard<std::mutex> guard(s->lock);
+		if(!c->started){
+			c->started=true;
+			c->telnet=buff[0]==TN_IAC;
+		}
+		writer=s->clients.front()==c;
+	}
+	size_t n=c->telnet?parseTelnet(s, c, buff, len, writer):(size_t)len;
+	if(writer && n>0){
+		int rv=usbasp_sched_try_write(s->sched, buff, n);
+		if(rv<0){ return rv; }
+		if((size_t)rv<n){
+			c->pending.assign(buff+rv, buff+n);
+			std::lock_guard<std::mutex> guard(s->lock);
+			setEvents(s, c);
+		}
+	}
+	return 0;
+}
+
+int serveTcp(USBasp_UART* usbasp, USBasp_Sched* sched, const ServerConfig& config){
+	int listener=socket(AF_INET, SOCK_STREAM, 0);
+	int one=1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_port=htons(config.port);
+	if(inet_pton(AF_INET, config.addr, &addr.sin_addr)!=1 ||
+			bind(listener, (struct sockaddr*)&addr, sizeof(addr))!=0 ||
+			listen(listener, 16)!=0){
+		fprintf(stderr, "Cannot listen on %s:%d: %s\n", config.addr, config.port, strerror(errno));
+		close(listener);
+		return -1;
+	}
+	fprintf(stderr, "UART is available at %s:%d\n", config.addr, config.port);
+
+	Server s;
+	s.usbasp=usbasp;
+	s.sched=sched;
+	s.config=config;
+	s.baud=config.baud;
+	s.flags=config.flags;
+	s.ep=epoll_create1(0);
+	s.wake=eventfd(0, EFD_NONBLOCK);
+	struct epoll_event ev;
+	ev.events=EPOLLIN;
+	ev.data.ptr=&listener;
+	epoll_ctl(s.ep, EPOLL_CTL_ADD, listener, &ev);
+	ev.data.ptr=&s.wake;
+	epoll_ctl(s.ep, EPOLL_CTL_ADD, s.wake, &ev);
+
+	sched->on_rx=serverRx;
+	sched->on_tx_room=serverTxRoom;
+	sched->ctx=&s;
+	if(usbasp_sched_start(sched, usbasp)!=0){
+		fprintf(stderr, "Cannot start scheduler\n");
+		close(s.wake);
+		close(s.ep);
+		close(listener);
+		return -1;
+	}
+	int rv=0;
+	struct epoll_event events[16];
+	while(sched->running && rv>=0){
+		int n=epoll_wait(s.ep, events, 16, 200);
+		if(n<0 && errno!=EINTR){ break; }
+		for(int i=0; i<n && rv>=0; i++){
+			void* ptr=events[i].data.ptr;
+			if(ptr==&listener){
+				acceptClient(&s, listener);
+			}
+			else if(ptr==&s.wake){
+				uint64_t count;
+				if(read(s.wake, &count, sizeof(count))<0){}
+				Client* writer=NULL;
+				{
+					std::lock_guard<std::mutex> guard(s.lock);
+					for(Client* c : s.clients){
+						if(!c->polling_out){ flushClient(&s, c); }
+					}
+					if(!s.clients.empty()){ writer=s.clients.front(); }
+				}
+				if(writer){ rv=sendPending(&s, writer); }
+			}
+			else{
+				Client* c=(Client*)ptr;
+				if(events[i].events & EPOLLOUT){
+					std::lock_guard<std::mutex> guard(s.lock);
+					flushClient(&s, c);
+				}
+				// Client may be gone after this, so it goes last.
+				if(events[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR)){
+					rv=readClient(&s, c, events[i].events);
+				}
+			}
+		}
+	}
+	if(rv>=0 && !sched->running){
+		rv=usbasp_sched_wait(sched);
+	}
+	usbasp_sched_stop(sched);
+	while(!s.clients.empty()){
+		dropClient(&s, s.clients.front());
+	}
+	close(s.wake);
+	close(s.ep);
+	close(listener);
+	return rv;
+}
@@ -0,0 +1,21 @@
+#ifndef SERVER_H_
+#define SERVER_H_
+
+#include "usbasp_uart.h"
+#include "usbasp_sched.h"
+
+struct ServerConfig{
+	const char* addr="127.0.0.1";
+	int port=0;
+	int baud;
+	int flags;                 // usbasp_uart_config() flags in effect.
+	size_t queue_size=65536;   // Per-client send queue.
+};
+
+// Shares UART over TCP until scheduler fails. Every client gets received
+// data; the oldest one is the writer, whose data goes to UART and whose
+// RFC 2217 commands change baud and line settings. Clients starting with
+// telnet IAC are spoken RFC 2217 to, others get raw bytes.
+int serveTcp(USBasp_UART* usbasp, USBasp_Sched* sched, const ServerConfig& config);
+
+#endif
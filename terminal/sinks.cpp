@@ -0,0 +1,203 @@
+#include "sinks.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string>
+
+#define SINK_CONNECT_MS 3000 // Gives up on a tcp: sink not answering.
+
+static int writeFd(void* ctx, const uint8_t* data, size_t len){
+	int fd=(int)(intptr_t)ctx;
+	while(len>0){
+		ssize_t rv=write(fd, data, len);
+		if(rv<0){
+			if(errno==EINTR){ continue; }
+			return -1;
+		}
+		data+=rv;
+		len-=rv;
+	}
+	return 0;
+}
+
+static int sendSocket(void* ctx, const uint8_t* data, size_t len){
+	int fd=(int)(intptr_t)ctx;
+	while(len>0){
+		ssize_t rv=send(fd, data, len, MSG_NOSIGNAL);
+		if(rv<0){
+			if(errno==EINTR){ continue; }
+			return -1;
+		}
+		data+=rv;
+		len-=rv;
+	}
+	return 0;
+}
+
+// Reports every occurrence of text in the stream, also across chunks.
+struct Matcher{
+	std::string text;
+	std::string window;  // Last text.size()-1 bytes of previous chunks.
+	uint64_t offset=0;   // Stream position of window start.
+	uint64_t matches=0;
+};
+
+static int match(void* ctx, const uint8_t* data, size_t len){
+	Matcher* m=(Matcher*)ctx;
+	m->window.append((const char*)data, len);
+	for(size_t at=m->window.find(m->text); at!=std::string::npos;
+			at=m->window.find(m->text, at+1)){
+		m->matches++;
+		fprintf(stderr, "Matched \"%s\" at byte %llu\n", m->text.c_str(),
+				(unsigned long long)(m->offset+at));
+	}
+	size_t keep=m->text.size()-1;
+	if(m->window.size()>keep){
+		m->offset+=m->window.size()-keep;
+		m->window.erase(0, m->window.size()-keep);
+	}
+	return 0;
+}
+
+static int connectTcp(const std::string& host, const std::string& port){
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype=SOCK_STREAM;
+	struct addrinfo* res;
+	if(getaddrinfo(host.c_str(), port.c_str(), &hints, &res)!=0){
+		return -1;
+	}
+	// Non-blocking only while connecting, so it can time out.
+	int fd=socket(res->ai_family, res->ai_socktype|SOCK_NONBLOCK, res->ai_protocol);
+	if(fd>=0 && connect(fd, res->ai_addr, res->ai_addrlen)!=0){
+		struct pollfd p;
+		p.fd=fd;
+		p.events=POLLOUT;
+		int err=0;
+		socklen_t len=sizeof(err);
+		if(errno!=EINPROGRESS || poll(&p, 1, SINK_CONNECT_MS)!=1 ||
+				getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len)!=0 || err){
+			close(fd);
+			fd=-1;
+		}
+	}
+	if(fd>=0){
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+void freeSink(USBasp_Tee_Sink* sink){
+	if(sink->write==match){
+		delete (Matcher*)sink->ctx;
+	}
+	else if(sink->write && (intptr_t)sink->ctx!=STDOUT_FILENO){
+		close((int)(intptr_t)sink->ctx);
+	}
+	free((char*)sink->name);
+	delete sink;
+}
+
+USBasp_Tee_Sink* makeSink(const char* spec){
+	std::string s=spec;
+	USBasp_Tee_Sink* sink=new USBasp_Tee_Sink();
+	sink->policy=-1;
+	size_t slash=s.rfind('/');
+	if(slash!=std::string::npos && (s.substr(slash)=="/drop" || s.substr(slash)=="/block")){
+		sink->policy=s.substr(slash)=="/drop"?USBASP_TEE_DROP:USBASP_TEE_BLOCK;
+		s.erase(slash);
+	}
+	sink->name=strdup(s.c_str());
+	int policy=USBASP_TEE_BLOCK;
+	if(s=="stdout"){
+		sink->write=writeFd;
+		sink->ctx=(void*)(intptr_t)STDOUT_FILENO;
+	}
+	else if(s.compare(0, 5, "file:")==0){
+		int fd=open(s.c_str()+5, O_WRONLY|O_CREAT|O_APPEND, 0644);
+		if(fd<0){
+			fprintf(stderr, "Cannot open %s: %s\n", s.c_str()+5, strerror(errno));
+			freeSink(sink);
+			return NULL;
+		}
+		sink->write=writeFd;
+		sink->ctx=(void*)(intptr_t)fd;
+	}
+	else if(s.compare(0, 4, "tcp:")==0 && s.rfind(':')>3){
+		size_t colon=s.rfind(':');
+		int fd=connectTcp(s.substr(4, colon-4), s.substr(colon+1));
+		if(fd<0){
+			fprintf(stderr, "Cannot connect to %s\n", s.c_str()+4);
+			freeSink(sink);
+			return NULL;
+		}
+		sink->write=sendSocket;
+		sink->ctx=(void*)(intptr_t)fd;
+		policy=USBASP_TEE_DROP;
+	}
+	else if(s.compare(0, 6, "match:")==0 && s.size()>6){
+		Matcher* m=new Matcher();
+		m->text=s.substr(6);
+		sink->write=match;
+		sink->ctx=m;
+		policy=USBASP_TEE_DROP;
+	}
+	else{
+		fprintf(stderr, "Unknown sink %s\n", spec);
+		freeSink(sink);
+		return NULL;
+	}
+	if(sink->policy<0){
+		sink->policy=policy;
+	}
+	return sink;
+}
+
+bool addSink(USBasp_Tee* tee, const char* spec){
+	USBasp_Tee_Sink* sink=makeSink(spec);
+	if(!sink){
+		return false;
+	}
+	if(usbasp_tee_add(tee, sink)!=0){
+		freeSink(sink);
+		return false;
+	}
+	return true;
+}
+
+struct FilterSink{
+	LineFilter* filter;
+	std::string out;
+};
+
+static int filterLines(void* ctx, const uint8_t* data, size_t len){
+	FilterSink* f=(FilterSink*)ctx;
+	f->out.clear();
+	f->filter->feed(data, len, f->out);
+	return writeFd((void*)(intptr_t)STDOUT_FILENO, (const uint8_t*)f->out.data(), f->out.size());
+}
+
+bool addFilterSink(USBasp_Tee* tee, LineFilter* filter){
+	FilterSink* f=new FilterSink();
+	f->filter=filter;
+	USBasp_Tee_Sink* sink=new USBasp_Tee_Sink();
+	sink->name="filter";
+	sink->write=filterLines;
+	sink->ctx=f;
+	sink->policy=USBASP_TEE_BLOCK;
+	if(usbasp_tee_add(tee, sink)!=0){
+		delete sink;
+		delete f;
+		return false;
+	}
+	return true;
+}
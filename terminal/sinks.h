@@ -0,0 +1,19 @@
+#ifndef SINKS_H_
+#define SINKS_H_
+
+#include "usbasp_tee.h"
+#include "filter.h"
+
+// Creates sink described by SPEC: stdout, file:PATH, tcp:HOST:PORT or
+// match:TEXT, optionally followed by /drop or /block. By default stdout
+// and files block, sockets and matchers drop. Returns NULL on error.
+USBasp_Tee_Sink* makeSink(const char* spec);
+// Undoes makeSink(), for a sink not in a tee.
+void freeSink(USBasp_Tee_Sink* sink);
+// Same, and adds the sink to tee.
+bool addSink(USBasp_Tee* tee, const char* spec);
+// Adds a sink passing only lines filter lets through to stdout. Blocks
+// when full, like stdout.
+bool addFilterSink(USBasp_Tee* tee, LineFilter* filter);
+
+#endif
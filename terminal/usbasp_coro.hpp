@@ -0,0 +1,381 @@
+#ifndef USBASP_CORO_HPP_
+#define USBASP_CORO_HPP_
+
+// C++20 coroutines over asynchronous control transfers. One Executor
+// thread runs libusb event handling for every device and resumes the
+// coroutines whose transfers or timers completed, so many scripted
+// sessions need neither a thread each nor blocking calls:
+//
+//   usbasp::Task<void> session(usbasp::AsyncUart& uart){
+//       co_await uart.write_all(command);
+//       auto line=co_await uart.read_until("OK\r\n", std::chrono::seconds(2));
+//   }
+//   executor.spawn(session(uart));
+//   executor.run();
+
+#if __cplusplus < 202002L
+#error "usbasp_coro.hpp needs C++20"
+#endif
+
+#include "usbasp_uart.hpp"
+
+#include <algorithm>
+#include <coroutine>
+#include <cstring>
+#include <exception>
+#include <optional>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace usbasp{
+
+template<class T> class Task;
+
+namespace detail{
+
+struct PromiseBase{
+	std::coroutine_handle<> continuation;
+	std::exception_ptr error;
+
+	std::suspend_always initial_suspend() noexcept{ return {}; }
+	// Finished task goes on with whoever awaited it, without recursion.
+	struct Final{
+		bool await_ready() noexcept{ return false; }
+		template<class P>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept{
+			auto next=h.promise().continuation;
+			return next?next:std::noop_coroutine();
+		}
+		void await_resume() noexcept{}
+	};
+	Final final_suspend() noexcept{ return {}; }
+	void unhandled_exception() noexcept{ error=std::current_exception(); }
+};
+
+template<class T> struct Promise: PromiseBase{
+	std::optional<T> value;
+	Task<T> get_return_object() noexcept;
+	void return_value(T v){ value.emplace(std::move(v)); }
+	T take(){
+		if(error){ std::rethrow_exception(error); }
+		return std::move(*value);
+	}
+};
+
+template<> struct Promise<void>: PromiseBase{
+	Task<void> get_return_object() noexcept;
+	void return_void() noexcept{}
+	void take(){
+		if(error){ std::rethrow_exception(error); }
+	}
+};
+
+}
+
+// Lazy coroutine: starts when awaited or spawned.
+template<class T=void> class Task{
+public:
+	using promise_type=detail::Promise<T>;
+	using Handle=std::coroutine_handle<promise_type>;
+
+	explicit Task(Handle h) noexcept: handle_(h){}
+	Task(Task&& other) noexcept: handle_(std::exchange(other.handle_, nullptr)){}
+	Task& operator=(Task&& other) noexcept{
+		if(handle_){ handle_.destroy(); }
+		handle_=std::exchange(other.handle_, nullptr);
+		return *this;
+	}
+	Task(const Task&)=delete;
+	~Task(){
+		if(handle_){ handle_.destroy(); }
+	}
+
+	bool await_ready() const noexcept{ return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept{
+		handle_.promise().continuation=caller;
+		return handle_;
+	}
+	T await_resume(){ return handle_.promise().take(); }
+
+	Handle handle() const noexcept{ return handle_; }
+
+private:
+	Handle handle_;
+};
+
+template<class T> Task<T> detail::Promise<T>::get_return_object() noexcept{
+	return Task<T>(Task<T>::Handle::from_promise(*this));
+}
+
+inline Task<void> detail::Promise<void>::get_return_object() noexcept{
+	return Task<void>(Task<void>::Handle::from_promise(*this));
+}
+
+// Single-threaded: all coroutines spawned on it, and the transfers they
+// start, run on the thread calling run(). Transfer callbacks only queue
+// coroutines, which are resumed after libusb returns.
+class Executor{
+public:
+	// Starts task at once, runs it to completion on this executor.
+	void spawn(Task<void> task){
+		auto h=task.handle();
+		tasks_.push_back(std::move(task));
+		ready_.push(h);
+	}
+
+	// Runs until all spawned tasks finished. An exception of one of them
+	// is thrown from here, after the transfers still in flight were
+	// cancelled and the other tasks destroyed.
+	void run(){
+		while(!tasks_.empty()){
+			while(!ready_.empty()){
+				auto h=ready_.front();
+				ready_.pop();
+				h.resume();
+			}
+			reap();
+			if(tasks_.empty()){ break; }
+			auto wait=std::chrono::milliseconds(100);
+			auto now=Clock::now();
+			std::chrono::nanoseconds left=wait;
+			if(!timers_.empty()){
+				left=timers_.top().at>now?timers_.top().at-now:Clock::duration::zero();
+				if(left>wait){ left=wait; }
+			}
+			if(!inflight_.empty()){
+				struct timeval tv;
+				tv.tv_sec=left.count()/1000000000;
+				tv.tv_usec=left.count()%1000000000/1000;
+				libusb_handle_events_timeout_completed(usbasp_uart_context(), &tv, nullptr);
+			}
+			else if(left.count()>0){
+				std::this_thread::sleep_for(left);
+			}
+			now=Clock::now();
+			while(!timers_.empty() && timers_.top().at<=now){
+				ready_.push(timers_.top().handle);
+				timers_.pop();
+			}
+		}
+	}
+
+	// Awaitable pause, e.g. co_await executor.sleep(1ms).
+	auto sleep(Clock::duration d){
+		struct Sleep{
+			Executor* ex;
+			Deadline at;
+			bool await_ready() const noexcept{ return false; }
+			void await_suspend(std::coroutine_handle<> h){ ex->timers_.push(Timer{at, h}); }
+			void await_resume() const noexcept{}
+		};
+		return Sleep{this, Clock::now()+d};
+	}
+
+private:
+	friend class AsyncUart;
+
+	struct Timer{
+		Deadline at;
+		std::coroutine_handle<> handle;
+		bool operator>(const Timer& other) const noexcept{ return at>other.at; }
+	};
+
+	void reap(){
+		for(size_t i=0; i<tasks_.size(); ){
+			if(!tasks_[i].handle().done()){
+				i++;
+				continue;
+			}
+			Task<void> done=std::move(tasks_[i]);
+			tasks_.erase(tasks_.begin()+i);
+			try{
+				done.handle().promise().take();
+			}
+			catch(...){
+				abort();
+				throw;
+			}
+		}
+	}
+
+	// Cancels the transfers in flight and waits for their callbacks, as
+	// they point into coroutine frames, then destroys the tasks left.
+	void abort() noexcept{
+		for(libusb_transfer* xfer : inflight_){
+			libusb_cancel_transfer(xfer);
+		}
+		while(!inflight_.empty()){
+			struct timeval tv={0, 100000};
+			if(libusb_handle_events_timeout_completed(usbasp_uart_context(), &tv, nullptr)<0){
+				break;
+			}
+		}
+		ready_={};
+		timers_={};
+		tasks_.clear();
+	}
+
+	std::vector<Task<void>> tasks_;
+	std::queue<std::coroutine_handle<>> ready_;
+	std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers_;
+	std::vector<libusb_transfer*> inflight_;
+};
+
+// Coroutine side of an open Uart. Data read past a read_until() match
+// stays buffered for the next read. On a closed or suspended Uart every
+// operation throws Error with LIBUSB_ERROR_NO_DEVICE.
+class AsyncUart{
+public:
+	AsyncUart(Executor& ex, Uart& uart, Clock::duration poll=std::chrono::milliseconds(1))
+		: ex_(ex), uart_(uart.native()), poll_(poll){}
+
+	// Waits for at least one byte, returns how many were read into buff.
+	Task<size_t> read_some(span<uint8_t> buff){
+		if(!pending_.empty()){
+			co_return takePending(buff.data(), buff.size());
+		}
+		while(1){
+			size_t len=buff.size()<USBASP_CHUNK_SIZE?buff.size():USBASP_CHUNK_SIZE;
+			int rv=co_await transfer(USBASP_FUNC_UART_RX, true, buff.data(), len);
+			if(rv<0){ throw Error(transferError(rv), "usbasp read"); }
+			if(rv>0){ co_return (size_t)rv; }
+			co_await ex_.sleep(poll_);
+		}
+	}
+
+	// Sends all of data, waiting for room in firmware buffer.
+	Task<void> write_all(span<const uint8_t> data){
+		size_t done=0;
+		while(done<data.size()){
+			uint8_t room[2];
+			int rv=co_await transfer(USBASP_FUNC_UART_TX_FREE, true, room, 2);
+			if(rv<0){ throw Error(transferError(rv), "usbasp write"); }
+			size_t avail=(room[0]<<8)|room[1];
+			if(rv<2 || avail==0){
+				co_await ex_.sleep(poll_);
+				continue;
+			}
+			size_t len=data.size()-done;
+			if(len>avail){ len=avail; }
+			if(len>USBASP_CHUNK_SIZE){ len=USBASP_CHUNK_SIZE; }
+			rv=co_await transfer(USBASP_FUNC_UART_TX, false,
+					const_cast<uint8_t*>(data.data()+done), len);
+			if(rv<0){ throw Error(transferError(rv), "usbasp write"); }
+			done+=rv;
+		}
+	}
+
+	// Reads until delim was received, returns everything up to and
+	// including it. Nothing is consumed when timeout passes first.
+	Task<std::optional<std::string>> read_until(std::string_view delim, Clock::duration timeout){
+		Deadline deadline=Clock::now()+timeout;
+		size_t searched=0;
+		while(1){
+			size_t at=pending_.find(delim, searched);
+			if(at!=std::string::npos){
+				std::string line=pending_.substr(0, at+delim.size());
+				pending_.erase(0, at+delim.size());
+				co_return line;
+			}
+			searched=pending_.size()>=delim.size()?pending_.size()-delim.size()+1:0;
+			if(Clock::now()>=deadline){
+				co_return std::nullopt;
+			}
+			uint8_t buff[USBASP_CHUNK_SIZE];
+			int rv=co_await transfer(USBASP_FUNC_UART_RX, true, buff, sizeof(buff));
+			if(rv<0){ throw Error(transferError(rv), "usbasp read"); }
+			if(rv==0){
+				co_await ex_.sleep(poll_);
+				continue;
+			}
+			pending_.append((const char*)buff, rv);
+		}
+	}
+
+private:
+	// One control transfer; resumes with its length or a libusb error.
+	struct Transfer{
+		AsyncUart* uart;
+		uint8_t func;
+		bool in;
+		uint8_t* data;
+		size_t len;
+		libusb_transfer* xfer=nullptr;
+		std::coroutine_handle<> handle;
+		int rv=LIBUSB_ERROR_NO_MEM;
+		uint8_t buff[LIBUSB_CONTROL_SETUP_SIZE+USBASP_CHUNK_SIZE];
+
+		Transfer(AsyncUart* uart, uint8_t func, bool in, uint8_t* data, size_t len) noexcept
+			: uart(uart), func(func), in(in), data(data), len(len){}
+		Transfer(const Transfer&)=delete;
+		// Frees the transfer of a coroutine destroyed while suspended.
+		~Transfer(){
+			if(xfer){ libusb_free_transfer(xfer); }
+		}
+
+		bool await_ready() const noexcept{ return false; }
+		bool await_suspend(std::coroutine_handle<> h){
+			handle=h;
+			if(!uart->uart_ || !uart->uart_->usbhandle){
+				rv=LIBUSB_ERROR_NO_DEVICE;
+				return false;
+			}
+			xfer=libusb_alloc_transfer(0);
+			if(!xfer){ return false; }
+			libusb_fill_control_setup(buff,
+					LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE |
+					(in?LIBUSB_ENDPOINT_IN:LIBUSB_ENDPOINT_OUT), func, 0, 0, len);
+			if(!in){ memcpy(buff+LIBUSB_CONTROL_SETUP_SIZE, data, len); }
+			libusb_fill_control_transfer(xfer, uart->uart_->usbhandle, buff, done, this,
+					usbasp_uart_timeout(uart->uart_));
+			rv=libusb_submit_transfer(xfer);
+			if(rv!=0){ return false; }
+			uart->ex_.inflight_.push_back(xfer);
+			return true;
+		}
+		int await_resume(){
+			if(xfer){ libusb_free_transfer(xfer); }
+			xfer=nullptr;
+			if(rv>0 && in){ memcpy(data, buff+LIBUSB_CONTROL_SETUP_SIZE, rv); }
+			return rv;
+		}
+
+		static void done(libusb_transfer* xfer){
+			Transfer* t=(Transfer*)xfer->user_data;
+			switch(xfer->status){
+			case LIBUSB_TRANSFER_COMPLETED: t->rv=xfer->actual_length; break;
+			case LIBUSB_TRANSFER_TIMED_OUT: t->rv=LIBUSB_ERROR_TIMEOUT; break;
+			case LIBUSB_TRANSFER_STALL:     t->rv=LIBUSB_ERROR_PIPE; break;
+			case LIBUSB_TRANSFER_NO_DEVICE: t->rv=LIBUSB_ERROR_NO_DEVICE; break;
+			default:                        t->rv=LIBUSB_ERROR_IO; break;
+			}
+			auto& inflight=t->uart->ex_.inflight_;
+			inflight.erase(std::find(inflight.begin(), inflight.end(), xfer));
+			t->uart->ex_.ready_.push(t->handle);
+		}
+	};
+
+	Transfer transfer(uint8_t func, bool in, uint8_t* data, size_t len){
+		return Transfer(this, func, in, data, len);
+	}
+
+	size_t takePending(uint8_t* buff, size_t len){
+		if(len>pending_.size()){ len=pending_.size(); }
+		memcpy(buff, pending_.data(), len);
+		pending_.erase(0, len);
+		return len;
+	}
+
+	Executor& ex_;
+	USBasp_UART* uart_;
+	Clock::duration poll_;
+	std::string pending_;
+};
+
+}
+
+#endif
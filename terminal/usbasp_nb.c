@@ -0,0 +1,368 @@
+#include "usbasp_nb.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+typedef struct USBasp_UART_NB{
+	USBasp_UART* usbasp;
+	int poll_us;
+	int epfd;              // Handed to caller: libusb pollfds, timerfd, eventfd.
+	int timerfd;           // Next RX poll or TX retry, libusb timeouts.
+	int eventfd;           // Readable while handle is ready for caller.
+	int signalled;
+	int error;             // libusb error handle failed with, no more transfers.
+	int want_write;        // try_write() took less than offered.
+
+	struct libusb_transfer* rx_xfer;
+	uint8_t rx_buff[LIBUSB_CONTROL_SETUP_SIZE+USBASP_CHUNK_SIZE];
+	int rx_busy;
+	uint64_t rx_next_ns;
+	uint8_t rxq[USBASP_NB_QUEUE];
+	size_t rx_head;
+	size_t rx_len;
+
+	struct libusb_transfer* tx_xfer;
+	uint8_t tx_buff[LIBUSB_CONTROL_SETUP_SIZE+USBASP_CHUNK_SIZE];
+	int tx_busy;
+	int tx_query;          // Transfer in flight asks for room, not sends.
+	size_t tx_room;        // Firmware room left, as last reported.
+	uint64_t tx_next_ns;
+	uint8_t txq[USBASP_NB_QUEUE];
+	size_t tx_head;
+	size_t tx_len;         // Includes bytes in flight.
+
+	struct USBasp_UART_NB* next;
+} USBasp_UART_NB;
+
+// libusb pollfds belong to the shared context, so every handle's epoll
+// set holds all of them.
+static USBasp_UART_NB* usbasp_nb_handles;
+static int usbasp_nb_usb_timeouts;
+
+static void usbasp_nb_watch(USBasp_UART_NB* nb, int fd, short events){
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	if(events&POLLIN){ ev.events|=EPOLLIN; }
+	if(events&POLLOUT){ ev.events|=EPOLLOUT; }
+	ev.data.fd=fd;
+	epoll_ctl(nb->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void usbasp_nb_fd_added(int fd, short events, void* arg){
+	(void)arg;
+	for(USBasp_UART_NB* nb=usbasp_nb_handles; nb; nb=nb->next){
+		usbasp_nb_watch(nb, fd, events);
+	}
+}
+
+static void usbasp_nb_fd_removed(int fd, void* arg){
+	(void)arg;
+	for(USBasp_UART_NB* nb=usbasp_nb_handles; nb; nb=nb->next){
+		epoll_ctl(nb->epfd, EPOLL_CTL_DEL, fd, NULL);
+	}
+}
+
+static int usbasp_nb_ready(const USBasp_UART_NB* nb){
+	return nb->rx_len>0 || nb->error || (nb->want_write && nb->tx_len<USBASP_NB_QUEUE);
+}
+
+// Keeps eventfd readable exactly while caller has something to do.
+static void usbasp_nb_update(USBasp_UART_NB* nb){
+	uint64_t tmp=1;
+	int ready=usbasp_nb_ready(nb);
+	if(ready && !nb->signalled){
+		if(write(nb->eventfd, &tmp, sizeof(tmp))<0){}
+		nb->signalled=1;
+	}
+	else if(!ready && nb->signalled){
+		if(read(nb->eventfd, &tmp, sizeof(tmp))<0){}
+		nb->signalled=0;
+	}
+}
+
+static void usbasp_nb_fail(USBasp_UART_NB* nb, int status){
+	switch(status){
+	case LIBUSB_TRANSFER_NO_DEVICE: nb->error=LIBUSB_ERROR_NO_DEVICE; break;
+	case LIBUSB_TRANSFER_STALL:     nb->error=LIBUSB_ERROR_PIPE; break;
+	case LIBUSB_TRANSFER_OVERFLOW:  nb->error=LIBUSB_ERROR_OVERFLOW; break;
+	default:                        nb->error=LIBUSB_ERROR_IO; break;
+	}
+}
+
+static void usbasp_nb_pump(USBasp_UART_NB* nb);
+
+static void usbasp_nb_rx_done(struct libusb_transfer* xfer){
+	USBasp_UART_NB* nb=(USBasp_UART_NB*)xfer->user_data;
+	uint64_t now=usbasp_uart_now_ns();
+	nb->rx_busy=0;
+	nb->rx_next_ns=now+(uint64_t)nb->poll_us*1000;
+	if(xfer->status==LIBUSB_TRANSFER_CANCELLED){ return; }
+	if(xfer->status!=LIBUSB_TRANSFER_COMPLETED && xfer->status!=LIBUSB_TRANSFER_TIMED_OUT){
+		usbasp_nb_fail(nb, xfer->status);
+	}
+	else if(xfer->status==LIBUSB_TRANSFER_COMPLETED && xfer->actual_length>0){
+		const uint8_t* data=libusb_control_transfer_get_data(xfer);
+		size_t len=xfer->actual_length;
+		size_t tail=(nb->rx_head+nb->rx_len)%USBASP_NB_QUEUE;
+		size_t first=USBASP_NB_QUEUE-tail;
+		if(first>len){ first=len; }
+		memcpy(nb->rxq+tail, data, first);
+		memcpy(nb->rxq, data+first, len-first);
+		nb->rx_len+=len;
+		if(!nb->usbasp->first_rx_ns){
+			nb->usbasp->first_rx_ns=now;
+		}
+		nb->rx_next_ns=now; // Firmware may have more already.
+	}
+	usbasp_nb_pump(nb);
+	usbasp_nb_update(nb);
+}
+
+static void usbasp_nb_tx_done(struct libusb_transfer* xfer){
+	USBasp_UART_NB* nb=(USBasp_UART_NB*)xfer->user_data;
+	uint64_t now=usbasp_uart_now_ns();
+	nb->tx_busy=0;
+	nb->tx_next_ns=now;
+	if(xfer->status==LIBUSB_TRANSFER_CANCELLED){ return; }
+	if(xfer->status==LIBUSB_TRANSFER_TIMED_OUT){
+		nb->tx_next_ns=now+(uint64_t)nb->poll_us*1000;
+	}
+	else if(xfer->status!=LIBUSB_TRANSFER_COMPLETED){
+		usbasp_nb_fail(nb, xfer->status);
+	}
+	else if(nb->tx_query){
+		const uint8_t* room=libusb_control_transfer_get_data(xfer);
+		nb->tx_room=xfer->actual_length<2?0:(size_t)((room[0]<<8)|room[1]);
+		if(!nb->tx_room){
+			nb->tx_next_ns=now+(uint64_t)nb->poll_us*1000;
+		}
+	}
+	else{
+		size_t sent=xfer->actual_length;
+		if(sent>nb->tx_len){ sent=nb->tx_len; }
+		nb->tx_head=(nb->tx_head+sent)%USBASP_NB_QUEUE;
+		nb->tx_len-=sent;
+		nb->tx_room=sent<nb->tx_room?nb->tx_room-sent:0;
+	}
+	usbasp_nb_pump(nb);
+	usbasp_nb_update(nb);
+}
+
+static int usbasp_nb_submit(USBasp_UART_NB* nb, struct libusb_transfer* xfer, uint8_t* buff,
+		uint8_t endpoint, uint8_t func, size_t len, libusb_transfer_cb_fn done){
+	if(!nb->usbasp->usbhandle){
+		nb->error=LIBUSB_ERROR_NO_DEVICE;
+		return nb->error;
+	}
+	libusb_fill_control_setup(buff,
+			LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | endpoint, func, 0, 0, len);
+	libusb_fill_control_transfer(xfer, nb->usbasp->usbhandle, buff, done, nb,
+			usbasp_uart_timeout(nb->usbasp));
+	int rv=libusb_submit_transfer(xfer);
+	if(rv!=0){
+		nb->error=rv;
+	}
+	return rv;
+}
+
+static void usbasp_nb_submit_tx(USBasp_UART_NB* nb){
+	if(!nb->tx_room){
+		nb->tx_query=1;
+		if(usbasp_nb_submit(nb, nb->tx_xfer, nb->tx_buff, LIBUSB_ENDPOINT_IN,
+				USBASP_FUNC_UART_TX_FREE, 2, usbasp_nb_tx_done)==0){
+			nb->tx_busy=1;
+		}
+		return;
+	}
+	size_t len=USBASP_NB_QUEUE-nb->tx_head;
+	if(len>nb->tx_len){ len=nb->tx_len; }
+	if(len>nb->tx_room){ len=nb->tx_room; }
+	if(len>USBASP_CHUNK_SIZE){ len=USBASP_CHUNK_SIZE; }
+	memcpy(nb->tx_buff+LIBUSB_CONTROL_SETUP_SIZE, nb->txq+nb->tx_head, len);
+	nb->tx_query=0;
+	if(usbasp_nb_submit(nb, nb->tx_xfer, nb->tx_buff, LIBUSB_ENDPOINT_OUT,
+			USBASP_FUNC_UART_TX, len, usbasp_nb_tx_done)==0){
+		nb->tx_busy=1;
+	}
+}
+
+// Arms timerfd for the earliest of next transfer and libusb timeouts.
+static void usbasp_nb_arm(USBasp_UART_NB* nb, uint64_t now, uint64_t wake){
+	struct timeval tv;
+	if(!usbasp_nb_usb_timeouts &&
+			libusb_get_next_timeout(usbasp_uart_context(), &tv)==1){
+		uint64_t at=now+(uint64_t)tv.tv_sec*1000000000+(uint64_t)tv.tv_usec*1000;
+		if(at<wake){ wake=at; }
+	}
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	if(wake!=UINT64_MAX){
+		uint64_t ns=wake>now?wake-now:1000;
+		its.it_value.tv_sec=ns/1000000000;
+		its.it_value.tv_nsec=ns%1000000000;
+	}
+	timerfd_settime(nb->timerfd, 0, &its, NULL);
+}
+
+// Starts whatever transfers are due. RX is polled only while the queue
+// has room for a whole chunk; firmware buffers meanwhile.
+static void usbasp_nb_pump(USBasp_UART_NB* nb){
+	if(nb->error){ return; }
+	uint64_t now=usbasp_uart_now_ns();
+	uint64_t wake=UINT64_MAX;
+	if(!nb->rx_busy && USBASP_NB_QUEUE-nb->rx_len>=USBASP_CHUNK_SIZE){
+		if(nb->rx_next_ns<=now){
+			if(usbasp_nb_submit(nb, nb->rx_xfer, nb->rx_buff, LIBUSB_ENDPOINT_IN,
+					USBASP_FUNC_UART_RX, USBASP_CHUNK_SIZE, usbasp_nb_rx_done)==0){
+				nb->rx_busy=1;
+			}
+		}
+		else{
+			wake=nb->rx_next_ns;
+		}
+	}
+	if(!nb->error && !nb->tx_busy && nb->tx_len>0){
+		if(nb->tx_next_ns<=now){ usbasp_nb_submit_tx(nb); }
+		else if(nb->tx_next_ns<wake){ wake=nb->tx_next_ns; }
+	}
+	usbasp_nb_arm(nb, now, wake);
+}
+
+int usbasp_uart_nb_enable(USBasp_UART* usbasp, int poll_us){
+	if(usbasp->nb){ return 0; }
+	if(!usbasp->usbhandle){ return LIBUSB_ERROR_NO_DEVICE; }
+	usbasp_uart_nb_off=usbasp_uart_nb_disable;
+	USBasp_UART_NB* nb=(USBasp_UART_NB*)calloc(1, sizeof(USBasp_UART_NB));
+	if(!nb){ return LIBUSB_ERROR_NO_MEM; }
+	nb->usbasp=usbasp;
+	nb->poll_us=poll_us>0?poll_us:1000;
+	nb->epfd=epoll_create1(EPOLL_CLOEXEC);
+	nb->timerfd=timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	nb->eventfd=eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	nb->rx_xfer=libusb_alloc_transfer(0);
+	nb->tx_xfer=libusb_alloc_transfer(0);
+	if(nb->epfd<0 || nb->timerfd<0 || nb->eventfd<0 || !nb->rx_xfer || !nb->tx_xfer){
+		if(nb->epfd>=0){ close(nb->epfd); }
+		if(nb->timerfd>=0){ close(nb->timerfd); }
+		if(nb->eventfd>=0){ close(nb->eventfd); }
+		libusb_free_transfer(nb->rx_xfer);
+		libusb_free_transfer(nb->tx_xfer);
+		free(nb);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	usbasp_nb_watch(nb, nb->timerfd, POLLIN);
+	usbasp_nb_watch(nb, nb->eventfd, POLLIN);
+	libusb_context* usb=usbasp_uart_context();
+	const struct libusb_pollfd** fds=libusb_get_pollfds(usb);
+	for(int i=0; fds && fds[i]; i++){
+		usbasp_nb_watch(nb, fds[i]->fd, fds[i]->events);
+	}
+	libusb_free_pollfds(fds);
+	if(!usbasp_nb_handles){
+		usbasp_nb_usb_timeouts=libusb_pollfds_handle_timeouts(usb);
+		libusb_set_pollfd_notifiers(usb, usbasp_nb_fd_added, usbasp_nb_fd_removed, NULL);
+	}
+	nb->next=usbasp_nb_handles;
+	usbasp_nb_handles=nb;
+	usbasp->nb=nb;
+	usbasp_nb_pump(nb);
+	return 0;
+}
+
+void usbasp_uart_nb_disable(USBasp_UART* usbasp){
+	USBasp_UART_NB* nb=usbasp->nb;
+	if(!nb){ return; }
+	libusb_context* usb=usbasp_uart_context();
+	if(nb->rx_busy){ libusb_cancel_transfer(nb->rx_xfer); }
+	if(nb->tx_busy){ libusb_cancel_transfer(nb->tx_xfer); }
+	nb->error=LIBUSB_ERROR_INTERRUPTED; // Nothing new from callbacks.
+	while(nb->rx_busy || nb->tx_busy){
+		struct timeval tv={0, 100000};
+		libusb_handle_events_timeout_completed(usb, &tv, NULL);
+	}
+	for(USBasp_UART_NB** p=&usbasp_nb_handles; *p; p=&(*p)->next){
+		if(*p==nb){
+			*p=nb->next;
+			break;
+		}
+	}
+	if(!usbasp_nb_handles){
+		libusb_set_pollfd_notifiers(usb, NULL, NULL, NULL);
+	}
+	libusb_free_transfer(nb->rx_xfer);
+	libusb_free_transfer(nb->tx_xfer);
+	close(nb->epfd);
+	close(nb->timerfd);
+	close(nb->eventfd);
+	free(nb);
+	usbasp->nb=NULL;
+}
+
+int usbasp_uart_nb_fd(const USBasp_UART* usbasp){
+	return usbasp->nb?usbasp->nb->epfd:-1;
+}
+
+int usbasp_uart_nb_dispatch(USBasp_UART* usbasp){
+	USBasp_UART_NB* nb=usbasp->nb;
+	if(!nb){ return LIBUSB_ERROR_INVALID_PARAM; }
+	struct timeval zero={0, 0};
+	uint64_t tmp;
+	if(read(nb->timerfd, &tmp, sizeof(tmp))<0){}
+	libusb_handle_events_timeout_completed(usbasp_uart_context(), &zero, NULL);
+	usbasp_nb_pump(nb);
+	int rv=0;
+	if(nb->rx_len>0){ rv|=USBASP_NB_READABLE; }
+	if(nb->tx_len<USBASP_NB_QUEUE){ rv|=USBASP_NB_WRITABLE; }
+	if(nb->error && !nb->rx_len){ rv=nb->error; }
+	nb->want_write=0; // Reported once, like EPOLLET.
+	usbasp_nb_update(nb);
+	return rv;
+}
+
+// Data received before a failure is still handed out first.
+int usbasp_uart_try_read(USBasp_UART* usbasp, uint8_t* buff, size_t len){
+	USBasp_UART_NB* nb=usbasp->nb;
+	if(!nb){ return LIBUSB_ERROR_INVALID_PARAM; }
+	if(!nb->rx_len && nb->error){ return nb->error; }
+	if(len>nb->rx_len){ len=nb->rx_len; }
+	if(len>INT32_MAX){ len=INT32_MAX; }
+	size_t first=USBASP_NB_QUEUE-nb->rx_head;
+	if(first>len){ first=len; }
+	memcpy(buff, nb->rxq+nb->rx_head, first);
+	memcpy(buff+first, nb->rxq, len-first);
+	nb->rx_head=(nb->rx_head+len)%USBASP_NB_QUEUE;
+	nb->rx_len-=len;
+	if(len){ usbasp_nb_pump(nb); }
+	usbasp_nb_update(nb);
+	return (int)len;
+}
+
+int usbasp_uart_try_write(USBasp_UART* usbasp, const uint8_t* buff, size_t len){
+	USBasp_UART_NB* nb=usbasp->nb;
+	if(!nb){ return LIBUSB_ERROR_INVALID_PARAM; }
+	if(nb->error){ return nb->error; }
+	size_t room=USBASP_NB_QUEUE-nb->tx_len;
+	if(len>room){
+		len=room;
+		nb->want_write=1;
+	}
+	size_t tail=(nb->tx_head+nb->tx_len)%USBASP_NB_QUEUE;
+	size_t first=USBASP_NB_QUEUE-tail;
+	if(first>len){ first=len; }
+	memcpy(nb->txq+tail, buff, first);
+	memcpy(nb->txq, buff+first, len-first);
+	nb->tx_len+=len;
+	if(len){ usbasp_nb_pump(nb); }
+	usbasp_nb_update(nb);
+	return (int)len;
+}
+
+size_t usbasp_uart_nb_pending(const USBasp_UART* usbasp){
+	return usbasp->nb?usbasp->nb->tx_len:0;
+}
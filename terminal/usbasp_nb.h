@@ -0,0 +1,55 @@
+#ifndef USBASP_NB_H_
+#define USBASP_NB_H_
+
+#include "usbasp_uart.h"
+
+// Non-blocking mode, for embedding a configured USBasp in a caller's own
+// event loop. Transfers run asynchronously on the shared libusb context;
+// received data and data to send wait in queues of the handle, so
+// usbasp_uart_try_read() and usbasp_uart_try_write() never block.
+//
+// usbasp_uart_nb_fd() gives one descriptor to watch for readability
+// with poll, select or epoll. It gets readable when data was received,
+// room came back after try_write() took less than offered, an error
+// happened, or the engine itself needs to run; in every case call
+// usbasp_uart_nb_dispatch(), which tells what the handle is ready for.
+//
+// A handle without device, never opened or suspended, fails with
+// LIBUSB_ERROR_NO_DEVICE: nb_enable() at once, try_read(), try_write()
+// and dispatch() once the engine tried to submit a transfer.
+// usbasp_uart_disable() ends non-blocking mode itself.
+//
+// All non-blocking handles of a process must be used from one thread.
+// Blocking calls, the scheduler, the reactor and reconnect cannot be
+// used on a handle while non-blocking mode is on, and the reactor not in
+// the same process, as libusb has one set of pollfd notifiers.
+
+#define USBASP_NB_READABLE 1
+#define USBASP_NB_WRITABLE 2
+
+#define USBASP_NB_QUEUE 4096   // Bytes each of RX and TX queue holds.
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+// poll_us is the wait after an RX poll found nothing or firmware had no
+// room for TX, 0 means 1000.
+int usbasp_uart_nb_enable(USBasp_UART* usbasp, int poll_us);
+// Cancels transfers in flight; data still queued for TX is dropped.
+void usbasp_uart_nb_disable(USBasp_UART* usbasp);
+int usbasp_uart_nb_fd(const USBasp_UART* usbasp);
+// Returns USBASP_NB_* flags or a libusb error the handle failed with.
+int usbasp_uart_nb_dispatch(USBasp_UART* usbasp);
+// Bytes taken from RX queue, 0 when empty, or a libusb error.
+int usbasp_uart_try_read(USBasp_UART* usbasp, uint8_t* buff, size_t len);
+// Bytes put in TX queue, 0 when full, or a libusb error.
+int usbasp_uart_try_write(USBasp_UART* usbasp, const uint8_t* buff, size_t len);
+// Bytes in TX queue or in flight, not yet taken by firmware.
+size_t usbasp_uart_nb_pending(const USBasp_UART* usbasp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
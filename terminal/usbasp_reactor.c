@@ -0,0 +1,343 @@
+#include "usbasp_reactor.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#define USBASP_REACTOR_EVENTS 16
+
+static void usbasp_reactor_watch(USBasp_Reactor* reactor, int fd, uint32_t events){
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events=events;
+	ev.data.fd=fd;
+	epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void usbasp_reactor_fd_added(int fd, short events, void* arg){
+	uint32_t ev=0;
+	if(events&POLLIN){ ev|=EPOLLIN; }
+	if(events&POLLOUT){ ev|=EPOLLOUT; }
+	usbasp_reactor_watch((USBasp_Reactor*)arg, fd, ev);
+}
+
+static void usbasp_reactor_fd_removed(int fd, void* arg){
+	epoll_ctl(((USBasp_Reactor*)arg)->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+// Hands chunk to sink threads. A device is on the ready list at most
+// once, so only one thread writes its chunks at a time.
+static void usbasp_reactor_queue(USBasp_Reactor* reactor, USBasp_Reactor_Dev* dev,
+		USBasp_UART_Chunk* chunk){
+	pthread_mutex_lock(&reactor->lock);
+	if(dev->tail){ dev->tail->next=chunk; }
+	else{ dev->head=chunk; }
+	dev->tail=chunk;
+	if(!dev->scheduled){
+		dev->scheduled=1;
+		dev->next=NULL;
+		if(reactor->ready_tail){ reactor->ready_tail->next=dev; }
+		else{ reactor->ready_head=dev; }
+		reactor->ready_tail=dev;
+		pthread_cond_signal(&reactor->cond);
+	}
+	pthread_mutex_unlock(&reactor->lock);
+}
+
+// Runs on reactor thread, from libusb event handling.
+static void usbasp_reactor_done(struct libusb_transfer* xfer){
+	USBasp_Reactor_Dev* dev=(USBasp_Reactor_Dev*)xfer->user_data;
+	USBasp_Reactor* reactor=dev->reactor;
+	USBasp_UART_Chunk* chunk=dev->chunk;
+	uint64_t now=usbasp_uart_now_ns();
+	dev->chunk=NULL;
+	dev->busy=0;
+	dev->rx_transfers++;
+	dev->next_ns=now+(uint64_t)reactor->poll_us*1000;
+	if(xfer->status!=LIBUSB_TRANSFER_COMPLETED){
+		usbasp_uart_chunk_release(chunk);
+		if(xfer->status!=LIBUSB_TRANSFER_CANCELLED && xfer->status!=LIBUSB_TRANSFER_TIMED_OUT){
+			dev->failed=1;
+		}
+		return;
+	}
+	if(xfer->actual_length<=0){
+		usbasp_uart_chunk_release(chunk);
+		dev->rx_empty++;
+		return;
+	}
+	chunk->len=xfer->actual_length;
+	chunk->ns=now;
+	memcpy(chunk->data, libusb_control_transfer_get_data(xfer), chunk->len);
+	dev->rx_bytes+=chunk->len;
+	if(!dev->usbasp->first_rx_ns){
+		dev->usbasp->first_rx_ns=now;
+	}
+	dev->next_ns=now; // Firmware may have more already.
+	usbasp_reactor_queue(reactor, dev, chunk);
+}
+
+static void usbasp_reactor_submit(USBasp_Reactor* reactor, USBasp_Reactor_Dev* dev,
+		uint64_t now){
+	dev->chunk=usbasp_uart_chunk_get(&reactor->pool);
+	if(!dev->chunk){
+		// Sinks hold every chunk; firmware buffers meanwhile.
+		dev->rx_starved++;
+		dev->next_ns=now+(uint64_t)reactor->poll_us*1000;
+		return;
+	}
+	libusb_fill_control_setup(dev->buff,
+			LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN,
+			USBASP_FUNC_UART_RX, 0, 0, USBASP_CHUNK_SIZE);
+	libusb_fill_control_transfer(dev->xfer, dev->usbasp->usbhandle, dev->buff,
+			usbasp_reactor_done, dev, usbasp_uart_timeout(dev->usbasp));
+	if(!dev->usbasp->usbhandle || libusb_submit_transfer(dev->xfer)!=0){
+		usbasp_uart_chunk_release(dev->chunk);
+		dev->chunk=NULL;
+		dev->failed=1;
+		return;
+	}
+	dev->busy=1;
+}
+
+// Arms timerfd for the earliest of next RX polls and libusb timeouts.
+static void usbasp_reactor_arm(USBasp_Reactor* reactor, uint64_t now, uint64_t wake){
+	struct timeval tv;
+	if(!reactor->usb_timeouts && libusb_get_next_timeout(reactor->usb, &tv)==1){
+		uint64_t at=now+(uint64_t)tv.tv_sec*1000000000+(uint64_t)tv.tv_usec*1000;
+		if(at<wake){ wake=at; }
+	}
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	if(wake!=UINT64_MAX){
+		uint64_t ns=wake>now?wake-now:1000;
+		its.it_value.tv_sec=ns/1000000000;
+		its.it_value.tv_nsec=ns%1000000000;
+	}
+	timerfd_settime(reactor->timerfd, 0, &its, NULL);
+}
+
+static void* usbasp_reactor_thread(void* arg){
+	USBasp_Reactor* reactor=(USBasp_Reactor*)arg;
+	struct epoll_event events[USBASP_REACTOR_EVENTS];
+	struct timeval zero={0, 0};
+	while(reactor->running){
+		uint64_t now=usbasp_uart_now_ns();
+		uint64_t wake=UINT64_MAX;
+		for(int i=0; i<reactor->count; i++){
+			USBasp_Reactor_Dev* dev=reactor->devs[i];
+			if(dev->busy || dev->failed){ continue; }
+			if(dev->next_ns<=now){ usbasp_reactor_submit(reactor, dev, now); }
+			if(!dev->busy && dev->next_ns<wake){ wake=dev->next_ns; }
+		}
+		usbasp_reactor_arm(reactor, now, wake);
+		int n=epoll_wait(reactor->epfd, events, USBASP_REACTOR_EVENTS, -1);
+		if(n<0){
+			if(errno==EINTR){ continue; }
+			reactor->error=-errno;
+			break;
+		}
+		reactor->wakeups++;
+		for(int i=0; i<n; i++){
+			uint64_t tmp;
+			if(events[i].data.fd==reactor->timerfd || events[i].data.fd==reactor->wakefd){
+				if(read(events[i].data.fd, &tmp, sizeof(tmp))<0){}
+			}
+		}
+		libusb_handle_events_timeout_completed(reactor->usb, &zero, NULL);
+	}
+	for(int i=0; i<reactor->count; i++){
+		if(reactor->devs[i]->busy){ libusb_cancel_transfer(reactor->devs[i]->xfer); }
+	}
+	for(int busy=1; busy; ){
+		struct timeval tv={0, 100000};
+		libusb_handle_events_timeout_completed(reactor->usb, &tv, NULL);
+		busy=0;
+		for(int i=0; i<reactor->count; i++){ busy|=reactor->devs[i]->busy; }
+	}
+	return NULL;
+}
+
+static void* usbasp_reactor_sink_thread(void* arg){
+	USBasp_Reactor* reactor=(USBasp_Reactor*)arg;
+	pthread_mutex_lock(&reactor->lock);
+	while(1){
+		USBasp_Reactor_Dev* dev=reactor->ready_head;
+		if(!dev){
+			if(!reactor->sinks_running){ break; }
+			pthread_cond_wait(&reactor->cond, &reactor->lock);
+			continue;
+		}
+		reactor->ready_head=dev->next;
+		if(!reactor->ready_head){ reactor->ready_tail=NULL; }
+		USBasp_UART_Chunk* chunk=dev->head;
+		dev->head=dev->tail=NULL;
+		pthread_mutex_unlock(&reactor->lock);
+
+		while(chunk){
+			USBasp_UART_Chunk* next=chunk->next;
+			if(!dev->sink_failed && dev->write(dev->ctx, chunk->data, chunk->len)<0){
+				dev->sink_failed=1;
+			}
+			if(dev->sink_failed){
+				dev->dropped+=chunk->len;
+			}
+			usbasp_uart_chunk_release(chunk);
+			chunk=next;
+		}
+
+		pthread_mutex_lock(&reactor->lock);
+		if(dev->head){
+			// More came meanwhile, back to the end of the line.
+			dev->next=NULL;
+			if(reactor->ready_tail){ reactor->ready_tail->next=dev; }
+			else{ reactor->ready_head=dev; }
+			reactor->ready_tail=dev;
+		}
+		else{
+			dev->scheduled=0;
+		}
+	}
+	pthread_mutex_unlock(&reactor->lock);
+	return NULL;
+}
+
+int usbasp_reactor_add(USBasp_Reactor* reactor, USBasp_Reactor_Dev* dev){
+	if(!dev->usbasp->usbhandle){
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+	if(reactor->count==USBASP_REACTOR_MAX_DEVS){
+		return -1;
+	}
+	dev->reactor=reactor;
+	reactor->devs[reactor->count++]=dev;
+	return 0;
+}
+
+// Frees what usbasp_reactor_start() got so far, fds not opened are -1.
+static void usbasp_reactor_free(USBasp_Reactor* reactor){
+	for(int i=0; i<reactor->count; i++){
+		libusb_free_transfer(reactor->devs[i]->xfer);
+		reactor->devs[i]->xfer=NULL;
+	}
+	if(reactor->epfd>=0){ close(reactor->epfd); }
+	if(reactor->timerfd>=0){ close(reactor->timerfd); }
+	if(reactor->wakefd>=0){ close(reactor->wakefd); }
+	reactor->epfd=reactor->timerfd=reactor->wakefd=-1;
+	usbasp_uart_pool_free(&reactor->pool);
+}
+
+int usbasp_reactor_start(USBasp_Reactor* reactor){
+	if(reactor->poll_us<=0){ reactor->poll_us=1000; }
+	if(reactor->threads<=0){ reactor->threads=2; }
+	if(reactor->threads>USBASP_REACTOR_MAX_THREADS){ reactor->threads=USBASP_REACTOR_MAX_THREADS; }
+	if(reactor->chunks==0){ reactor->chunks=16*reactor->count; }
+	reactor->usb=usbasp_uart_context();
+	if(!reactor->usb || !reactor->count){
+		return -1;
+	}
+	if(usbasp_uart_pool_init(&reactor->pool, reactor->chunks)!=0){
+		return -1;
+	}
+	reactor->epfd=reactor->timerfd=reactor->wakefd=-1;
+	for(int i=0; i<reactor->count; i++){
+		reactor->devs[i]->xfer=NULL;
+	}
+	for(int i=0; i<reactor->count; i++){
+		USBasp_Reactor_Dev* dev=reactor->devs[i];
+		dev->xfer=libusb_alloc_transfer(0);
+		if(!dev->xfer){
+			usbasp_reactor_free(reactor);
+			return -1;
+		}
+		dev->busy=dev->failed=dev->sink_failed=0;
+		dev->next_ns=0;
+	}
+	reactor->epfd=epoll_create1(EPOLL_CLOEXEC);
+	reactor->timerfd=timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	reactor->wakefd=eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(reactor->epfd<0 || reactor->timerfd<0 || reactor->wakefd<0){
+		usbasp_reactor_free(reactor);
+		return -1;
+	}
+	usbasp_reactor_watch(reactor, reactor->timerfd, EPOLLIN);
+	usbasp_reactor_watch(reactor, reactor->wakefd, EPOLLIN);
+	const struct libusb_pollfd** fds=libusb_get_pollfds(reactor->usb);
+	for(int i=0; fds && fds[i]; i++){
+		usbasp_reactor_fd_added(fds[i]->fd, fds[i]->events, reactor);
+	}
+	libusb_free_pollfds(fds);
+	libusb_set_pollfd_notifiers(reactor->usb, usbasp_reactor_fd_added,
+			usbasp_reactor_fd_removed, reactor);
+	reactor->usb_timeouts=libusb_pollfds_handle_timeouts(reactor->usb);
+
+	pthread_mutex_init(&reactor->lock, NULL);
+	pthread_cond_init(&reactor->cond, NULL);
+	reactor->ready_head=reactor->ready_tail=NULL;
+	reactor->error=0;
+	// No reactor thread to join yet, should stop() be needed below.
+	reactor->running=0;
+	reactor->sinks_running=1;
+	for(int i=0; i<reactor->threads; i++){
+		if(pthread_create(&reactor->workers[i], NULL, usbasp_reactor_sink_thread, reactor)!=0){
+			reactor->threads=i;
+			usbasp_reactor_stop(reactor);
+			return -1;
+		}
+	}
+	reactor->running=1;
+	if(pthread_create(&reactor->thread, NULL, usbasp_reactor_thread, reactor)!=0){
+		reactor->running=0;
+		usbasp_reactor_stop(reactor);
+		return -1;
+	}
+	return 0;
+}
+
+void usbasp_reactor_stop(USBasp_Reactor* reactor){
+	if(reactor->running){
+		uint64_t one=1;
+		reactor->running=0;
+		if(write(reactor->wakefd, &one, sizeof(one))<0){}
+		pthread_join(reactor->thread, NULL);
+	}
+	// Reactor thread queues nothing more, sinks may finish and quit.
+	pthread_mutex_lock(&reactor->lock);
+	reactor->sinks_running=0;
+	pthread_cond_broadcast(&reactor->cond);
+	pthread_mutex_unlock(&reactor->lock);
+	for(int i=0; i<reactor->threads; i++){
+		pthread_join(reactor->workers[i], NULL);
+	}
+	libusb_set_pollfd_notifiers(reactor->usb, NULL, NULL, NULL);
+	pthread_cond_destroy(&reactor->cond);
+	pthread_mutex_destroy(&reactor->lock);
+	usbasp_reactor_free(reactor);
+}
+
+void usbasp_reactor_print(const USBasp_Reactor* reactor, FILE* f){
+	uint64_t bytes=0, transfers=0, empty=0;
+	for(int i=0; i<reactor->count; i++){
+		bytes+=reactor->devs[i]->rx_bytes;
+		transfers+=reactor->devs[i]->rx_transfers;
+		empty+=reactor->devs[i]->rx_empty;
+	}
+	fprintf(f, "Reactor: %d devices, %llu bytes, %llu transfers (%llu empty), "
+			"%llu wakeups, %zu chunks at most in use\n", reactor->count,
+			(unsigned long long)bytes, (unsigned long long)transfers,
+			(unsigned long long)empty, (unsigned long long)reactor->wakeups,
+			reactor->pool.peak);
+	for(int i=0; i<reactor->count; i++){
+		const USBasp_Reactor_Dev* dev=reactor->devs[i];
+		fprintf(f, "  %s: %llu bytes, %llu transfers (%llu empty), %llu starved, "
+				"%llu dropped%s\n", dev->name, (unsigned long long)dev->rx_bytes,
+				(unsigned long long)dev->rx_transfers, (unsigned long long)dev->rx_empty,
+				(unsigned long long)dev->rx_starved, (unsigned long long)dev->dropped,
+				dev->failed?", failed":"");
+	}
+}
@@ -0,0 +1,88 @@
+#ifndef USBASP_REACTOR_H_
+#define USBASP_REACTOR_H_
+
+#include "usbasp_uart.h"
+#include "usbasp_tee.h"
+
+#include <pthread.h>
+
+#define USBASP_REACTOR_MAX_DEVS    128
+#define USBASP_REACTOR_MAX_THREADS 16
+
+// One device driven by reactor; usbasp must be configured already. Must
+// be zero-initialized, fields up to ctx may be set before
+// usbasp_reactor_add().
+typedef struct USBasp_Reactor_Dev{
+	const char* name;
+	USBasp_UART* usbasp;
+	usbasp_tee_cb write;   // Called on a sink thread, chunks in order. <0 stops delivery.
+	void* ctx;
+
+	struct USBasp_Reactor* reactor;
+	struct libusb_transfer* xfer;
+	uint8_t buff[LIBUSB_CONTROL_SETUP_SIZE+USBASP_CHUNK_SIZE];
+	USBasp_UART_Chunk* chunk;  // Receives data of the transfer in flight.
+	int busy;              // Transfer in flight.
+	int failed;            // Transfer failed, device is not polled any more.
+	int sink_failed;
+	uint64_t next_ns;      // Earliest time of next RX poll.
+	USBasp_UART_Chunk* head;   // Received chunks waiting for sink.
+	USBasp_UART_Chunk* tail;
+	int scheduled;         // On ready list or being written by a sink thread.
+	struct USBasp_Reactor_Dev* next;
+
+	uint64_t rx_transfers;
+	uint64_t rx_empty;
+	uint64_t rx_bytes;
+	uint64_t rx_starved;   // Polls put off since chunk pool was empty.
+	uint64_t dropped;      // Bytes not delivered after sink failed.
+} USBasp_Reactor_Dev;
+
+// Polls RX of many devices from one thread. Transfers are asynchronous on
+// the libusb context shared by all handles, and the thread waits in epoll
+// on libusb's pollfds. Received data goes through one chunk pool to a few
+// sink threads, which run each device's sink with its chunks in order.
+// Must be zero-initialized, fields up to chunks may be set before
+// usbasp_reactor_start().
+typedef struct USBasp_Reactor{
+	int poll_us;           // Wait after empty RX poll, 0 means 1000.
+	int threads;           // Sink threads, 0 means 2.
+	size_t chunks;         // Chunk pool size, 0 means 16 per device.
+
+	USBasp_Reactor_Dev* devs[USBASP_REACTOR_MAX_DEVS];
+	int count;
+	USBasp_UART_Pool pool;
+	libusb_context* usb;
+	int usb_timeouts;      // libusb timeouts are handled through its pollfds.
+	int epfd;
+	int timerfd;
+	int wakefd;
+	pthread_t thread;
+	pthread_t workers[USBASP_REACTOR_MAX_THREADS];
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	USBasp_Reactor_Dev* ready_head;  // Devices with chunks for sink threads.
+	USBasp_Reactor_Dev* ready_tail;
+	volatile int running;
+	volatile int sinks_running;
+	int error;
+	uint64_t wakeups;      // Returns from epoll_wait().
+} USBasp_Reactor;
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+// LIBUSB_ERROR_NO_DEVICE for a device not open, -1 when reactor is full.
+// A device suspended later fails like an unplugged one.
+int usbasp_reactor_add(USBasp_Reactor* reactor, USBasp_Reactor_Dev* dev);
+int usbasp_reactor_start(USBasp_Reactor* reactor);
+// Cancels transfers in flight and lets sinks write out what was received.
+void usbasp_reactor_stop(USBasp_Reactor* reactor);
+void usbasp_reactor_print(const USBasp_Reactor* reactor, FILE* f);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
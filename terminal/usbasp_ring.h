@@ -0,0 +1,112 @@
+#ifndef USBASP_RING_H_
+#define USBASP_RING_H_
+
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Received data shared by the daemon through shared memory. One writer
+// appends, any number of processes map it read-only, each reading at its
+// own position. Positions are sequence numbers: byte n of the stream is
+// at data[n % size]. Readers falling more than size behind lose the
+// oldest bytes and find out from the sequence.
+//
+// The writer never waits for readers, so it may overwrite bytes while
+// they are being read. A reader copies what usbasp_ring_peek() points at
+// out of the ring, then checks the copy with usbasp_ring_intact() before
+// using it, and counts it as lost when it was not.
+#define USBASP_RING_MAGIC  0x52505355u // "USPR"
+#define USBASP_RING_HEADER 64          // Data starts at this offset.
+
+#define USBASP_RING_RUNNING   0
+#define USBASP_RING_SUSPENDED 1        // Programming session holds the device.
+#define USBASP_RING_CLOSED    2        // Daemon quit, nothing more will come.
+
+typedef struct USBasp_Ring{
+	uint32_t magic;
+	uint32_t size;             // Power of two.
+	volatile uint64_t head;    // Bytes written so far, sequence of next byte.
+	volatile uint64_t reserve; // head plus bytes being written now.
+	volatile uint32_t wake;    // Futex, bumped after every write.
+	volatile uint32_t state;
+} USBasp_Ring;
+
+static inline uint8_t* usbasp_ring_data(const USBasp_Ring* r){
+	return (uint8_t*)r+USBASP_RING_HEADER;
+}
+
+static inline void usbasp_ring_init(USBasp_Ring* r, uint32_t size){
+	memset(r, 0, USBASP_RING_HEADER);
+	r->size=size;
+	__atomic_store_n(&r->magic, USBASP_RING_MAGIC, __ATOMIC_RELEASE);
+}
+
+static inline void usbasp_ring_wake(USBasp_Ring* r){
+	__atomic_fetch_add(&r->wake, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &r->wake, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// Single writer. reserve is moved before data is overwritten, so readers
+// can tell afterwards whether what they read was intact.
+static inline void usbasp_ring_write(USBasp_Ring* r, const uint8_t* data, size_t len){
+	uint64_t head=r->head;
+	uint64_t pos=head;
+	if(len>r->size){
+		pos+=len-r->size;
+		data+=len-r->size;
+		len=r->size;
+	}
+	__atomic_store_n(&r->reserve, pos+len, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	size_t off=pos&(r->size-1);
+	size_t first=r->size-off;
+	if(first>len){ first=len; }
+	memcpy(usbasp_ring_data(r)+off, data, first);
+	memcpy(usbasp_ring_data(r), data+first, len-first);
+	__atomic_store_n(&r->head, pos+len, __ATOMIC_RELEASE);
+	usbasp_ring_wake(r);
+}
+
+// Points *data at bytes from *pos on, up to the end of ring memory, and
+// returns their count. When the writer got more than a ring ahead, *pos
+// first moves to the oldest byte still there and *lost tells how many
+// were skipped.
+static inline size_t usbasp_ring_peek(const USBasp_Ring* r, uint64_t* pos,
+		const uint8_t** data, uint64_t* lost){
+	uint64_t head=__atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	*lost=0;
+	if(head-*pos>r->size){
+		*lost=head-r->size-*pos;
+		*pos=head-r->size;
+	}
+	size_t off=*pos&(r->size-1);
+	size_t n=head-*pos;
+	if(n>r->size-off){ n=r->size-off; }
+	*data=usbasp_ring_data(r)+off;
+	return n;
+}
+
+// Whether bytes from pos on, read after usbasp_ring_peek(), were still
+// intact, i.e. the writer has not started overwriting them meanwhile.
+static inline int usbasp_ring_intact(const USBasp_Ring* r, uint64_t pos){
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&r->reserve, __ATOMIC_RELAXED)-pos<=r->size;
+}
+
+// Sleeps until data after pos arrives, state changes or timeout passes.
+static inline void usbasp_ring_wait(const USBasp_Ring* r, uint64_t pos, int timeout_ms){
+	uint32_t wake=__atomic_load_n(&r->wake, __ATOMIC_ACQUIRE);
+	if(__atomic_load_n(&r->head, __ATOMIC_ACQUIRE)!=pos){
+		return;
+	}
+	struct timespec ts;
+	ts.tv_sec=timeout_ms/1000;
+	ts.tv_nsec=(timeout_ms%1000)*1000000L;
+	syscall(SYS_futex, (void*)&r->wake, FUTEX_WAIT, wake, &ts, NULL, 0);
+}
+
+#endif
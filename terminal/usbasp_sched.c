@@ -0,0 +1,552 @@
+#include "usbasp_sched.h"
+
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// RX priority policy gives up the bus after this many RX polls in a row,
+// so TX still makes progress under constant RX stream.
+#define USBASP_SCHED_RX_STREAK 16
+
+// Commands other threads hand to the scheduler thread.
+#define USBASP_SCHED_CMD_CONFIG  1
+#define USBASP_SCHED_CMD_FLUSHRX 2
+#define USBASP_SCHED_CMD_FLUSHTX 3
+
+static void usbasp_sched_timedwait(USBasp_Sched* sched, int us){
+	sched->last_end=0; // Deliberate wait isn't a scheduling gap.
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec+=(long)us*1000;
+	ts.tv_sec+=ts.tv_nsec/1000000000;
+	ts.tv_nsec%=1000000000;
+	pthread_cond_timedwait(&sched->cond, &sched->lock, &ts);
+}
+
+static void usbasp_sched_fail(USBasp_Sched* sched, int rv){
+	pthread_mutex_lock(&sched->lock);
+	sched->error=rv;
+	sched->running=0;
+	pthread_cond_broadcast(&sched->cond);
+	pthread_mutex_unlock(&sched->lock);
+}
+
+// Called with lock held. Returns how many queued bytes may be sent now;
+// when held back, *hold_us tells how long until they may.
+static size_t usbasp_sched_tx_ready(USBasp_Sched* sched, int* hold_us){
+	*hold_us=0;
+	if(!sched->txq_len || sched->tx_hold_us<=0 || sched->txq_urgent ||
+			sched->txq_len>=sched->tx_batch){
+		return sched->txq_len;
+	}
+	uint64_t age=usbasp_uart_now_ns()-sched->txq_since;
+	if(age>=(uint64_t)sched->tx_hold_us*1000){
+		return sched->txq_len;
+	}
+	*hold_us=sched->tx_hold_us-(int)(age/1000);
+	return 0;
+}
+
+// Counts time from end of previous transfer to start of this one.
+static void usbasp_sched_gap(USBasp_Sched* sched, uint64_t start){
+	if(!sched->last_end){ return; }
+	uint64_t ns=start-sched->last_end;
+	if(ns>sched->gap_max_ns){ sched->gap_max_ns=ns; }
+	int d=0;
+	for(uint64_t us=ns/1000; us>1 && d<USBASP_STATS_BUCKETS-1; us>>=1){ d++; }
+	sched->gaps[d]++;
+}
+
+#define usbasp_sched_rx_on(s) ((s)->on_rx || (s)->on_chunk)
+
+// Returns number of bytes received, or <0 on error.
+static int usbasp_sched_rx(USBasp_Sched* sched, uint8_t* buff){
+	USBasp_UART_Chunk* chunk=NULL;
+	uint64_t start=usbasp_uart_now_ns();
+	usbasp_sched_gap(sched, start);
+	int rv;
+	if(sched->on_chunk){
+		rv=usbasp_uart_read_chunk(sched->usbasp, sched->pool, &chunk);
+		if(rv==USBASP_POOL_EMPTY){
+			// Consumer holds every chunk; firmware buffers meanwhile.
+			sched->rx_starved++;
+			sched->last_end=0;
+			return 0;
+		}
+	}
+	else{
+		rv=usbasp_uart_read(sched->usbasp, buff, USBASP_CHUNK_SIZE);
+	}
+	sched->last_end=usbasp_uart_now_ns();
+	sched->rx_ns+=sched->last_end-start;
+	sched->rx_transfers++;
+	if(rv<0){
+		usbasp_sched_fail(sched, rv);
+		return rv;
+	}
+	if(rv==0){
+		sched->rx_empty++;
+		return 0;
+	}
+	sched->rx_bytes+=rv;
+	if(chunk){
+		sched->on_chunk(sched->ctx, chunk);
+	}
+	else{
+		sched->on_rx(sched->ctx, buff, rv);
+	}
+	return rv;
+}
+
+// Sends straight from the queue: only this thread consumes it, and
+// writers never touch the queued part.
+static int usbasp_sched_tx(USBasp_Sched* sched){
+	pthread_mutex_lock(&sched->lock);
+	size_t len=sched->txq_len;
+	if(len>sched->txq_size-sched->txq_head){ len=sched->txq_size-sched->txq_head; }
+	if(len>USBASP_CHUNK_SIZE){ len=USBASP_CHUNK_SIZE; }
+	uint8_t* data=sched->txq+sched->txq_head;
+	pthread_mutex_unlock(&sched->lock);
+
+	uint64_t start=usbasp_uart_now_ns();
+	usbasp_sched_gap(sched, start);
+	int rv=usbasp_uart_write(sched->usbasp, data, len);
+	sched->last_end=usbasp_uart_now_ns();
+	sched->tx_ns+=sched->last_end-start;
+	sched->tx_transfers+=rv>0?2:1; // TX_FREE and TX.
+	if(rv<0){
+		usbasp_sched_fail(sched, rv);
+		return rv;
+	}
+	if(rv==0){
+		sched->tx_stalls++;
+		return 0;
+	}
+	sched->tx_bytes+=rv;
+	pthread_mutex_lock(&sched->lock);
+	sched->txq_head=(sched->txq_head+rv)%sched->txq_size;
+	sched->txq_len-=rv;
+	sched->txq_urgent-=sched->txq_urgent<(size_t)rv?sched->txq_urgent:rv;
+	// Bytes left in the queue came no earlier than this send started.
+	sched->txq_since=start;
+	int want=sched->tx_want;
+	sched->tx_want=0;
+	pthread_cond_broadcast(&sched->cond);
+	pthread_mutex_unlock(&sched->lock);
+	if(want && sched->on_tx_room){
+		sched->on_tx_room(sched->ctx);
+	}
+	return rv;
+}
+
+static int usbasp_sched_exec(USBasp_Sched* sched, int cmd){
+	switch(cmd){
+	case USBASP_SCHED_CMD_CONFIG:
+		return usbasp_uart_config(sched->usbasp, sched->cmd_baud, sched->cmd_flags);
+	case USBASP_SCHED_CMD_FLUSHRX:
+		usbasp_uart_flushrx(sched->usbasp);
+		return 0;
+	default:
+		if(sched->txq){
+			pthread_mutex_lock(&sched->lock);
+			sched->txq_len=sched->txq_urgent=0;
+			int want=sched->tx_want;
+			sched->tx_want=0;
+			pthread_cond_broadcast(&sched->cond);
+			pthread_mutex_unlock(&sched->lock);
+			if(want && sched->on_tx_room){
+				sched->on_tx_room(sched->ctx);
+			}
+		}
+		usbasp_uart_flushtx(sched->usbasp);
+		return 0;
+	}
+}
+
+// Runs a posted command, if any. Called on the scheduler thread.
+static void usbasp_sched_take(USBasp_Sched* sched){
+	pthread_mutex_lock(&sched->lock);
+	int cmd=sched->cmd;
+	if(cmd>0){ sched->cmd=-cmd; }
+	pthread_mutex_unlock(&sched->lock);
+	if(cmd<=0){ return; }
+	int rv=usbasp_sched_exec(sched, cmd);
+	pthread_mutex_lock(&sched->lock);
+	sched->cmd_rv=rv;
+	sched->cmd=0;
+	pthread_cond_broadcast(&sched->cond);
+	pthread_mutex_unlock(&sched->lock);
+}
+
+// Faults in stack the thread will use, before it gets real-time priority.
+static void usbasp_sched_prefault(void){
+	volatile uint8_t stack[64*1024];
+	memset((uint8_t*)stack, 0, sizeof(stack));
+}
+
+static void* usbasp_sched_thread(void* arg){
+	USBasp_Sched* sched=(USBasp_Sched*)arg;
+	uint8_t buff[USBASP_CHUNK_SIZE];
+	usbasp_sched_prefault();
+	uint64_t deadline_ns=(uint64_t)sched->rx_deadline_us*1000;
+	uint64_t last_rx=usbasp_uart_now_ns();
+	int rx_streak=0;
+	int rx_more=1;   // Last RX poll suggests more data is waiting.
+	int tx_stalled=0;
+	int rx_credit=sched->rx_weight;
+	int tx_credit=sched->tx_weight;
+	int idle_us=1;
+	int hold_us=0;
+	int held=0;      // Current batch was already counted in tx_held.
+
+	while(sched->running){
+		if(sched->cmd>0){
+			usbasp_sched_take(sched);
+			continue;
+		}
+		pthread_mutex_lock(&sched->lock);
+		size_t pending=usbasp_sched_tx_ready(sched, &hold_us);
+		if(hold_us && !held){
+			sched->tx_held++;
+			held=1;
+		}
+		if(!pending && !usbasp_sched_rx_on(sched) && sched->running && !sched->cmd){
+			// Nothing to do until somebody queues data or hold expires.
+			usbasp_sched_timedwait(sched, hold_us?hold_us:100000);
+			pthread_mutex_unlock(&sched->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&sched->lock);
+
+		int do_rx;
+		if(!usbasp_sched_rx_on(sched)){
+			do_rx=0;
+		}
+		else if(!pending){
+			do_rx=1;
+		}
+		else if(usbasp_uart_now_ns()-last_rx>=deadline_ns){
+			do_rx=1;
+			sched->rx_forced++;
+		}
+		else{
+			switch(sched->policy){
+			case USBASP_SCHED_WEIGHTED:
+				if(rx_credit==0 && tx_credit==0){
+					rx_credit=sched->rx_weight;
+					tx_credit=sched->tx_weight;
+				}
+				do_rx=rx_credit>0;
+				if(do_rx){ rx_credit--; }
+				else{ tx_credit--; }
+				break;
+			case USBASP_SCHED_TX_BULK:
+				do_rx=tx_stalled;
+				break;
+			default:
+				do_rx=(rx_more && rx_streak<USBASP_SCHED_RX_STREAK) || tx_stalled;
+				break;
+			}
+		}
+
+		if(!do_rx){
+			int rv=usbasp_sched_tx(sched);
+			if(rv<0){ break; }
+			tx_stalled=rv==0;
+			rx_streak=0;
+			held=0;
+			rx_more=1; // Sent data may be looped back already.
+			continue;
+		}
+
+		int rv=usbasp_sched_rx(sched, buff);
+		if(rv<0){ break; }
+		last_rx=usbasp_uart_now_ns();
+		rx_streak++;
+		tx_stalled=0;
+		// Full packets mean firmware had more than we got in this poll.
+		rx_more=rv>=8;
+		if(rv>0 || pending){
+			idle_us=1;
+			continue;
+		}
+
+		// Idle: wait as usbasp->poll_mode says, but wake up for new TX data.
+		USBasp_UART* usbasp=sched->usbasp;
+		int wait_us=0;
+		if(usbasp->poll_mode==USBASP_POLL_SLEEP){
+			wait_us=usbasp->poll_interval_us;
+		}
+		else if(usbasp->poll_mode==USBASP_POLL_BACKOFF){
+			wait_us=idle_us;
+			idle_us*=2;
+			if(idle_us>usbasp->poll_interval_us){ idle_us=usbasp->poll_interval_us; }
+		}
+		if(hold_us && hold_us<wait_us){ wait_us=hold_us; }
+		if(wait_us>0){
+			pthread_mutex_lock(&sched->lock);
+			if(!usbasp_sched_tx_ready(sched, &hold_us) && sched->running && !sched->cmd){
+				usbasp_sched_timedwait(sched, wait_us);
+			}
+			pthread_mutex_unlock(&sched->lock);
+		}
+	}
+	return NULL;
+}
+
+int usbasp_sched_start(USBasp_Sched* sched, USBasp_UART* usbasp){
+	if(sched->rx_weight<=0){ sched->rx_weight=1; }
+	if(sched->tx_weight<=0){ sched->tx_weight=1; }
+	if(sched->rx_deadline_us<=0){ sched->rx_deadline_us=5000; }
+	if(sched->txq_size==0){ sched->txq_size=4096; }
+	if(sched->tx_batch==0 || sched->tx_batch>sched->txq_size){
+		sched->tx_batch=sched->tx_batch?sched->txq_size:USBASP_CHUNK_SIZE;
+	}
+	sched->txq=(uint8_t*)malloc(sched->txq_size);
+	if(!sched->txq){
+		return -1;
+	}
+	// Touch it now, so pages aren't faulted in (or locked) on the hot path.
+	memset(sched->txq, 0, sched->txq_size);
+	sched->usbasp=usbasp;
+	sched->txq_head=sched->txq_len=sched->txq_urgent=0;
+	sched->error=0;
+	sched->halted=0;
+	sched->tx_want=0;
+	sched->cmd=0;
+	sched->running=1;
+	pthread_mutex_init(&sched->lock, NULL);
+	pthread_mutex_init(&sched->cmd_lock, NULL);
+	pthread_cond_init(&sched->cond, NULL);
+	if(pthread_create(&sched->thread, NULL, usbasp_sched_thread, sched)!=0){
+		pthread_cond_destroy(&sched->cond);
+		pthread_mutex_destroy(&sched->cmd_lock);
+		pthread_mutex_destroy(&sched->lock);
+		free(sched->txq);
+		sched->txq=NULL;
+		return -1;
+	}
+	// Failures here are not fatal, thread runs as usual then.
+	sched->rt_error=0;
+#ifdef __linux__
+	if(sched->cpu_mask){
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for(int cpu=0; cpu<64; cpu++){
+			if(sched->cpu_mask>>cpu & 1){ CPU_SET(cpu, &set); }
+		}
+		sched->rt_error=pthread_setaffinity_np(sched->thread, sizeof(set), &set);
+		if(sched->rt_error){
+			fprintf(stderr, "Note: cannot pin scheduler thread: %s\n", strerror(sched->rt_error));
+		}
+	}
+#endif
+	if(sched->rt_policy){
+		struct sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority=sched->rt_priority;
+		int rv=pthread_setschedparam(sched->thread, sched->rt_policy, &param);
+		if(rv){
+			sched->rt_error=rv;
+			fprintf(stderr, "Note: cannot set real-time priority: %s\n", strerror(rv));
+		}
+	}
+	return 0;
+}
+
+// Called with lock held. Queues what fits, returns its length.
+static size_t usbasp_sched_queue(USBasp_Sched* sched, const uint8_t* buff, size_t len){
+	size_t room=sched->txq_size-sched->txq_len;
+	if(room>len){ room=len; }
+	if(room==0){
+		return 0;
+	}
+	size_t tail=(sched->txq_head+sched->txq_len)%sched->txq_size;
+	size_t first=sched->txq_size-tail;
+	if(first>room){ first=room; }
+	memcpy(sched->txq+tail, buff, first);
+	memcpy(sched->txq, buff+first, room-first);
+	if(!sched->txq_len){ sched->txq_since=usbasp_uart_now_ns(); }
+	sched->txq_len+=room;
+	// Finished lines go out without waiting for the hold window.
+	for(size_t i=room; i>0; i--){
+		if(buff[i-1]=='\n'){
+			sched->txq_urgent=sched->txq_len-(room-i);
+			break;
+		}
+	}
+	pthread_cond_broadcast(&sched->cond);
+	return room;
+}
+
+// Blocks while the queue is full. Returns len, or error of the scheduler.
+int usbasp_sched_write(USBasp_Sched* sched, const uint8_t* buff, size_t len){
+	size_t done=0;
+	pthread_mutex_lock(&sched->lock);
+	while(done<len){
+		if(!sched->running){
+			pthread_mutex_unlock(&sched->lock);
+			return sched->error?sched->error:-1;
+		}
+		size_t n=usbasp_sched_queue(sched, buff+done, len-done);
+		if(n==0){
+			pthread_cond_wait(&sched->cond, &sched->lock);
+		}
+		done+=n;
+	}
+	pthread_mutex_unlock(&sched->lock);
+	return len;
+}
+
+// Queues what fits without waiting. Returns its length, possibly 0, or
+// error of the scheduler. When it falls short, on_tx_room is called as
+// soon as the scheduler sent some of the queue.
+int usbasp_sched_try_write(USBasp_Sched* sched, const uint8_t* buff, size_t len){
+	pthread_mutex_lock(&sched->lock);
+	if(!sched->running){
+		pthread_mutex_unlock(&sched->lock);
+		return sched->error?sched->error:-1;
+	}
+	size_t n=usbasp_sched_queue(sched, buff, len);
+	if(n<len){
+		sched->tx_want=1;
+	}
+	pthread_mutex_unlock(&sched->lock);
+	return n;
+}
+
+// Sends everything queued so far without waiting for tx_hold_us.
+int usbasp_sched_flush(USBasp_Sched* sched){
+	pthread_mutex_lock(&sched->lock);
+	sched->txq_urgent=sched->txq_len;
+	pthread_cond_broadcast(&sched->cond);
+	int rv=sched->error;
+	pthread_mutex_unlock(&sched->lock);
+	return rv;
+}
+
+// Flushes and waits until everything queued was accepted by the device.
+int usbasp_sched_drain(USBasp_Sched* sched){
+	pthread_mutex_lock(&sched->lock);
+	sched->txq_urgent=sched->txq_len;
+	pthread_cond_broadcast(&sched->cond);
+	while(sched->txq_len && sched->running){
+		pthread_cond_wait(&sched->cond, &sched->lock);
+	}
+	int rv=sched->error;
+	pthread_mutex_unlock(&sched->lock);
+	return rv;
+}
+
+// Waits until scheduler stops on error, returns the error.
+int usbasp_sched_wait(USBasp_Sched* sched){
+	pthread_mutex_lock(&sched->lock);
+	while(sched->running){
+		pthread_cond_wait(&sched->cond, &sched->lock);
+	}
+	int rv=sched->error;
+	pthread_mutex_unlock(&sched->lock);
+	return rv;
+}
+
+static int usbasp_sched_command(USBasp_Sched* sched, int cmd, int baud, int flags){
+	if(!sched->txq){
+		sched->cmd_baud=baud;
+		sched->cmd_flags=flags;
+		return usbasp_sched_exec(sched, cmd);
+	}
+	pthread_mutex_lock(&sched->cmd_lock);
+	pthread_mutex_lock(&sched->lock);
+	sched->cmd_baud=baud;
+	sched->cmd_flags=flags;
+	sched->cmd=cmd;
+	pthread_cond_broadcast(&sched->cond);
+	// Once taken, the thread finishes it even when stopping meanwhile.
+	while((sched->cmd>0 && sched->running) || sched->cmd<0){
+		pthread_cond_wait(&sched->cond, &sched->lock);
+	}
+	int rv=sched->cmd_rv;
+	int mine=sched->cmd>0; // Thread is gone, nobody else drives the device.
+	sched->cmd=0;
+	pthread_mutex_unlock(&sched->lock);
+	if(mine){
+		rv=usbasp_sched_exec(sched, cmd);
+	}
+	pthread_mutex_unlock(&sched->cmd_lock);
+	return rv;
+}
+
+int usbasp_sched_config(USBasp_Sched* sched, int baud, int flags){
+	return usbasp_sched_command(sched, USBASP_SCHED_CMD_CONFIG, baud, flags);
+}
+
+void usbasp_sched_flushrx(USBasp_Sched* sched){
+	usbasp_sched_command(sched, USBASP_SCHED_CMD_FLUSHRX, 0, 0);
+}
+
+void usbasp_sched_flushtx(USBasp_Sched* sched){
+	usbasp_sched_command(sched, USBASP_SCHED_CMD_FLUSHTX, 0, 0);
+}
+
+// Stops polling and joins the thread but frees nothing, so other threads
+// may still be waiting in usbasp_sched_write() and the like; they return
+// then. usbasp_sched_stop() must follow, but not concurrently.
+void usbasp_sched_halt(USBasp_Sched* sched){
+	if(!sched->txq || sched->halted){
+		return;
+	}
+	pthread_mutex_lock(&sched->lock);
+	sched->running=0;
+	pthread_cond_broadcast(&sched->cond);
+	pthread_mutex_unlock(&sched->lock);
+	pthread_join(sched->thread, NULL);
+	sched->halted=1;
+}
+
+void usbasp_sched_stop(USBasp_Sched* sched){
+	if(!sched->txq){
+		return;
+	}
+	usbasp_sched_halt(sched);
+	pthread_cond_destroy(&sched->cond);
+	pthread_mutex_destroy(&sched->cmd_lock);
+	pthread_mutex_destroy(&sched->lock);
+	free(sched->txq);
+	sched->txq=NULL;
+}
+
+void usbasp_sched_print(const USBasp_Sched* sched, FILE* f){
+	double total=(double)(sched->rx_ns+sched->tx_ns);
+	if(total==0){ total=1; }
+	fprintf(f, "Scheduler: RX %llu transfers (%llu empty, %llu forced), %llu bytes, "
+			"%.1f%% of bus time\n", (unsigned long long)sched->rx_transfers,
+			(unsigned long long)sched->rx_empty, (unsigned long long)sched->rx_forced,
+			(unsigned long long)sched->rx_bytes, 100*sched->rx_ns/total);
+	if(sched->rx_starved){
+		fprintf(f, "Scheduler: RX %llu polls skipped, chunk pool exhausted\n",
+				(unsigned long long)sched->rx_starved);
+	}
+	fprintf(f, "Scheduler: TX %llu transfers (%llu stalls, %llu held), %llu bytes, "
+			"%.1f%% of bus time\n", (unsigned long long)sched->tx_transfers,
+			(unsigned long long)sched->tx_stalls, (unsigned long long)sched->tx_held,
+			(unsigned long long)sched->tx_bytes, 100*sched->tx_ns/total);
+	uint64_t count=0;
+	for(int i=0; i<USBASP_STATS_BUCKETS; i++){ count+=sched->gaps[i]; }
+	if(!count){ return; }
+	fprintf(f, "Scheduler: gap between transfers, max %.1fus", sched->gap_max_ns/1000.0);
+	// Upper bounds of buckets holding the percentiles.
+	static const double ps[]={0.5, 0.99, 0.999};
+	for(int k=0; k<3; k++){
+		uint64_t seen=0;
+		int i=0;
+		while(i<USBASP_STATS_BUCKETS-1 && (seen+=sched->gaps[i])<ps[k]*count){ i++; }
+		fprintf(f, ", p%g <%dus", ps[k]*100, 2<<i);
+	}
+	fprintf(f, "\n");
+	for(int i=0; i<USBASP_STATS_BUCKETS; i++){
+		if(!sched->gaps[i]){ continue; }
+		fprintf(f, "  %8dus-%8dus: %llu\n", i?1<<i:0, (2<<i)-1,
+				(unsigned long long)sched->gaps[i]);
+	}
+}
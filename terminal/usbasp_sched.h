@@ -0,0 +1,108 @@
+#ifndef USBASP_SCHED_H_
+#define USBASP_SCHED_H_
+
+#include "usbasp_uart.h"
+
+#include <pthread.h>
+
+// Scheduler policies: which transfer goes next when both RX and TX want
+// the bus. Whatever the policy, RX is polled at least every
+// rx_deadline_us, so heavy uploads can't overflow firmware rx buffer.
+#define USBASP_SCHED_RX_PRIORITY 0 // Keep polling RX while it returns data.
+#define USBASP_SCHED_WEIGHTED    1 // rx_weight RX polls per tx_weight TX writes.
+#define USBASP_SCHED_TX_BULK     2 // Empty TX queue first, RX only when forced.
+
+typedef void (*usbasp_sched_rx_cb)(void* ctx, const uint8_t* data, int len);
+typedef void (*usbasp_sched_room_cb)(void* ctx);
+// Takes ownership of chunk, which goes back with usbasp_uart_chunk_release().
+typedef void (*usbasp_sched_chunk_cb)(void* ctx, USBasp_UART_Chunk* chunk);
+
+// One thread owning the device. TX data is queued by any thread with
+// usbasp_sched_write(), received data is passed to on_rx callback on the
+// scheduler thread. Small writes are held for up to tx_hold_us and sent
+// together, a newline or usbasp_sched_flush() sends them at once. While
+// it runs, configure and flush the device only through usbasp_sched_config()
+// and friends, which hand the call to the scheduler thread.
+// Must be zero-initialized, fields up to ctx may be set before
+// usbasp_sched_start().
+typedef struct USBasp_Sched{
+	int policy;
+	int rx_weight;
+	int tx_weight;
+	int rx_deadline_us;    // 0 means 5ms.
+	size_t txq_size;       // 0 means 4096 bytes.
+	int tx_hold_us;        // Hold small writes this long to batch them, 0 sends at once.
+	size_t tx_batch;       // Send held data once this much is queued, 0 means 254.
+	int rt_policy;         // SCHED_FIFO or SCHED_RR for the thread, 0 keeps default.
+	int rt_priority;
+	uint64_t cpu_mask;     // CPUs the thread may run on, 0 doesn't pin.
+	usbasp_sched_rx_cb on_rx; // NULL disables RX polling, unless on_chunk is set.
+	usbasp_sched_chunk_cb on_chunk; // Used instead of on_rx, receiving into pool.
+	USBasp_UART_Pool* pool;
+	usbasp_sched_room_cb on_tx_room; // After usbasp_sched_try_write() fell short, once there is room.
+	void* ctx;
+
+	USBasp_UART* usbasp;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint8_t* txq;
+	size_t txq_head;
+	size_t txq_len;
+	size_t txq_urgent;     // Queued bytes up to last newline or flush, sent without holding.
+	uint64_t txq_since;    // When the oldest held byte was queued.
+	volatile int running;
+	int halted;            // Thread was joined by usbasp_sched_halt().
+	int error;
+	int tx_want;           // usbasp_sched_try_write() fell short.
+	pthread_mutex_t cmd_lock; // One command at a time.
+	volatile int cmd;      // Posted for the thread, negated once it took it.
+	int cmd_baud;
+	int cmd_flags;
+	int cmd_rv;
+	int rt_error;          // errno of failed rt_policy or cpu_mask setting.
+	uint64_t last_end;     // End of last transfer, 0 after waiting on purpose.
+
+	// Achieved split, written by scheduler thread only.
+	uint64_t rx_transfers;
+	uint64_t tx_transfers;
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	uint64_t rx_empty;
+	uint64_t tx_stalls;
+	uint64_t rx_forced;    // RX polls forced by rx_deadline_us.
+	uint64_t rx_starved;   // RX polls skipped since pool had no free chunk.
+	uint64_t tx_held;      // Times TX was held back to coalesce writes.
+	uint64_t rx_ns;
+	uint64_t tx_ns;
+	// How long thread took to start next transfer after previous one
+	// completed, in the same log2 buckets as transfer duration.
+	uint64_t gaps[USBASP_STATS_BUCKETS];
+	uint64_t gap_max_ns;
+} USBasp_Sched;
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+int usbasp_sched_start(USBasp_Sched* sched, USBasp_UART* usbasp);
+int usbasp_sched_write(USBasp_Sched* sched, const uint8_t* buff, size_t len);
+int usbasp_sched_try_write(USBasp_Sched* sched, const uint8_t* buff, size_t len);
+int usbasp_sched_flush(USBasp_Sched* sched);
+int usbasp_sched_drain(USBasp_Sched* sched);
+int usbasp_sched_wait(USBasp_Sched* sched);
+// Run on the scheduler thread between two transfers, or on the calling
+// thread once the scheduler stopped. Config returns what
+// usbasp_uart_config() did, flushtx also drops data still queued.
+int usbasp_sched_config(USBasp_Sched* sched, int baud, int flags);
+void usbasp_sched_flushrx(USBasp_Sched* sched);
+void usbasp_sched_flushtx(USBasp_Sched* sched);
+void usbasp_sched_halt(USBasp_Sched* sched);
+void usbasp_sched_stop(USBasp_Sched* sched);
+void usbasp_sched_print(const USBasp_Sched* sched, FILE* f);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,161 @@
+#include "usbasp_tee.h"
+#include "usbasp_uart.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define load_acquire(x)  __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define store_release(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+// Dropped bytes are counted by producer and, after a failure, by sink thread.
+#define count_add(x, n) __atomic_fetch_add(&(x), (n), __ATOMIC_RELAXED)
+
+// A side about to sleep sets *flag, then checks again. The other side
+// posts only if it clears the flag, so every sleep gets at most one post.
+static void usbasp_tee_wake(int* flag, sem_t* sem){
+	// Orders the caller's store of head or tail before reading the flag.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(flag, __ATOMIC_SEQ_CST) && __atomic_exchange_n(flag, 0, __ATOMIC_SEQ_CST)){
+		sem_post(sem);
+	}
+}
+
+// Sleeps unless ready() turns true after the flag is set.
+static void usbasp_tee_sleep(int* flag, sem_t* sem, int (*ready)(USBasp_Tee_Sink*),
+		USBasp_Tee_Sink* sink){
+	__atomic_store_n(flag, 1, __ATOMIC_SEQ_CST);
+	if(ready(sink) && __atomic_exchange_n(flag, 0, __ATOMIC_SEQ_CST)){
+		return;
+	}
+	// Either nothing came, or the other side cleared the flag and posts.
+	sem_wait(sem);
+}
+
+static int usbasp_tee_has_data(USBasp_Tee_Sink* sink){
+	return load_acquire(sink->head)!=sink->tail || !sink->running;
+}
+
+static int usbasp_tee_has_room(USBasp_Tee_Sink* sink){
+	return sink->head-load_acquire(sink->tail)<sink->size;
+}
+
+static void* usbasp_tee_thread(void* arg){
+	USBasp_Tee_Sink* sink=(USBasp_Tee_Sink*)arg;
+	size_t mask=sink->size-1;
+	while(1){
+		size_t head=load_acquire(sink->head);
+		size_t tail=sink->tail;
+		if(head==tail){
+			if(!sink->running){ break; }
+			usbasp_tee_sleep(&sink->sleeping, &sink->ready, usbasp_tee_has_data, sink);
+			continue;
+		}
+		// Contiguous part only, the rest comes in the next round.
+		size_t len=head-tail;
+		size_t at=tail&mask;
+		if(len>sink->size-at){ len=sink->size-at; }
+		if(!sink->failed && sink->write(sink->ctx, sink->ring+at, len)<0){
+			sink->failed=1;
+		}
+		if(sink->failed){
+			count_add(sink->dropped, len);
+		}
+		store_release(sink->tail, tail+len);
+		usbasp_tee_wake(&sink->blocked, &sink->room);
+	}
+	return NULL;
+}
+
+int usbasp_tee_add(USBasp_Tee* tee, USBasp_Tee_Sink* sink){
+	if(tee->count==USBASP_TEE_MAX_SINKS){
+		return -1;
+	}
+	size_t size=1;
+	while(size<(sink->size?sink->size:(1<<20))){ size*=2; }
+	sink->size=size;
+	sink->ring=(uint8_t*)malloc(size);
+	if(!sink->ring){
+		return -1;
+	}
+	memset(sink->ring, 0, size); // Fault pages in before streaming starts.
+	sink->head=sink->tail=0;
+	sink->sleeping=sink->blocked=0;
+	sink->running=1;
+	sem_init(&sink->ready, 0, 0);
+	sem_init(&sink->room, 0, 0);
+	if(pthread_create(&sink->thread, NULL, usbasp_tee_thread, sink)!=0){
+		sem_destroy(&sink->ready);
+		sem_destroy(&sink->room);
+		free(sink->ring);
+		sink->ring=NULL;
+		return -1;
+	}
+	tee->sinks[tee->count++]=sink;
+	return 0;
+}
+
+// Single producer: the scheduler thread, or whoever reads the device.
+void usbasp_tee_push(void* ctx, const uint8_t* data, int len){
+	USBasp_Tee* tee=(USBasp_Tee*)ctx;
+	for(int i=0; i<tee->count; i++){
+		USBasp_Tee_Sink* sink=tee->sinks[i];
+		size_t mask=sink->size-1;
+		size_t head=sink->head;
+		sink->pushed+=len;
+		if(sink->policy==USBASP_TEE_DROP || sink->failed){
+			if(sink->size-(head-load_acquire(sink->tail))<(size_t)len){
+				count_add(sink->dropped, len);
+				sink->drops++;
+				continue;
+			}
+		}
+		uint64_t start=0;
+		for(int done=0; done<len; ){
+			size_t room=sink->size-(head-load_acquire(sink->tail));
+			if(room==0){
+				// Sink thread is behind, wait until it made room.
+				if(!start){ start=usbasp_uart_now_ns(); }
+				usbasp_tee_sleep(&sink->blocked, &sink->room, usbasp_tee_has_room, sink);
+				continue;
+			}
+			size_t n=len-done;
+			if(n>room){ n=room; }
+			size_t at=head&mask;
+			size_t first=sink->size-at;
+			if(first>n){ first=n; }
+			memcpy(sink->ring+at, data+done, first);
+			memcpy(sink->ring, data+done+first, n-first);
+			head+=n;
+			done+=n;
+			store_release(sink->head, head);
+			usbasp_tee_wake(&sink->sleeping, &sink->ready);
+		}
+		if(start){
+			sink->blocked_ns+=usbasp_uart_now_ns()-start;
+		}
+	}
+}
+
+// Lets every sink write out what it has queued, then stops its thread.
+void usbasp_tee_stop(USBasp_Tee* tee){
+	for(int i=0; i<tee->count; i++){
+		USBasp_Tee_Sink* sink=tee->sinks[i];
+		if(!sink->ring){ continue; }
+		sink->running=0;
+		usbasp_tee_wake(&sink->sleeping, &sink->ready);
+		pthread_join(sink->thread, NULL);
+		sem_destroy(&sink->ready);
+		sem_destroy(&sink->room);
+		free(sink->ring);
+		sink->ring=NULL;
+	}
+}
+
+void usbasp_tee_print(const USBasp_Tee* tee, FILE* f){
+	for(int i=0; i<tee->count; i++){
+		const USBasp_Tee_Sink* sink=tee->sinks[i];
+		fprintf(f, "Sink %s: %llu bytes, %llu dropped in %llu chunks, producer blocked %.3fs%s\n",
+				sink->name, (unsigned long long)sink->pushed,
+				(unsigned long long)sink->dropped, (unsigned long long)sink->drops,
+				sink->blocked_ns/1e9, sink->failed?", failed":"");
+	}
+}
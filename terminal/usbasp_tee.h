@@ -0,0 +1,66 @@
+#ifndef USBASP_TEE_H_
+#define USBASP_TEE_H_
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// What usbasp_tee_push() does when a sink's queue is full.
+#define USBASP_TEE_DROP  0 // Drop the chunk for this sink and count it.
+#define USBASP_TEE_BLOCK 1 // Wait until the sink catches up.
+
+#define USBASP_TEE_MAX_SINKS 8
+
+// Called on the sink's own thread. Returning <0 stops delivery to the
+// sink, the rest of its data is counted as dropped.
+typedef int (*usbasp_tee_cb)(void* ctx, const uint8_t* data, size_t len);
+
+// Every sink has its own single-producer single-consumer queue and thread,
+// so a slow sink delays only itself. Must be zero-initialized, fields up
+// to size may be set before usbasp_tee_add().
+typedef struct USBasp_Tee_Sink{
+	const char* name;
+	usbasp_tee_cb write;
+	void* ctx;
+	int policy;
+	size_t size;           // Queue size, rounded up to power of two, 0 means 1MB.
+
+	uint8_t* ring;
+	size_t head;           // Written by producer only.
+	size_t tail;           // Written by sink thread only.
+	sem_t ready;           // Posted when data comes while sink thread sleeps,
+	int sleeping;          // which it says here.
+	sem_t room;            // Same for space, producer waits with USBASP_TEE_BLOCK.
+	int blocked;
+	pthread_t thread;
+	volatile int running;
+	volatile int failed;
+
+	uint64_t pushed;       // Bytes offered to this sink.
+	uint64_t dropped;
+	uint64_t drops;        // Chunks dropped.
+	uint64_t blocked_ns;   // Time producer waited for this sink.
+} USBasp_Tee_Sink;
+
+typedef struct USBasp_Tee{
+	USBasp_Tee_Sink* sinks[USBASP_TEE_MAX_SINKS];
+	int count;
+} USBasp_Tee;
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+int usbasp_tee_add(USBasp_Tee* tee, USBasp_Tee_Sink* sink);
+// Matches usbasp_sched_rx_cb, so tee can be scheduler's on_rx with tee as ctx.
+void usbasp_tee_push(void* tee, const uint8_t* data, int len);
+void usbasp_tee_stop(USBasp_Tee* tee);
+void usbasp_tee_print(const USBasp_Tee* tee, FILE* f);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,239 @@
+// Offline analyzer for trace files recorded with usbasp_uart -x FILE.
+#include "usbasp_uart.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+int verbose=0;
+
+typedef USBasp_UART_TraceRecord Record;
+
+static const uint64_t FRAME_NS=1000000; // USB frame is 1ms.
+
+struct Interval{
+	uint64_t start;
+	uint64_t end;
+};
+
+static bool load(const char* path, std::vector<Record>& out){
+	FILE* f=fopen(path, "rb");
+	if(!f){
+		fprintf(stderr, "Cannot open %s\n", path);
+		return false;
+	}
+	USBasp_UART_TraceHeader header;
+	if(fread(&header, sizeof(header), 1, f)!=1 || header.magic!=USBASP_TRACE_MAGIC){
+		fprintf(stderr, "%s is not a USBasp trace\n", path);
+		fclose(f);
+		return false;
+	}
+	if(header.version!=USBASP_TRACE_VERSION || header.record_size!=sizeof(Record)){
+		fprintf(stderr, "Unsupported trace version %d\n", header.version);
+		fclose(f);
+		return false;
+	}
+	Record r;
+	while(fread(&r, sizeof(r), 1, f)==1){
+		out.push_back(r);
+	}
+	fclose(f);
+	std::sort(out.begin(), out.end(), [](const Record& a, const Record& b){
+		return a.submit_ns<b.submit_ns;
+	});
+	return true;
+}
+
+// Transfers of reader and writer threads may be in flight at once, so
+// the bus is busy for the union of their intervals.
+static std::vector<Interval> busyIntervals(const std::vector<Record>& records){
+	std::vector<Interval> busy;
+	for(auto& r : records){
+		if(!busy.empty() && r.submit_ns<=busy.back().end){
+			busy.back().end=std::max(busy.back().end, r.complete_ns);
+			continue;
+		}
+		busy.push_back(Interval{r.submit_ns, r.complete_ns});
+	}
+	return busy;
+}
+
+static uint64_t percentile(std::vector<uint64_t>& v, double p){
+	if(v.empty()){ return 0; }
+	return v[(size_t)(p*(v.size()-1)+0.5)];
+}
+
+// RX carries received data, TX and TX_FREE belong to sending, the rest is
+// configuration.
+static const char* directionOf(const Record& r){
+	switch(r.function){
+	case USBASP_FUNC_UART_RX: return "rx";
+	case USBASP_FUNC_UART_TX:
+	case USBASP_FUNC_UART_TX_FREE: return "tx";
+	default: return "ctl";
+	}
+}
+
+static void usage(const char* name){
+	fprintf(stderr, "Usage: %s [OPTIONS] TRACE\n", name);
+	fprintf(stderr, "Analyzes USB transfer trace recorded with usbasp_uart -x TRACE.\n");
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  -F        print bus utilization of every 1ms frame as CSV\n");
+	fprintf(stderr, "  -t RATE   compare throughput against theoretical RATE in B/s\n");
+	exit(0);
+}
+
+int main(int argc, char** argv){
+	bool frames_csv=false;
+	double theoretical=0;
+	int c;
+	opterr=0;
+	while( (c=getopt(argc, argv, "Ft:"))!=-1){
+		switch(c){
+		case 'F':
+			frames_csv=true;
+			break;
+		case 't':
+			sscanf(optarg, "%lf", &theoretical);
+			break;
+		default:
+			usage(argv[0]);
+			break;
+		}
+	}
+	if(optind>=argc){
+		usage(argv[0]);
+	}
+
+	std::vector<Record> records;
+	if(!load(argv[optind], records)){
+		return -1;
+	}
+	if(records.empty()){
+		printf("Trace is empty.\n");
+		return 0;
+	}
+	uint64_t t0=records.front().submit_ns;
+	uint64_t t1=t0;
+	for(auto& r : records){
+		t1=std::max(t1, r.complete_ns);
+	}
+	uint64_t duration=std::max<uint64_t>(t1-t0, 1);
+	std::vector<Interval> busy=busyIntervals(records);
+
+	// Bus utilization per frame.
+	size_t nframes=(duration+FRAME_NS-1)/FRAME_NS;
+	std::vector<uint64_t> frame_busy(nframes+1, 0);
+	std::vector<int> frame_transfers(nframes+1, 0);
+	uint64_t busy_total=0;
+	for(auto& b : busy){
+		busy_total+=b.end-b.start;
+		for(uint64_t t=b.start; t<b.end; ){
+			size_t frame=(t-t0)/FRAME_NS;
+			uint64_t frame_end=t0+(frame+1)*FRAME_NS;
+			uint64_t end=std::min(frame_end, b.end);
+			frame_busy[frame]+=end-t;
+			t=end;
+		}
+	}
+	for(auto& r : records){
+		frame_transfers[(r.submit_ns-t0)/FRAME_NS]++;
+	}
+	if(frames_csv){
+		printf("frame,busy_us,transfers\n");
+		for(size_t i=0; i<nframes; i++){
+			printf("%zu,%.1f,%d\n", i, frame_busy[i]/1000.0, frame_transfers[i]);
+		}
+		return 0;
+	}
+
+	printf("%zu transfers in %.3fs\n", records.size(), duration/1e9);
+	printf("\nPer function:\n");
+	std::map<int, std::pair<uint64_t, uint64_t> > funcs; // count, bytes
+	for(auto& r : records){
+		auto& f=funcs[r.function];
+		f.first++;
+		if(r.result>0){ f.second+=r.result; }
+	}
+	for(auto& f : funcs){
+		printf("  %3d %-15s %8llu transfers, %9llu bytes\n", f.first,
+				usbasp_uart_func_name(f.first), (unsigned long long)f.second.first,
+				(unsigned long long)f.second.second);
+	}
+
+	printf("\nBus utilization (%zu frames of 1ms): %.1f%% on average\n", nframes,
+			100.0*busy_total/duration);
+	int util_hist[11]={0};
+	for(size_t i=0; i<nframes; i++){
+		int bucket=(int)(frame_busy[i]*10/FRAME_NS);
+		util_hist[std::min(bucket, 10)]++;
+	}
+	for(int i=0; i<=10; i++){
+		if(!util_hist[i]){ continue; }
+		if(i==10){ printf("       100%%: %d frames\n", util_hist[i]); }
+		else{ printf("  %3d-%3d%%: %d frames\n", i*10, i*10+9, util_hist[i]); }
+	}
+
+	std::vector<uint64_t> gaps;
+	for(size_t i=1; i<busy.size(); i++){
+		gaps.push_back(busy[i].start-busy[i-1].end);
+	}
+	std::sort(gaps.begin(), gaps.end());
+	uint64_t idle=duration-busy_total;
+	printf("\nIdle gaps: %zu, %.3fs in total (%.1f%%)\n", gaps.size(), idle/1e9,
+			100.0*idle/duration);
+	if(!gaps.empty()){
+		printf("  p50 %.1fus, p99 %.1fus, max %.1fus\n", percentile(gaps, 0.5)/1000.0,
+				percentile(gaps, 0.99)/1000.0, gaps.back()/1000.0);
+	}
+
+	// Interleaving: how often consecutive transfers come from a different
+	// thread or go in a different direction.
+	std::map<uint32_t, uint64_t> per_thread;
+	std::map<std::string, uint64_t> runs, run_lengths;
+	size_t thread_switches=0;
+	for(size_t i=0; i<records.size(); i++){
+		const Record& r=records[i];
+		per_thread[r.thread]++;
+		std::string dir=directionOf(r);
+		run_lengths[dir]++;
+		if(i==0 || dir!=directionOf(records[i-1])){
+			runs[dir]++;
+		}
+		if(i>0 && r.thread!=records[i-1].thread){
+			thread_switches++;
+		}
+	}
+	printf("\nThreads:\n");
+	for(auto& t : per_thread){
+		printf("  thread %u: %llu transfers\n", t.first, (unsigned long long)t.second);
+	}
+	printf("  %zu switches between threads\n", thread_switches);
+	printf("Direction runs:\n");
+	for(auto& d : runs){
+		printf("  %-3s: %llu runs, %.1f transfers per run\n", d.first.c_str(),
+				(unsigned long long)d.second, run_lengths[d.first]/(double)d.second);
+	}
+
+	// Achieved throughput against zero-idle ceiling: the same transfers
+	// sent back to back, without gaps between them.
+	printf("\nThroughput:\n");
+	for(int func : {USBASP_FUNC_UART_RX, USBASP_FUNC_UART_TX}){
+		uint64_t bytes=funcs[func].second;
+		if(!bytes){ continue; }
+		double achieved=bytes/(duration/1e9);
+		double ceiling=bytes/(busy_total/1e9);
+		printf("  %s: %.0f B/s achieved, %.0f B/s without idle gaps",
+				func==USBASP_FUNC_UART_RX?"rx":"tx", achieved, ceiling);
+		if(theoretical>0){
+			printf(", %.1f%% of %.0f B/s", 100*achieved/theoretical, theoretical);
+		}
+		printf("\n");
+	}
+	return 0;
+}
@@ -1,8 +1,19 @@
 #include "usbasp_uart.h"
 
+#include <ctype.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#endif
 
 #define USB_ERROR_NOTFOUND 1
 #define USB_ERROR_ACCESS   2
@@ -13,22 +24,80 @@
 
 #define dprintf(...) if(verbose>0){fprintf(stderr,__VA_ARGS__);}
 
+// Stats may be updated from reader and writer threads at once.
+#ifdef _MSC_VER
+#define stat_add(x, n) InterlockedExchangeAdd64((volatile LONG64*)&(x), (n))
+#else
+#define stat_add(x, n) __atomic_fetch_add(&(x), (n), __ATOMIC_RELAXED)
+#endif
+
+#ifdef _MSC_VER
+#define thread_local_var __declspec(thread)
+#define spin_lock(x) while(InterlockedExchange((volatile LONG*)&(x), 1)){}
+#define spin_unlock(x) InterlockedExchange((volatile LONG*)&(x), 0)
+#else
+#define thread_local_var __thread
+#define spin_lock(x) while(__atomic_exchange_n(&(x), 1, __ATOMIC_ACQUIRE)){}
+#define spin_unlock(x) __atomic_store_n(&(x), 0, __ATOMIC_RELEASE)
+#endif
+
+// Full barriers, for handing device over between threads on reconnect.
+#ifdef _MSC_VER
+#define sync_add(x, n) InterlockedExchangeAdd((volatile LONG*)&(x), (n))
+#define sync_get(x) InterlockedCompareExchange((volatile LONG*)&(x), 0, 0)
+#define sync_xchg(x, v) InterlockedExchange((volatile LONG*)&(x), (v))
+#else
+#define sync_add(x, n) __atomic_fetch_add(&(x), (n), __ATOMIC_SEQ_CST)
+#define sync_get(x) __atomic_load_n(&(x), __ATOMIC_SEQ_CST)
+#define sync_xchg(x, v) __atomic_exchange_n(&(x), (v), __ATOMIC_SEQ_CST)
+#endif
+
+// Records are collected in memory and written out in blocks, so tracing
+// costs one fwrite() per USBASP_TRACE_BLOCK transfers. There are two blocks:
+// a full one is swapped out under lock and written under write_lock only,
+// so transfers keep recording into the other one meanwhile. Lock order is
+// lock, then write_lock. The struct lives until usbasp_uart_disable(), so
+// closing the trace is safe even while other threads are transferring.
+#define USBASP_TRACE_BLOCK 4096
+
+struct USBasp_UART_Trace{
+	FILE* f;
+	volatile int lock;
+	volatile int write_lock;
+	int active;
+	int count;
+	USBasp_UART_TraceRecord records[2][USBASP_TRACE_BLOCK];
+};
+
 static int usbasp_uart_open(USBasp_UART* usbasp);
+static void usbasp_uart_ctx_put(void);
 static uint32_t usbasp_uart_capabilities(USBasp_UART* usbasp);
 static int usbasp_uart_transmit(USBasp_UART* usbasp, uint8_t receive, 
 		uint8_t functionid, const uint8_t* send, uint8_t* buffer, 
 		uint16_t buffersize);
 
+static void usbasp_uart_account(USBasp_UART* usbasp, uint8_t receive,
+		uint8_t functionid, const uint8_t* send, uint16_t buffersize, int rv,
+		uint64_t start, uint64_t finish);
+static int64_t usbasp_uart_caps_config(USBasp_UART* usbasp, const uint8_t* send,
+		int* configured);
+static void usbasp_uart_cache_caps(USBasp_UART* usbasp, uint32_t caps);
+static void usbasp_uart_sleep_us(int us);
+static int usbasp_uart_reopen(USBasp_UART* usbasp);
+
 static uint8_t dummy[4];
 
+void (*usbasp_uart_nb_off)(USBasp_UART* usbasp);
+
 int usbasp_uart_config(USBasp_UART* usbasp, int baud, int flags){
-	if(usbasp_uart_open(usbasp) != 0){
-		return -1;
-	}
-	uint32_t caps=usbasp_uart_capabilities(usbasp);
-	dprintf("Capabilities: %x\n", caps);
-	if(!(caps & USBASP_CAP_6_UART)){
-		return USBASP_NO_CAPS;
+	int opened=!usbasp->usbhandle;
+	if(opened){
+		usbasp->open_ns=usbasp_uart_now_ns();
+		usbasp->first_rx_ns=0;
+		if(usbasp_uart_open(usbasp) != 0){
+			return -1;
+		}
+		usbasp->found_ns=usbasp_uart_now_ns();
 	}
 	uint8_t send[4];
 
@@ -42,7 +111,44 @@ int usbasp_uart_config(USBasp_UART* usbasp, int baud, int flags){
 	send[1]=presc>>8;
 	send[0]=presc&0xFF;
 	send[2]=flags&0xFF;
-	usbasp_uart_transmit(usbasp, 1, USBASP_FUNC_UART_CONFIG, send, dummy, 0);
+	send[3]=0;
+	usbasp->baud=baud;
+	usbasp->flags=flags;
+
+	// Config goes along with asking for capabilities only when they are
+	// known to allow it, so firmware without UART never gets it.
+	uint32_t known=usbasp->caps;
+	int configured=0;
+	int64_t caps=-1;
+	if((known & USBASP_CAP_6_UART) &&
+			(!(flags & USBASP_UART_LOOPBACK) || (known & USBASP_CAP_7_UART_LOOPBACK))){
+		caps=usbasp_uart_caps_config(usbasp, send, &configured);
+	}
+	if(caps<0){
+		caps=usbasp_uart_capabilities(usbasp);
+	}
+	dprintf("Capabilities: %x\n", (uint32_t)caps);
+	usbasp->caps=caps;
+	if(caps!=known){
+		usbasp_uart_cache_caps(usbasp, caps);
+	}
+	if(!(caps & USBASP_CAP_6_UART)){
+		return USBASP_NO_CAPS;
+	}
+	if((flags & USBASP_UART_LOOPBACK) && !(caps & USBASP_CAP_7_UART_LOOPBACK)){
+		// Cached capabilities were wrong, firmware not knowing the flag
+		// was configured without loopback.
+		if(configured){
+			usbasp_uart_transmit(usbasp, 1, USBASP_FUNC_UART_DISABLE, dummy, dummy, 0);
+		}
+		return USBASP_NO_CAPS;
+	}
+	if(!configured){
+		usbasp_uart_transmit(usbasp, 1, USBASP_FUNC_UART_CONFIG, send, dummy, 0);
+	}
+	if(opened){
+		usbasp->config_ns=usbasp_uart_now_ns();
+	}
 	return 0;
 }
 
@@ -55,8 +161,36 @@ void usbasp_uart_flushtx(USBasp_UART* usbasp){
 }
 
 void usbasp_uart_disable(USBasp_UART* usbasp){
+	if(usbasp->nb){ usbasp_uart_nb_off(usbasp); }
+	if(usbasp->usbhandle){
+		usbasp_uart_transmit(usbasp, 1, USBASP_FUNC_UART_DISABLE, dummy, dummy, 0);
+		libusb_close(usbasp->usbhandle);
+		usbasp->usbhandle=NULL;
+		usbasp_uart_ctx_put();
+	}
+	usbasp_uart_trace_close(usbasp);
+	free(usbasp->trace);
+	usbasp->trace=NULL;
+}
+
+// Closes the device, e.g. for a programmer to use it, keeping stats, trace
+// and configuration, which usbasp_uart_resume() applies again. No other
+// thread may be transferring.
+void usbasp_uart_suspend(USBasp_UART* usbasp){
+	if(!usbasp->usbhandle){
+		return;
+	}
 	usbasp_uart_transmit(usbasp, 1, USBASP_FUNC_UART_DISABLE, dummy, dummy, 0);
 	libusb_close(usbasp->usbhandle);
+	usbasp->usbhandle=NULL;
+	usbasp_uart_ctx_put();
+}
+
+int usbasp_uart_resume(USBasp_UART* usbasp){
+	if(usbasp->usbhandle){
+		return 0;
+	}
+	return usbasp_uart_reopen(usbasp);
 }
 
 int usbasp_uart_read(USBasp_UART* usbasp, uint8_t* buff, size_t len){
@@ -64,10 +198,17 @@ int usbasp_uart_read(USBasp_UART* usbasp, uint8_t* buff, size_t len){
 	return usbasp_uart_transmit(usbasp, 1, USBASP_FUNC_UART_RX, dummy, buff, len);
 }
 
-int usbasp_uart_write(USBasp_UART* usbasp, uint8_t* buff, size_t len){
+static size_t usbasp_uart_tx_free(USBasp_UART* usbasp){
 	uint8_t tmp[2];
 	usbasp_uart_transmit(usbasp, 1,  USBASP_FUNC_UART_TX_FREE, dummy, tmp, 2);
 	size_t avail=(tmp[0]<<8)|tmp[1];
+	if(avail==0 && usbasp->stats){
+		stat_add(usbasp->stats->tx_stalls, 1);
+	}
+	return avail;
+}
+int usbasp_uart_write(USBasp_UART* usbasp, uint8_t* buff, size_t len){
+	size_t avail=usbasp_uart_tx_free(usbasp);
 	if(len>avail){
 		len=avail;
 	}
@@ -89,53 +230,791 @@ int usbasp_uart_write_all(USBasp_UART* usbasp, uint8_t* buff, int len){
 	return len;
 }
 
+// Sends buffers one after another, like write_all of their concatenation.
+// Transfers are sent straight from caller memory, only the ones spanning
+// two buffers are gathered into a small bounce buffer.
+int usbasp_uart_writev(USBasp_UART* usbasp, const struct iovec* iov, int iovcnt){
+	uint8_t bounce[256];
+	size_t total=0;
+	size_t off=0;
+	int i=0;
+	while(i<iovcnt){
+		if(off==iov[i].iov_len){
+			i++;
+			off=0;
+			continue;
+		}
+		size_t avail=usbasp_uart_tx_free(usbasp);
+		if(avail==0){ continue; }
+		if(avail>sizeof(bounce)){ avail=sizeof(bounce); }
+		uint8_t* data=(uint8_t*)iov[i].iov_base+off;
+		size_t len=iov[i].iov_len-off;
+		if(len<avail && i+1<iovcnt){
+			// Gather following buffers up to avail.
+			len=0;
+			for(int j=i; j<iovcnt && len<avail; j++){
+				size_t from=j==i?off:0;
+				size_t n=iov[j].iov_len-from;
+				if(n>avail-len){ n=avail-len; }
+				memcpy(bounce+len, (uint8_t*)iov[j].iov_base+from, n);
+				len+=n;
+			}
+			data=bounce;
+		}
+		else if(len>avail){
+			len=avail;
+		}
+		int rv=usbasp_uart_transmit(usbasp, 0, USBASP_FUNC_UART_TX, dummy, data, len);
+		if(rv<0){ dprintf("writev: rv=%d\n", rv); return rv; }
+		total+=rv;
+		// Skip what was sent, possibly over several buffers.
+		for(size_t left=rv; left>0; ){
+			size_t n=iov[i].iov_len-off;
+			if(n>left){ n=left; }
+			off+=n;
+			left-=n;
+			if(off==iov[i].iov_len){
+				i++;
+				off=0;
+			}
+		}
+	}
+	return total;
+}
+
+// Streams fd until EOF. Regular files are mapped and sent straight from
+// page cache in windows of USBASP_SEND_WINDOW bytes, pipes and terminals
+// are read in large blocks. Returns number of bytes sent or <0 on error.
+#define USBASP_SEND_WINDOW (1<<20)
+int64_t usbasp_uart_send_fd(USBasp_UART* usbasp, int fd){
+	int64_t total=0;
+#ifndef _WIN32
+	struct stat st;
+	if(fstat(fd, &st)==0 && S_ISREG(st.st_mode)){
+		off_t pos=lseek(fd, 0, SEEK_CUR);
+		if(pos<0){ pos=0; }
+		long page=sysconf(_SC_PAGESIZE);
+		while(pos<st.st_size){
+			off_t base=pos-pos%page;
+			size_t map_len=st.st_size-base;
+			if(map_len>USBASP_SEND_WINDOW){ map_len=USBASP_SEND_WINDOW; }
+			uint8_t* map=(uint8_t*)mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, base);
+			if(map==MAP_FAILED){
+				break; // Fall back to read() below.
+			}
+			madvise(map, map_len, MADV_SEQUENTIAL);
+			int rv=usbasp_uart_write_all(usbasp, map+(pos-base), map_len-(pos-base));
+			munmap(map, map_len);
+			if(rv<0){ return rv; }
+			pos+=rv;
+			total+=rv;
+		}
+		lseek(fd, pos, SEEK_SET);
+		if(pos>=st.st_size){ return total; }
+	}
+#endif
+	static const size_t block=64*1024;
+	uint8_t* buff=(uint8_t*)malloc(block);
+	if(!buff){ return -1; }
+	while(1){
+		int n=read(fd, buff, block);
+		if(n==0){ break; }
+		if(n<0){
+			dprintf("send_fd: read returned %d\n", n);
+			free(buff);
+			return -1;
+		}
+		int rv=usbasp_uart_write_all(usbasp, buff, n);
+		if(rv<0){
+			free(buff);
+			return rv;
+		}
+		total+=rv;
+	}
+	free(buff);
+	return total;
+}
+
+// Writes all iovecs, continuing after partial writes.
+static int usbasp_uart_writev_fd(int fd, struct iovec* iov, int iovcnt){
+	while(iovcnt>0){
+#ifdef _WIN32
+		int rv=_write(fd, iov->iov_base, iov->iov_len);
+#else
+		ssize_t rv=writev(fd, iov, iovcnt);
+#endif
+		if(rv<0){ return -1; }
+		while(iovcnt>0 && (size_t)rv>=iov->iov_len){
+			rv-=iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if(iovcnt>0){
+			iov->iov_base=(uint8_t*)iov->iov_base+rv;
+			iov->iov_len-=rv;
+		}
+	}
+	return 0;
+}
+
+// Copies RX to fd until an error, which is returned. Every poll reads straight into the next
+// of USBASP_RECV_SLOTS slots, and slots are written out with one writev()
+// once all are used or the oldest byte waited latency_us.
+#define USBASP_RECV_SLOTS 64
+int usbasp_uart_recv_fd(USBasp_UART* usbasp, int fd, int latency_us){
+	uint8_t* slots=(uint8_t*)malloc(USBASP_RECV_SLOTS*USBASP_CHUNK_SIZE);
+	if(!slots){ return -1; }
+	struct iovec iov[USBASP_RECV_SLOTS];
+	int used=0;
+	uint64_t oldest=0;
+	int rv=0;
+	while(1){
+		int timeout_ms=-1;
+		if(used){
+			uint64_t age=(usbasp_uart_now_ns()-oldest)/1000;
+			timeout_ms=age<(uint64_t)latency_us?(int)((latency_us-age)/1000):0;
+		}
+		uint8_t* slot=slots+used*USBASP_CHUNK_SIZE;
+		int n=usbasp_uart_read_wait(usbasp, slot, USBASP_CHUNK_SIZE, timeout_ms);
+		if(n<0){
+			dprintf("recv_fd: rv=%d\n", n);
+			rv=n;
+			break;
+		}
+		if(n>0){
+			if(!used){ oldest=usbasp_uart_now_ns(); }
+			iov[used].iov_base=slot;
+			iov[used].iov_len=n;
+			used++;
+		}
+		if(!used){ continue; }
+		if(used<USBASP_RECV_SLOTS && latency_us>0 &&
+				usbasp_uart_now_ns()-oldest<(uint64_t)latency_us*1000){
+			continue;
+		}
+		if(usbasp_uart_writev_fd(fd, iov, used)<0){
+			dprintf("recv_fd: write failed\n");
+			rv=-1;
+			break;
+		}
+		used=0;
+	}
+	free(slots);
+	return rv;
+}
+
+int usbasp_uart_pool_init(USBasp_UART_Pool* pool, size_t count){
+	pool->chunks=(USBasp_UART_Chunk*)calloc(count, sizeof(USBasp_UART_Chunk));
+	if(!pool->chunks){
+		return -1;
+	}
+	pool->free=NULL;
+	for(size_t i=count; i>0; i--){
+		pool->chunks[i-1].pool=pool;
+		pool->chunks[i-1].next=pool->free;
+		pool->free=&pool->chunks[i-1];
+	}
+	pool->count=count;
+	pool->in_use=pool->peak=0;
+	pool->exhausted=0;
+	pool->lock=0;
+	return 0;
+}
+
+// All chunks must be released by now.
+void usbasp_uart_pool_free(USBasp_UART_Pool* pool){
+	free(pool->chunks);
+	pool->chunks=pool->free=NULL;
+}
+
+// Returns NULL when all chunks are in use.
+USBasp_UART_Chunk* usbasp_uart_chunk_get(USBasp_UART_Pool* pool){
+	spin_lock(pool->lock);
+	USBasp_UART_Chunk* chunk=pool->free;
+	if(chunk){
+		pool->free=chunk->next;
+		chunk->next=NULL;
+		if(++pool->in_use>pool->peak){ pool->peak=pool->in_use; }
+	}
+	else{
+		pool->exhausted++;
+	}
+	spin_unlock(pool->lock);
+	return chunk;
+}
+
+void usbasp_uart_chunk_release(USBasp_UART_Chunk* chunk){
+	if(!chunk){
+		return;
+	}
+	USBasp_UART_Pool* pool=chunk->pool;
+	spin_lock(pool->lock);
+	chunk->next=pool->free;
+	pool->free=chunk;
+	pool->in_use--;
+	spin_unlock(pool->lock);
+}
+
+// Polls RX once. On data, *out is a chunk owned by the caller, otherwise
+// it is NULL. Returns bytes received, 0, USBASP_POOL_EMPTY without polling
+// when no chunk is free, or another error.
+int usbasp_uart_read_chunk(USBasp_UART* usbasp, USBasp_UART_Pool* pool, USBasp_UART_Chunk** out){
+	*out=NULL;
+	USBasp_UART_Chunk* chunk=usbasp_uart_chunk_get(pool);
+	if(!chunk){
+		return USBASP_POOL_EMPTY;
+	}
+	int rv=usbasp_uart_read(usbasp, chunk->data, USBASP_CHUNK_SIZE);
+	if(rv<=0){
+		usbasp_uart_chunk_release(chunk);
+		return rv;
+	}
+	chunk->len=rv;
+	chunk->ns=usbasp_uart_now_ns();
+	*out=chunk;
+	return rv;
+}
+
+void usbasp_uart_set_poll(USBasp_UART* usbasp, int mode, int interval_us){
+	usbasp->poll_mode=mode;
+	usbasp->poll_interval_us=interval_us;
+}
+
+uint64_t usbasp_uart_now_ns(void){
+#ifdef _WIN32
+	LARGE_INTEGER freq, cnt;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&cnt);
+	return (uint64_t)(cnt.QuadPart/(double)freq.QuadPart*1e9);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000u+ts.tv_nsec;
+#endif
+}
+
+static void usbasp_uart_sleep_us(int us){
+#ifdef _WIN32
+	Sleep((us+999)/1000);
+#else
+	usleep(us);
+#endif
+}
+
+// Polls RX according to usbasp->poll_mode until something arrives.
+// Returns 0 on timeout (timeout_ms<0 waits forever).
+int usbasp_uart_read_wait(USBasp_UART* usbasp, uint8_t* buff, size_t len, int timeout_ms){
+	uint64_t deadline=usbasp_uart_now_ns()+(uint64_t)timeout_ms*1000000u;
+	int delay=1;
+	while(1){
+		int rv=usbasp_uart_read(usbasp, buff, len);
+		if(rv!=0){ return rv; }
+		if(timeout_ms>=0 && usbasp_uart_now_ns()>=deadline){ return 0; }
+		switch(usbasp->poll_mode){
+		case USBASP_POLL_SLEEP:
+			usbasp_uart_sleep_us(usbasp->poll_interval_us);
+			break;
+		case USBASP_POLL_BACKOFF:
+			usbasp_uart_sleep_us(delay);
+			delay*=2;
+			if(delay>usbasp->poll_interval_us){ delay=usbasp->poll_interval_us; }
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+// Stats are opt-in, pass NULL to disable them again.
+void usbasp_uart_stats_enable(USBasp_UART* usbasp, USBasp_UART_Stats* stats){
+	if(stats){
+		memset(stats, 0, sizeof(*stats));
+	}
+	usbasp->stats=stats;
+}
+
+void usbasp_uart_stats_get(USBasp_UART* usbasp, USBasp_UART_Stats* out){
+	if(!usbasp->stats){
+		memset(out, 0, sizeof(*out));
+		return;
+	}
+	memcpy(out, usbasp->stats, sizeof(*out));
+}
+
+const char* usbasp_uart_func_name(int func){
+	switch(func){
+	case USBASP_FUNC_UART_CONFIG:     return "CONFIG";
+	case USBASP_FUNC_UART_FLUSHTX:    return "FLUSHTX";
+	case USBASP_FUNC_UART_FLUSHRX:    return "FLUSHRX";
+	case USBASP_FUNC_UART_DISABLE:    return "DISABLE";
+	case USBASP_FUNC_UART_TX:         return "TX";
+	case USBASP_FUNC_UART_RX:         return "RX";
+	case USBASP_FUNC_UART_TX_FREE:    return "TX_FREE";
+	case USBASP_FUNC_UART_RX_FREE:    return "RX_FREE";
+	case USBASP_FUNC_GETCAPABILITIES: return "GETCAPABILITIES";
+	default:                          return "?";
+	}
+}
+
+void usbasp_uart_stats_print(const USBasp_UART_Stats* stats, FILE* f){
+	uint64_t total=0, total_ns=0;
+	fprintf(f, "Function            transfers      bytes  avg bytes  errors   avg us\n");
+	for(int i=0; i<USBASP_STATS_FUNCS; i++){
+		uint64_t n=stats->transfers[i];
+		if(!n){ continue; }
+		total+=n;
+		total_ns+=stats->ns[i];
+		fprintf(f, "%-3d %-15s %9llu %10llu %10.1f %7llu %8.1f\n", i,
+				usbasp_uart_func_name(i), (unsigned long long)n,
+				(unsigned long long)stats->bytes[i], stats->bytes[i]/(double)n,
+				(unsigned long long)stats->errors[i], stats->ns[i]/1000.0/n);
+	}
+	fprintf(f, "Total: %llu transfers, %.3fs in transfers\n",
+			(unsigned long long)total, total_ns/1e9);
+	fprintf(f, "Timeouts: %llu, empty RX polls: %llu, TX stalls: %llu\n",
+			(unsigned long long)stats->timeouts, (unsigned long long)stats->rx_empty,
+			(unsigned long long)stats->tx_stalls);
+	fprintf(f, "Bytes per transfer:\n");
+	for(int i=0; i<USBASP_STATS_SIZES; i++){
+		if(!stats->sizes[i]){ continue; }
+		if(i==0){ fprintf(f, "  %9d: %llu\n", 0, (unsigned long long)stats->sizes[i]); }
+		else{
+			fprintf(f, "  %4d-%4d: %llu\n", 1<<(i-1), (1<<i)-1,
+					(unsigned long long)stats->sizes[i]);
+		}
+	}
+	fprintf(f, "Transfer duration:\n");
+	for(int i=0; i<USBASP_STATS_BUCKETS; i++){
+		if(!stats->durations[i]){ continue; }
+		fprintf(f, "  %8dus-%8dus: %llu\n", i?1<<i:0, (2<<i)-1,
+				(unsigned long long)stats->durations[i]);
+	}
+}
+
+// Times of last open, counted from start of usbasp_uart_config().
+void usbasp_uart_timing_print(const USBasp_UART* usbasp, FILE* f){
+	if(!usbasp->open_ns){ return; }
+	fprintf(f, "Open: device %.2fms (%s), configured %.2fms",
+			(usbasp->found_ns-usbasp->open_ns)/1e6,
+			usbasp->cached?"cached":usbasp->cache?"scanned, cache updated":"scanned",
+			(usbasp->config_ns-usbasp->open_ns)/1e6);
+	if(usbasp->first_rx_ns){
+		fprintf(f, ", first byte %.2fms\n", (usbasp->first_rx_ns-usbasp->open_ns)/1e6);
+	}
+	else{
+		fprintf(f, ", no byte received\n");
+	}
+	if(usbasp->reconnects){
+		fprintf(f, "Reconnects: %llu, last took %.1fms, up to %llu bytes lost\n",
+				(unsigned long long)usbasp->reconnects, usbasp->reconnect_ns/1e6,
+				(unsigned long long)usbasp->lost_bytes);
+	}
+}
+
+static void usbasp_uart_stats_add(USBasp_UART_Stats* stats, uint8_t functionid,
+		int rv, uint64_t ns){
+	int f=functionid&(USBASP_STATS_FUNCS-1);
+	stat_add(stats->transfers[f], 1);
+	stat_add(stats->ns[f], ns);
+	if(rv<0){
+		stat_add(stats->errors[f], 1);
+		if(rv==LIBUSB_ERROR_TIMEOUT){
+			stat_add(stats->timeouts, 1);
+		}
+	}
+	else{
+		stat_add(stats->bytes[f], rv);
+		int s=0;
+		for(int n=rv; n && s<USBASP_STATS_SIZES-1; n>>=1){ s++; }
+		stat_add(stats->sizes[s], 1);
+		if(rv==0 && functionid==USBASP_FUNC_UART_RX){
+			stat_add(stats->rx_empty, 1);
+		}
+	}
+	int d=0;
+	for(uint64_t us=ns/1000; us>1 && d<USBASP_STATS_BUCKETS-1; us>>=1){ d++; }
+	stat_add(stats->durations[d], 1);
+}
+
+int usbasp_uart_trace_open(USBasp_UART* usbasp, const char* path){
+	usbasp_uart_trace_close(usbasp);
+	FILE* f=fopen(path, "wb");
+	if(!f){
+		return -1;
+	}
+	USBasp_UART_TraceHeader header={USBASP_TRACE_MAGIC, USBASP_TRACE_VERSION,
+		sizeof(USBasp_UART_TraceRecord)};
+	fwrite(&header, sizeof(header), 1, f);
+	if(!usbasp->trace){
+		usbasp->trace=(USBasp_UART_Trace*)calloc(1, sizeof(USBasp_UART_Trace));
+		if(!usbasp->trace){
+			fclose(f);
+			return -1;
+		}
+	}
+	spin_lock(usbasp->trace->lock);
+	spin_lock(usbasp->trace->write_lock);
+	usbasp->trace->f=f;
+	spin_unlock(usbasp->trace->write_lock);
+	spin_unlock(usbasp->trace->lock);
+	return 0;
+}
+
+void usbasp_uart_trace_close(USBasp_UART* usbasp){
+	USBasp_UART_Trace* trace=usbasp->trace;
+	if(!trace){
+		return;
+	}
+	spin_lock(trace->lock);
+	spin_lock(trace->write_lock);
+	if(trace->f){
+		fwrite(trace->records[trace->active], sizeof(USBasp_UART_TraceRecord),
+			trace->count, trace->f);
+		fclose(trace->f);
+		trace->f=NULL;
+	}
+	trace->count=0;
+	spin_unlock(trace->write_lock);
+	spin_unlock(trace->lock);
+}
+
+static uint32_t usbasp_uart_thread_id(void){
+	static volatile uint32_t next=0;
+	static thread_local_var uint32_t id=0;
+	if(!id){
+		id=stat_add(next, 1)+1;
+	}
+	return id;
+}
+
+static void usbasp_uart_trace_add(USBasp_UART_Trace* trace, uint8_t receive,
+		uint8_t functionid, const uint8_t* send, uint16_t buffersize, int rv,
+		uint64_t submit, uint64_t complete){
+	uint32_t thread=usbasp_uart_thread_id();
+	spin_lock(trace->lock);
+	if(!trace->f){
+		spin_unlock(trace->lock);
+		return;
+	}
+	USBasp_UART_TraceRecord* r=&trace->records[trace->active][trace->count++];
+	r->submit_ns=submit;
+	r->complete_ns=complete;
+	r->thread=thread;
+	r->value=(send[1] << 8) | send[0];
+	r->index=(send[3] << 8) | send[2];
+	r->requested=buffersize;
+	r->result=rv;
+	r->function=functionid;
+	r->in=receive;
+	r->reserved[0]=r->reserved[1]=0;
+	if(trace->count<USBASP_TRACE_BLOCK){
+		spin_unlock(trace->lock);
+		return;
+	}
+	// Waits here only if the previous block is still being written, which
+	// is the block about to become active again.
+	int full=trace->active;
+	spin_lock(trace->write_lock);
+	trace->active=!full;
+	trace->count=0;
+	spin_unlock(trace->lock);
+	fwrite(trace->records[full], sizeof(USBasp_UART_TraceRecord),
+		USBASP_TRACE_BLOCK, trace->f);
+	spin_unlock(trace->write_lock);
+}
+
+// One context for all handles, created by first open and freed when the
+// last handle is disabled.
+static libusb_context* usbasp_uart_ctx;
+static int usbasp_uart_ctx_users;
+static volatile int usbasp_uart_ctx_lock;
+
+static libusb_context* usbasp_uart_ctx_get(void){
+	spin_lock(usbasp_uart_ctx_lock);
+	if(!usbasp_uart_ctx_users && libusb_init(&usbasp_uart_ctx)!=0){
+		usbasp_uart_ctx=NULL;
+	}
+	if(usbasp_uart_ctx){
+		usbasp_uart_ctx_users++;
+	}
+	libusb_context* ctx=usbasp_uart_ctx;
+	spin_unlock(usbasp_uart_ctx_lock);
+	return ctx;
+}
+
+static void usbasp_uart_ctx_put(void){
+	spin_lock(usbasp_uart_ctx_lock);
+	if(--usbasp_uart_ctx_users==0){
+		libusb_exit(usbasp_uart_ctx);
+		usbasp_uart_ctx=NULL;
+	}
+	spin_unlock(usbasp_uart_ctx_lock);
+}
+
+// Bus and port path, e.g. "1-2.4", known without opening the device.
+static void usbasp_uart_dev_path(libusb_device* dev, char* path, size_t len){
+	uint8_t ports[8];
+	int n=libusb_get_port_numbers(dev, ports, sizeof(ports));
+	int at=snprintf(path, len, "%d", libusb_get_bus_number(dev));
+	for(int i=0; i<n && at<(int)len; i++){
+		at+=snprintf(path+at, len-at, i?".%d":"-%d", ports[i]);
+	}
+}
+
+static int usbasp_uart_is_usbasp(const struct libusb_device_descriptor* descriptor){
+	return descriptor->idVendor == USBASP_SHARED_VID
+			&& descriptor->idProduct == USBASP_SHARED_PID;
+}
+
+// Shared VID/PID is used by other V-USB devices too, so strings are checked.
+static int usbasp_uart_check_strings(libusb_device_handle* handle,
+		const struct libusb_device_descriptor* descriptor){
+	uint8_t str[256];
+	libusb_get_string_descriptor_ascii(handle, 
+			descriptor->iManufacturer & 0xff, str, sizeof(str));
+	if(strcmp("www.fischl.de", (const char*)str)){
+		return 0;
+	}
+	dprintf("Vendor: %s\n", str);
+	libusb_get_string_descriptor_ascii(handle, 
+			descriptor->iProduct & 0xff, str, sizeof(str));
+	if(strcmp("USBasp", (const char*)str)){
+		return 0;
+	}
+	dprintf("Product: %s\n", str);
+	return 1;
+}
+
+static void usbasp_uart_serial(libusb_device_handle* handle,
+		const struct libusb_device_descriptor* descriptor, char* serial, size_t len){
+	serial[0]=0;
+	if(descriptor->iSerialNumber &&
+			libusb_get_string_descriptor_ascii(handle, descriptor->iSerialNumber,
+			(unsigned char*)serial, len)<0){
+		serial[0]=0;
+	}
+}
+
+// Opens dev if it is a USBasp at path with serial, NULL matches any. Serial
+// is stored to found when given. Strings need not be checked again when
+// the device was checked last time and still has the same path and serial.
+static int usbasp_uart_try(libusb_device* dev, const char* path, const char* serial,
+		int checked, libusb_device_handle** handle, char* found, size_t len){
+	struct libusb_device_descriptor descriptor;
+	libusb_get_device_descriptor(dev, &descriptor);
+	if (!usbasp_uart_is_usbasp(&descriptor)) {
+		return USB_ERROR_NOTFOUND;
+	}
+	if (path) {
+		char here[64];
+		usbasp_uart_dev_path(dev, here, sizeof(here));
+		if (strcmp(path, here)) {
+			return USB_ERROR_NOTFOUND;
+		}
+	}
+	*handle=NULL;
+	libusb_open(dev, handle);
+	if (!*handle) {
+		return USB_ERROR_ACCESS;
+	}
+	char here[256];
+	if (serial || found) {
+		usbasp_uart_serial(*handle, &descriptor, here, sizeof(here));
+	}
+	int ok=(!serial || !strcmp(serial, here)) &&
+			(checked || usbasp_uart_check_strings(*handle, &descriptor));
+	if (!ok) {
+		libusb_close(*handle);
+		*handle=NULL;
+		return USB_ERROR_NOTFOUND;
+	}
+	if (found) {
+		snprintf(found, len, "%s", here);
+	}
+	return 0;
+}
+
+// Cache holds one line "select path serial caps" about last device
+// opened, "-" standing for NULL select or empty serial, caps in hex and 0
+// until read (or in caches written before they were kept).
+static int usbasp_uart_cache_load(const char* file, const char* select,
+		char* path, char* serial, uint32_t* caps){
+	FILE* f=fopen(file, "r");
+	if(!f){
+		return 0;
+	}
+	char sel[256];
+	unsigned int c=0;
+	int ok=fscanf(f, "%255s %63s %255s %x", sel, path, serial, &c)>=3 &&
+			!strcmp(sel, select?select:"-");
+	*caps=c;
+	fclose(f);
+	if(ok && !strcmp(serial, "-")){
+		serial[0]=0;
+	}
+	return ok;
+}
+
+// Fields are separated by whitespace, so they must not contain any.
+static int usbasp_uart_cache_field(const char* s){
+	if(!*s){
+		return 0;
+	}
+	for(; *s; s++){
+		if(isspace((unsigned char)*s)){ return 0; }
+	}
+	return 1;
+}
+
+static void usbasp_uart_cache_save(const char* file, const char* select,
+		const char* path, const char* serial, uint32_t caps){
+	if((select && !usbasp_uart_cache_field(select)) ||
+			(serial[0] && !usbasp_uart_cache_field(serial))){
+		dprintf("Not caching device, select or serial has whitespace\n");
+		return;
+	}
+	FILE* f=fopen(file, "w");
+	if(!f){
+		dprintf("Cannot write cache %s\n", file);
+		return;
+	}
+	fprintf(f, "%s %s %s %x\n", select?select:"-", path, serial[0]?serial:"-", caps);
+	fclose(f);
+}
+
+// Keeps capabilities of the device in the cache, if it is the one there.
+static void usbasp_uart_cache_caps(USBasp_UART* usbasp, uint32_t caps){
+	char path[64]={0};
+	char serial[256]={0};
+	uint32_t old;
+	if(usbasp->cache && usbasp_uart_cache_load(usbasp->cache, usbasp->select,
+			path, serial, &old) && !strcmp(path, usbasp->path) && old!=caps){
+		usbasp_uart_cache_save(usbasp->cache, usbasp->select, path, serial, caps);
+	}
+}
+
 int usbasp_uart_open(USBasp_UART* usbasp){
 	int errorCode = USB_ERROR_NOTFOUND;
+	usbasp->usbhandle = NULL;
+	usbasp->cached = 0;
+	usbasp->caps = 0;
+
+	const char* path=NULL;
+	const char* serial=NULL;
+	if(usbasp->select){
+		if(!strncmp(usbasp->select, "path:", 5)){
+			path=usbasp->select+5;
+		}
+		else if(!strncmp(usbasp->select, "serial:", 7)){
+			serial=usbasp->select+7;
+		}
+		else{
+			serial=usbasp->select;
+		}
+	}
 
-	libusb_context* ctx;
-	libusb_init(&ctx);
+	libusb_context* ctx=usbasp_uart_ctx_get();
+	if(!ctx){
+		return USB_ERROR_IO;
+	}
 
 	libusb_device** dev_list;
 	int dev_list_len = libusb_get_device_list(ctx, &dev_list);
 
-	for (int j=0; j<dev_list_len; ++j) {
-		libusb_device* dev = dev_list[j];
-		struct libusb_device_descriptor descriptor;
-		libusb_get_device_descriptor(dev, &descriptor);
-		if (descriptor.idVendor == USBASP_SHARED_VID 
-				&& descriptor.idProduct == USBASP_SHARED_PID) {
-			uint8_t str[256];
-			libusb_open(dev, &usbasp->usbhandle);
-			if (!usbasp->usbhandle) {
-				errorCode = USB_ERROR_ACCESS;
-				continue;
-			}
-			libusb_get_string_descriptor_ascii(usbasp->usbhandle, 
-					descriptor.iManufacturer & 0xff, str, sizeof(str));
-			if(strcmp("www.fischl.de", (const char*)str)){
-				libusb_close(usbasp->usbhandle);
-				usbasp->usbhandle=NULL;
-				continue;
-			}
-			dprintf("Vendor: %s\n", str);
-			libusb_get_string_descriptor_ascii(usbasp->usbhandle, 
-					descriptor.iProduct & 0xff, str, sizeof(str));
-			if(strcmp("USBasp", (const char*)str)){
-				libusb_close(usbasp->usbhandle);
-				usbasp->usbhandle=NULL;
-				continue;
+	// Cached device is tried alone first, and if it still has the serial
+	// it had, its strings are not read again.
+	char cached_path[64]={0};
+	char cached_serial[256]={0};
+	uint32_t cached_caps=0;
+	char found[256];
+	char* want_found=usbasp->cache?found:NULL;
+	if (usbasp->cache && usbasp_uart_cache_load(usbasp->cache, usbasp->select,
+			cached_path, cached_serial, &cached_caps) &&
+			(!serial || !strcmp(serial, cached_serial))) {
+		for (int j=0; j<dev_list_len && !usbasp->usbhandle; ++j) {
+			int rv=usbasp_uart_try(dev_list[j], cached_path,
+					cached_serial[0]?cached_serial:NULL, cached_serial[0]!=0,
+					&usbasp->usbhandle, found, sizeof(found));
+			if (rv==USB_ERROR_ACCESS) {
+				errorCode=rv;
 			}
-			dprintf("Product: %s\n", str);
-			break;
+		}
+		usbasp->cached = usbasp->usbhandle!=NULL;
+		if (usbasp->cached) {
+			usbasp->caps = cached_caps;
+		}
+		dprintf("Cached device %s %s\n", cached_path, usbasp->cached?"opened":"not found");
+	}
+	for (int j=0; j<dev_list_len && !usbasp->usbhandle; ++j) {
+		int rv=usbasp_uart_try(dev_list[j], path, serial, 0,
+				&usbasp->usbhandle, want_found, sizeof(found));
+		if (rv==USB_ERROR_ACCESS) {
+			errorCode=rv;
+		}
+		if (!rv && usbasp->cache) {
+			char here[64];
+			usbasp_uart_dev_path(dev_list[j], here, sizeof(here));
+			usbasp_uart_cache_save(usbasp->cache, usbasp->select, here, found, 0);
 		}
 	}
 	libusb_free_device_list(dev_list,1);
 	if (usbasp->usbhandle != NULL){
 		errorCode = 0;
+		usbasp_uart_dev_path(libusb_get_device(usbasp->usbhandle),
+				usbasp->path, sizeof(usbasp->path));
+	}
+	else{
+		usbasp_uart_ctx_put();
 	}
 	return errorCode;
 }
 
+// Reports path and serial of every USBasp that can be opened, returns count.
+int usbasp_uart_enumerate(usbasp_uart_found_cb found, void* ctx){
+	libusb_context* usb=usbasp_uart_ctx_get();
+	if(!usb){
+		return -1;
+	}
+	libusb_device** dev_list;
+	int dev_list_len = libusb_get_device_list(usb, &dev_list);
+	int count=0;
+	for (int j=0; j<dev_list_len; ++j) {
+		libusb_device* dev = dev_list[j];
+		struct libusb_device_descriptor descriptor;
+		libusb_get_device_descriptor(dev, &descriptor);
+		libusb_device_handle* handle=NULL;
+		if (!usbasp_uart_is_usbasp(&descriptor) || libusb_open(dev, &handle)!=0) {
+			continue;
+		}
+		if (usbasp_uart_check_strings(handle, &descriptor)) {
+			char path[64];
+			char serial[256];
+			usbasp_uart_dev_path(dev, path, sizeof(path));
+			usbasp_uart_serial(handle, &descriptor, serial, sizeof(serial));
+			found(ctx, path, serial);
+			count++;
+		}
+		libusb_close(handle);
+	}
+	libusb_free_device_list(dev_list,1);
+	usbasp_uart_ctx_put();
+	return count;
+}
+
+static void usbasp_uart_print_found(void* ctx, const char* path, const char* serial){
+	fprintf((FILE*)ctx, "path:%s serial:%s\n", path, serial[0]?serial:"(none)");
+}
+
+int usbasp_uart_list(FILE* f){
+	return usbasp_uart_enumerate(usbasp_uart_print_found, f);
+}
+
+// Context shared by all handles, for callers doing asynchronous transfers
+// on them. Valid while at least one handle is open.
+libusb_context* usbasp_uart_context(void){
+	return usbasp_uart_ctx;
+}
+
 uint32_t usbasp_uart_capabilities(USBasp_UART* usbasp){
 	uint8_t res[4];
 	uint8_t tmp[4];
@@ -148,15 +1027,252 @@ uint32_t usbasp_uart_capabilities(USBasp_UART* usbasp){
 	return ret;
 }
 
-int usbasp_uart_transmit(USBasp_UART* usbasp, uint8_t receive, 
-		uint8_t functionid, const uint8_t* send, uint8_t* buffer, 
+static int usbasp_uart_transfer(USBasp_UART* usbasp, uint8_t receive,
+		uint8_t functionid, const uint8_t* send, uint8_t* buffer,
 		uint16_t buffersize){
-	return libusb_control_transfer(usbasp->usbhandle,
+	uint64_t start=0;
+	if(usbasp->stats || usbasp->trace){
+		start=usbasp_uart_now_ns();
+	}
+	int rv=libusb_control_transfer(usbasp->usbhandle,
 			(LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | (receive << 7)) & 0xff,
 			functionid, 
 			((send[1] << 8) | send[0]), 
 			((send[3] << 8) | send[2]), 
 			buffer, 
 			buffersize,
-			5000); // 5s timeout.
+			usbasp_uart_timeout(usbasp));
+	if(rv>0 && functionid==USBASP_FUNC_UART_RX && !usbasp->first_rx_ns){
+		usbasp->first_rx_ns=usbasp_uart_now_ns();
+	}
+	if(usbasp->stats || usbasp->trace){
+		usbasp_uart_account(usbasp, receive, functionid, send, buffersize,
+				rv, start, usbasp_uart_now_ns());
+	}
+	return rv;
+}
+
+// Set on the thread doing reconnect, its transfers go straight through.
+static thread_local_var int usbasp_uart_in_reconnect;
+
+static int usbasp_uart_arrived(libusb_context* ctx, libusb_device* dev,
+		libusb_hotplug_event event, void* user_data){
+	(void)ctx; (void)dev; (void)event;
+	*(int*)user_data=1;
+	return 0;
+}
+
+// Opens the device used before, by select or, without one, by the bus and
+// port path it had, and applies last configuration again.
+static int usbasp_uart_reopen(USBasp_UART* usbasp){
+	const char* select=usbasp->select;
+	const char* cache=usbasp->cache;
+	char by_path[72];
+	if(!select){
+		snprintf(by_path, sizeof(by_path), "path:%s", usbasp->path);
+		usbasp->select=by_path;
+	}
+	usbasp->cache=NULL;
+	int rv=usbasp_uart_open(usbasp);
+	if(rv==0){
+		rv=usbasp_uart_config(usbasp, usbasp->baud, usbasp->flags);
+		if(rv<0){
+			libusb_close(usbasp->usbhandle);
+			usbasp->usbhandle=NULL;
+			usbasp_uart_ctx_put();
+		}
+	}
+	usbasp->select=select;
+	usbasp->cache=cache;
+	return rv;
+}
+
+// Waits for lost device to come back and reopens it.
+// Only one thread reconnects; others wait for it. generation is reconnects
+// seen by caller before its transfer failed, so a failure from before the
+// last reconnect does not start another one.
+static int usbasp_uart_reconnect(USBasp_UART* usbasp, uint64_t generation){
+	if(sync_xchg(usbasp->reconnecting, 1)){
+		while(sync_get(usbasp->reconnecting)){
+			usbasp_uart_sleep_us(1000);
+		}
+		return usbasp->usbhandle?0:-1;
+	}
+	if(usbasp->reconnects!=generation){
+		sync_xchg(usbasp->reconnecting, 0);
+		return usbasp->usbhandle?0:-1;
+	}
+	while(sync_get(usbasp->users)){
+		usbasp_uart_sleep_us(1000);
+	}
+	uint64_t lost_ns=usbasp_uart_now_ns();
+	fprintf(stderr, "Note: USBasp %s lost, reconnecting...\n", usbasp->path);
+	usbasp_uart_in_reconnect=1;
+	// Context reference of the old handle is kept, so hotplug callback
+	// stays registered while nothing is open.
+	libusb_context* ctx=usbasp_uart_ctx;
+	libusb_close(usbasp->usbhandle);
+	usbasp->usbhandle=NULL;
+	int arrived=0;
+	libusb_hotplug_callback_handle hotplug;
+	int has_hotplug=libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+			libusb_hotplug_register_callback(ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+			LIBUSB_HOTPLUG_NO_FLAGS, USBASP_SHARED_VID, USBASP_SHARED_PID,
+			LIBUSB_HOTPLUG_MATCH_ANY, usbasp_uart_arrived, &arrived, &hotplug)==0;
+	int rv=-1;
+	while(1){
+		if(usbasp_uart_reopen(usbasp)==0){
+			rv=0;
+			break;
+		}
+		if(usbasp->reconnect_ms>0 &&
+				usbasp_uart_now_ns()-lost_ns>(uint64_t)usbasp->reconnect_ms*1000000u){
+			break;
+		}
+		// Without hotplug support, device is looked for every 200ms.
+		if(has_hotplug){
+			struct timeval tv={0, 200000};
+			libusb_handle_events_timeout_completed(ctx, &tv, &arrived);
+			arrived=0;
+		}
+		else{
+			usbasp_uart_sleep_us(200000);
+		}
+	}
+	if(has_hotplug){
+		libusb_hotplug_deregister_callback(ctx, hotplug);
+	}
+	usbasp_uart_ctx_put();
+	usbasp_uart_in_reconnect=0;
+	if(rv==0){
+		uint64_t gap=usbasp_uart_now_ns()-lost_ns;
+		uint64_t lost=gap/1000*usbasp->baud/10/1000000;
+		usbasp->reconnect_ns=gap;
+		usbasp->lost_bytes+=lost;
+		usbasp->reconnects++;
+		fprintf(stderr, "Note: USBasp reconnected after %.1fms, up to %llu bytes lost.\n",
+				gap/1e6, (unsigned long long)lost);
+	}
+	else{
+		fprintf(stderr, "Note: USBasp did not come back.\n");
+	}
+	sync_xchg(usbasp->reconnecting, 0);
+	return rv;
+}
+
+// With reconnect enabled, transfers that find the device gone wait until
+// it is back and are then repeated. Threads count themselves in users
+// while transferring, so the handle is never closed under them.
+int usbasp_uart_transmit(USBasp_UART* usbasp, uint8_t receive,
+		uint8_t functionid, const uint8_t* send, uint8_t* buffer,
+		uint16_t buffersize){
+	if(!usbasp->reconnect_ms || usbasp_uart_in_reconnect){
+		return usbasp_uart_transfer(usbasp, receive, functionid, send, buffer, buffersize);
+	}
+	while(1){
+		sync_add(usbasp->users, 1);
+		if(!sync_get(usbasp->reconnecting)){ break; }
+		sync_add(usbasp->users, -1);
+		usbasp_uart_sleep_us(1000);
+	}
+	uint64_t generation=usbasp->reconnects;
+	int rv=LIBUSB_ERROR_NO_DEVICE;
+	if(usbasp->usbhandle){
+		rv=usbasp_uart_transfer(usbasp, receive, functionid, send, buffer, buffersize);
+	}
+	sync_add(usbasp->users, -1);
+	if((rv==LIBUSB_ERROR_NO_DEVICE || rv==LIBUSB_ERROR_IO) && usbasp->usbhandle &&
+			usbasp_uart_reconnect(usbasp, generation)==0){
+		return usbasp_uart_transmit(usbasp, receive, functionid, send, buffer, buffersize);
+	}
+	return rv;
+}
+
+static void usbasp_uart_account(USBasp_UART* usbasp, uint8_t receive,
+		uint8_t functionid, const uint8_t* send, uint16_t buffersize, int rv,
+		uint64_t start, uint64_t finish){
+	if(usbasp->stats){
+		usbasp_uart_stats_add(usbasp->stats, functionid, rv, finish-start);
+	}
+	USBasp_UART_Trace* trace=usbasp->trace;
+	if(trace){
+		usbasp_uart_trace_add(trace, receive, functionid, send, buffersize,
+				rv, start, finish);
+	}
+}
+
+typedef struct USBasp_UART_Async{
+	int done;  // First, as libusb_handle_events_completed() watches it.
+	int rv;
+	uint64_t finish;
+} USBasp_UART_Async;
+
+static void usbasp_uart_async_done(struct libusb_transfer* xfer){
+	USBasp_UART_Async* async=(USBasp_UART_Async*)xfer->user_data;
+	async->finish=usbasp_uart_now_ns();
+	switch(xfer->status){
+	case LIBUSB_TRANSFER_COMPLETED: async->rv=xfer->actual_length; break;
+	case LIBUSB_TRANSFER_TIMED_OUT: async->rv=LIBUSB_ERROR_TIMEOUT; break;
+	case LIBUSB_TRANSFER_STALL:     async->rv=LIBUSB_ERROR_PIPE; break;
+	case LIBUSB_TRANSFER_NO_DEVICE: async->rv=LIBUSB_ERROR_NO_DEVICE; break;
+	default:                        async->rv=LIBUSB_ERROR_IO; break;
+	}
+	async->done=1;
+}
+
+// Submits GETCAPABILITIES and CONFIG together, so that both are queued on
+// the control endpoint at once and CONFIG does not wait a round trip for
+// capabilities. Only called when cached capabilities show UART, so
+// firmware without it never gets CONFIG. Returns capabilities, 0 if the
+// query failed, or -1 if nothing could be submitted; *configured tells
+// whether CONFIG was submitted and succeeded.
+static int64_t usbasp_uart_caps_config(USBasp_UART* usbasp, const uint8_t* send,
+		int* configured){
+	libusb_context* ctx=usbasp_uart_ctx;
+	static const uint8_t none[4]={0, 0, 0, 0};
+	const uint8_t* sends[2]={none, send};
+	const uint8_t funcs[2]={USBASP_FUNC_GETCAPABILITIES, USBASP_FUNC_UART_CONFIG};
+	const uint16_t lens[2]={4, 0};
+	uint8_t buff[2][LIBUSB_CONTROL_SETUP_SIZE+4];
+	USBasp_UART_Async async[2];
+	struct libusb_transfer* xfer[2]={libusb_alloc_transfer(0), libusb_alloc_transfer(0)};
+	int submitted=0;
+	uint64_t start=usbasp_uart_now_ns();
+	for(int i=0; i<2 && xfer[0] && xfer[1]; i++){
+		libusb_fill_control_setup(buff[i],
+				LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN,
+				funcs[i], (sends[i][1] << 8) | sends[i][0],
+				(sends[i][3] << 8) | sends[i][2], lens[i]);
+		libusb_fill_control_transfer(xfer[i], usbasp->usbhandle, buff[i],
+				usbasp_uart_async_done, &async[i], usbasp_uart_timeout(usbasp));
+		async[i].done=0;
+		if(libusb_submit_transfer(xfer[i])!=0){
+			break;
+		}
+		submitted++;
+	}
+	for(int i=0; i<submitted; i++){
+		while(!async[i].done){
+			libusb_handle_events_completed(ctx, &async[i].done);
+		}
+	}
+	if(usbasp->stats || usbasp->trace){
+		for(int i=0; i<submitted; i++){
+			usbasp_uart_account(usbasp, 1, funcs[i], sends[i], lens[i],
+					async[i].rv, start, async[i].finish);
+		}
+	}
+	int64_t caps=-1;
+	*configured=submitted==2 && async[1].rv>=0;
+	if(submitted>0){
+		caps=0;
+		if(async[0].rv==4){
+			uint8_t* res=buff[0]+LIBUSB_CONTROL_SETUP_SIZE;
+			caps=res[0] | ((uint32_t)res[1] << 8) | ((uint32_t)res[2] << 16) |
+				((uint32_t)res[3] << 24);
+		}
+	}
+	libusb_free_transfer(xfer[0]);
+	libusb_free_transfer(xfer[1]);
+	return caps;
 }
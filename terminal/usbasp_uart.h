@@ -2,17 +2,149 @@
 #define USBASP_UART_H_
 
 #include <stdint.h>
+#include <stdio.h>
+#ifdef _WIN32
+struct iovec{
+	void* iov_base;
+	size_t iov_len;
+};
+#else
+#include <sys/uio.h>
+#endif
 
 #include "../firmware/usbasp.h"
 
 #include <libusb-1.0/libusb.h>
 
 #define USBASP_NO_CAPS (-4)
+#define USBASP_POOL_EMPTY (-5)
+
+// How usbasp_uart_read_wait() schedules polls while RX is empty.
+#define USBASP_POLL_BUSY    0 // Poll again immediately (default).
+#define USBASP_POLL_SLEEP   1 // Sleep poll_interval_us after empty poll.
+#define USBASP_POLL_BACKOFF 2 // Double sleep after each empty poll, up to poll_interval_us.
+
+#define USBASP_STATS_FUNCS   128 // Function IDs are 7-bit.
+#define USBASP_STATS_SIZES   10  // Log2 buckets of bytes per transfer, 0..256+.
+#define USBASP_STATS_BUCKETS 24  // Log2 buckets of transfer duration in us.
+
+// Counters of every control transfer, filled in when enabled with
+// usbasp_uart_stats_enable(). Size bucket 0 is for empty transfers,
+// bucket i>0 for 2^(i-1)..2^i-1 bytes. Duration bucket 0 is for <2us,
+// bucket i>0 for 2^i..2^(i+1)-1 us.
+typedef struct USBasp_UART_Stats{
+	uint64_t transfers[USBASP_STATS_FUNCS];
+	uint64_t bytes[USBASP_STATS_FUNCS];
+	uint64_t errors[USBASP_STATS_FUNCS];
+	uint64_t ns[USBASP_STATS_FUNCS];   // Time spent in transfers.
+	uint64_t timeouts;
+	uint64_t rx_empty;                 // RX polls that returned no data.
+	uint64_t tx_stalls;                // TX_FREE answers with no room.
+	uint64_t sizes[USBASP_STATS_SIZES];
+	uint64_t durations[USBASP_STATS_BUCKETS];
+} USBasp_UART_Stats;
+
+// Trace file is a USBasp_UART_TraceHeader followed by records, one per
+// control transfer, in host byte order. Records are ordered by completion.
+#define USBASP_TRACE_MAGIC   0x52544155 // "UATR"
+#define USBASP_TRACE_VERSION 1
+
+typedef struct USBasp_UART_TraceHeader{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_size;
+} USBasp_UART_TraceHeader;
+
+typedef struct USBasp_UART_TraceRecord{
+	uint64_t submit_ns;    // usbasp_uart_now_ns() clock.
+	uint64_t complete_ns;
+	uint32_t thread;       // Small per-thread number, starting with 1.
+	uint16_t value;
+	uint16_t index;
+	uint16_t requested;
+	int16_t result;        // Bytes transferred or libusb error.
+	uint8_t function;
+	uint8_t in;            // 1 if data goes from device to host.
+	uint8_t reserved[2];
+} USBasp_UART_TraceRecord;
+
+typedef struct USBasp_UART_Trace USBasp_UART_Trace;
 
+#define USBASP_CHUNK_SIZE 254 // V-USB cannot transfer more at once.
+
+typedef struct USBasp_UART_Pool USBasp_UART_Pool;
+
+// Called by usbasp_uart_enumerate() for every USBasp found; serial is ""
+// for devices without one.
+typedef void (*usbasp_uart_found_cb)(void* ctx, const char* path, const char* serial);
+
+// Receive buffer handed out by usbasp_uart_read_chunk(). Owner passes it
+// on as it likes and gives it back with usbasp_uart_chunk_release().
+typedef struct USBasp_UART_Chunk{
+	USBasp_UART_Pool* pool;
+	struct USBasp_UART_Chunk* next; // Free for the owner, e.g. to queue chunks.
+	uint64_t ns;                     // usbasp_uart_now_ns() when received.
+	int len;
+	uint8_t data[USBASP_CHUNK_SIZE];
+} USBasp_UART_Chunk;
+
+// Preallocated chunks, so streaming doesn't touch the heap. Chunks may be
+// released from any thread.
+struct USBasp_UART_Pool{
+	USBasp_UART_Chunk* chunks;
+	USBasp_UART_Chunk* free;
+	size_t count;
+	size_t in_use;
+	size_t peak;         // Most chunks in use at once.
+	uint64_t exhausted;  // Reads refused since no chunk was free.
+	volatile int lock;
+};
+
+// Must be zero-initialized before first usbasp_uart_config(). Later calls
+// to usbasp_uart_config() reuse the already opened device.
+// Set select before usbasp_uart_config() to pick one of several USBasps:
+// "serial:S" or just "S" matches serial number, "path:B-P[.P...]" matches
+// bus and port path (as in Linux sysfs) without opening any other device.
+// NULL opens the first one found. All handles share one libusb context.
+// Set cache to a file to remember the device opened: next open tries it
+// before scanning, without reading its strings again if its serial still
+// matches, and its capabilities are known, so configuration is sent
+// along with asking for them. Times are usbasp_uart_now_ns() of the last
+// open.
+// Set reconnect_ms to survive unplugging or reset of the device: a transfer
+// finding it gone waits up to reconnect_ms (<0 forever) for it to come
+// back, configures it as before and is repeated. Stats, trace and the
+// struct itself are kept, so streaming goes on after the gap.
+// timeout_ms limits each blocking transfer, 0 means 5000.
 typedef struct USBasp_UART{
+	const char* select;
+	const char* cache;
+	int reconnect_ms;
+	int timeout_ms;
 	libusb_device_handle* usbhandle;
+	char path[64];         // Bus and port path of device opened.
+	int baud;              // Last configuration, applied again on reconnect.
+	int flags;
+	int cached;            // Last open found device through cache.
+	uint32_t caps;         // Capabilities read last or cached, 0 if unknown.
+	uint64_t open_ns;      // usbasp_uart_config() started opening.
+	uint64_t found_ns;     // Device opened.
+	uint64_t config_ns;    // UART configured.
+	uint64_t first_rx_ns;  // First byte received, 0 until then.
+	uint64_t reconnects;
+	uint64_t reconnect_ns; // Duration of last reconnect.
+	uint64_t lost_bytes;   // Line could carry that many while disconnected.
+	volatile int users;    // Threads transferring, handle is not closed under them.
+	volatile int reconnecting;
+	struct USBasp_UART_NB* nb;  // Non-blocking mode, see usbasp_nb.h.
+	int poll_mode;
+	int poll_interval_us;
+	USBasp_UART_Stats* stats;
+	USBasp_UART_Trace* trace;
 } USBasp_UART;
 
+#define usbasp_uart_timeout(u) ((u)->timeout_ms>0?(unsigned)(u)->timeout_ms:5000u)
+
 extern int verbose;
 
 #ifdef __cplusplus
@@ -22,13 +154,51 @@ extern "C"{
 int usbasp_uart_config(USBasp_UART* usbasp, int baud, int flags);
 void usbasp_uart_flushrx(USBasp_UART* usbasp);
 void usbasp_uart_flushtx(USBasp_UART* usbasp);
+// Ends non-blocking mode, disables UART and closes the device, and frees
+// the trace; without a handle only the host side is torn down.
 void usbasp_uart_disable(USBasp_UART* usbasp);
+// Set by usbasp_nb.c, so that disable() ends non-blocking mode without
+// every program linking it.
+extern void (*usbasp_uart_nb_off)(USBasp_UART* usbasp);
+void usbasp_uart_suspend(USBasp_UART* usbasp);
+int usbasp_uart_resume(USBasp_UART* usbasp);
 int usbasp_uart_read(USBasp_UART* usbasp, uint8_t* buff, size_t len);
 int usbasp_uart_write(USBasp_UART* usbasp, uint8_t* buff, size_t len);
 int usbasp_uart_write_all(USBasp_UART* usbasp, uint8_t* buff, int len);
+int usbasp_uart_writev(USBasp_UART* usbasp, const struct iovec* iov, int iovcnt);
+int64_t usbasp_uart_send_fd(USBasp_UART* usbasp, int fd);
+int usbasp_uart_recv_fd(USBasp_UART* usbasp, int fd, int latency_us);
+void usbasp_uart_set_poll(USBasp_UART* usbasp, int mode, int interval_us);
+int usbasp_uart_read_wait(USBasp_UART* usbasp, uint8_t* buff, size_t len, int timeout_ms);
+uint64_t usbasp_uart_now_ns(void);
+void usbasp_uart_stats_enable(USBasp_UART* usbasp, USBasp_UART_Stats* stats);
+void usbasp_uart_stats_get(USBasp_UART* usbasp, USBasp_UART_Stats* out);
+void usbasp_uart_stats_print(const USBasp_UART_Stats* stats, FILE* f);
+void usbasp_uart_timing_print(const USBasp_UART* usbasp, FILE* f);
+const char* usbasp_uart_func_name(int func);
+int usbasp_uart_trace_open(USBasp_UART* usbasp, const char* path);
+void usbasp_uart_trace_close(USBasp_UART* usbasp);
+int usbasp_uart_enumerate(usbasp_uart_found_cb found, void* ctx);
+int usbasp_uart_list(FILE* f);
+libusb_context* usbasp_uart_context(void);
+int usbasp_uart_pool_init(USBasp_UART_Pool* pool, size_t count);
+void usbasp_uart_pool_free(USBasp_UART_Pool* pool);
+USBasp_UART_Chunk* usbasp_uart_chunk_get(USBasp_UART_Pool* pool);
+void usbasp_uart_chunk_release(USBasp_UART_Chunk* chunk);
+int usbasp_uart_read_chunk(USBasp_UART* usbasp, USBasp_UART_Pool* pool, USBasp_UART_Chunk** out);
 
 #ifdef __cplusplus
 }
+
+#include <memory>
+
+// Gives chunk back to its pool when the handle goes out of scope.
+struct USBasp_UART_ChunkRelease{
+	void operator()(USBasp_UART_Chunk* chunk) const{
+		usbasp_uart_chunk_release(chunk);
+	}
+};
+typedef std::unique_ptr<USBasp_UART_Chunk, USBasp_UART_ChunkRelease> USBasp_UART_ChunkPtr;
 #endif
 
 #endif
@@ -0,0 +1,331 @@
+#ifndef USBASP_UART_HPP_
+#define USBASP_UART_HPP_
+
+// C++ interface to usbasp_uart.h: a move-only handle closing the device
+// when destroyed, typed line settings and std::error_code errors. Reads
+// and writes go straight between caller memory and the transfer, nothing
+// is copied or allocated after opening.
+
+#include "usbasp_uart.h"
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <type_traits>
+
+#if __cplusplus >= 202002L && defined(__has_include)
+#if __has_include(<span>)
+#include <span>
+#define USBASP_HAS_STD_SPAN 1
+#endif
+#endif
+
+namespace usbasp{
+
+#ifdef USBASP_HAS_STD_SPAN
+template<class T> using span=std::span<T>;
+#else
+// Enough of std::span for the calls below, before C++20.
+template<class T> class span{
+public:
+	constexpr span() noexcept: data_(nullptr), size_(0){}
+	constexpr span(T* data, size_t size) noexcept: data_(data), size_(size){}
+	template<size_t N> constexpr span(T (&array)[N]) noexcept: data_(array), size_(N){}
+	template<class C, class=decltype(std::declval<C&>().data())>
+	constexpr span(C& c) noexcept: data_(c.data()), size_(c.size()){}
+	template<class U, class=typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+	constexpr span(const span<U>& other) noexcept: data_(other.data()), size_(other.size()){}
+	constexpr T* data() const noexcept{ return data_; }
+	constexpr size_t size() const noexcept{ return size_; }
+	constexpr bool empty() const noexcept{ return size_==0; }
+	constexpr span subspan(size_t offset) const noexcept{ return span(data_+offset, size_-offset); }
+private:
+	T* data_;
+	size_t size_;
+};
+#endif
+
+enum class Errc{
+	open_failed=1,  // No USBasp matching, or no permission to open it.
+	no_caps,        // Firmware without UART (or loopback, when asked for).
+	no_device,      // Device gone.
+	timeout,
+	io,
+	access,
+	busy,
+	pipe,
+	overflow,
+	interrupted,
+	no_mem,
+	not_supported,
+	other,
+};
+
+class ErrorCategory: public std::error_category{
+public:
+	const char* name() const noexcept override{ return "usbasp"; }
+	std::string message(int code) const override{
+		switch(static_cast<Errc>(code)){
+		case Errc::open_failed:   return "USBasp not found or not accessible";
+		case Errc::no_caps:       return "USBasp firmware has no UART capability";
+		case Errc::no_device:     return "USBasp disconnected";
+		case Errc::timeout:       return "transfer timed out";
+		case Errc::io:            return "USB I/O error";
+		case Errc::access:        return "access denied";
+		case Errc::busy:          return "device busy";
+		case Errc::pipe:          return "request stalled";
+		case Errc::overflow:      return "transfer overflow";
+		case Errc::interrupted:   return "interrupted";
+		case Errc::no_mem:        return "out of memory";
+		case Errc::not_supported: return "not supported";
+		default:                  return "USB error";
+		}
+	}
+};
+
+inline const std::error_category& category() noexcept{
+	static ErrorCategory instance;
+	return instance;
+}
+
+inline std::error_code make_error_code(Errc e) noexcept{
+	return std::error_code(static_cast<int>(e), category());
+}
+
+// Thrown by the overloads without std::error_code.
+class Error: public std::system_error{
+public:
+	Error(std::error_code ec, const char* what): std::system_error(ec, what){}
+};
+
+// Transfer results are libusb codes.
+inline std::error_code transferError(int rv) noexcept{
+	switch(rv){
+	case LIBUSB_ERROR_TIMEOUT:       return make_error_code(Errc::timeout);
+	case LIBUSB_ERROR_NO_DEVICE:     return make_error_code(Errc::no_device);
+	case LIBUSB_ERROR_IO:            return make_error_code(Errc::io);
+	case LIBUSB_ERROR_ACCESS:        return make_error_code(Errc::access);
+	case LIBUSB_ERROR_BUSY:          return make_error_code(Errc::busy);
+	case LIBUSB_ERROR_PIPE:          return make_error_code(Errc::pipe);
+	case LIBUSB_ERROR_OVERFLOW:      return make_error_code(Errc::overflow);
+	case LIBUSB_ERROR_INTERRUPTED:   return make_error_code(Errc::interrupted);
+	case LIBUSB_ERROR_NO_MEM:        return make_error_code(Errc::no_mem);
+	case LIBUSB_ERROR_NOT_SUPPORTED: return make_error_code(Errc::not_supported);
+	default:                         return make_error_code(Errc::other);
+	}
+}
+
+// usbasp_uart_config() results, where -4 is USBASP_NO_CAPS, not a libusb code.
+inline std::error_code configError(int rv) noexcept{
+	switch(rv){
+	case -1:             return make_error_code(Errc::open_failed);
+	case USBASP_NO_CAPS: return make_error_code(Errc::no_caps);
+	default:             return transferError(rv);
+	}
+}
+
+enum class Parity{
+	none=USBASP_UART_PARITY_NONE,
+	even=USBASP_UART_PARITY_EVEN,
+	odd=USBASP_UART_PARITY_ODD,
+};
+
+enum class DataBits{
+	five=USBASP_UART_BYTES_5B,
+	six=USBASP_UART_BYTES_6B,
+	seven=USBASP_UART_BYTES_7B,
+	eight=USBASP_UART_BYTES_8B,
+};
+
+enum class StopBits{
+	one=USBASP_UART_STOP_1BIT,
+	two=USBASP_UART_STOP_2BIT,
+};
+
+// Line settings. Baud is derived from 12MHz/8, so only some rates are
+// exact; config<BAUD>() refuses at compile time those that are off by
+// more than 3% or out of the prescaler's range.
+struct Config{
+	static constexpr int clock=12000000/8;
+
+	int baud;
+	Parity parity;
+	DataBits bits;
+	StopBits stop;
+	bool loopback;
+
+	constexpr Config(int baud=9600, Parity parity=Parity::none, DataBits bits=DataBits::eight,
+			StopBits stop=StopBits::one, bool loopback=false) noexcept
+		: baud(baud), parity(parity), bits(bits), stop(stop), loopback(loopback){}
+
+	constexpr int flags() const noexcept{
+		return static_cast<int>(parity) | static_cast<int>(bits) |
+			static_cast<int>(stop) | (loopback?USBASP_UART_LOOPBACK:0);
+	}
+	constexpr int prescaler() const noexcept{ return clock/baud-1; }
+	constexpr int actualBaud() const noexcept{ return clock/(prescaler()+1); }
+	// Difference between asked and actual baud, in thousandths.
+	constexpr int errorPermille() const noexcept{
+		return (actualBaud()>baud?actualBaud()-baud:baud-actualBaud())*1000/baud;
+	}
+	constexpr bool valid() const noexcept{
+		return baud>0 && baud<=clock && prescaler()<=0xFFFF && errorPermille()<=30;
+	}
+};
+
+template<int Baud, Parity P=Parity::none, DataBits B=DataBits::eight,
+		StopBits S=StopBits::one, bool Loopback=false>
+constexpr Config config() noexcept{
+	static_assert(Baud>0 && Baud<=Config::clock, "baud out of range, at most 1500000");
+	static_assert(Config(Baud).prescaler()<=0xFFFF, "baud too low for 16-bit prescaler");
+	static_assert(Config(Baud).errorPermille()<=30, "baud cannot be made within 3% from 12MHz");
+	return Config(Baud, P, B, S, Loopback);
+}
+
+typedef std::chrono::steady_clock Clock;
+typedef Clock::time_point Deadline;  // Deadline::max() waits forever.
+
+// Owns an open device: moving passes it on, destruction disables UART
+// and closes it, dropping the shared libusb context with the last one.
+// The C struct stays at one address for its whole life, so native() may
+// be handed to the scheduler or other C code.
+class Uart{
+public:
+	Uart() noexcept{}
+
+	// select as for USBasp_UART, empty opens the first USBasp found.
+	explicit Uart(const Config& config, const std::string& select=std::string()){
+		std::error_code ec;
+		open(config, select, ec);
+		if(ec){ throw Error(ec, "usbasp open"); }
+	}
+
+	Uart(const Config& config, const std::string& select, std::error_code& ec){
+		open(config, select, ec);
+	}
+
+	Uart(Uart&&) noexcept=default;
+	Uart& operator=(Uart&&) noexcept=default;
+	Uart(const Uart&)=delete;
+	Uart& operator=(const Uart&)=delete;
+
+	explicit operator bool() const noexcept{ return state_!=nullptr; }
+	USBasp_UART* native() noexcept{ return state_?&state_->uart:nullptr; }
+	const Config& config() const noexcept{ return state_->config; }
+	void close() noexcept{ state_.reset(); }
+
+	// Polls until something arrives or deadline passes; returns bytes
+	// read, 0 on timeout, which is not an error. One call reads at most
+	// 254 bytes, the most firmware sends at once.
+	size_t read(span<uint8_t> buff, Deadline deadline, std::error_code& ec) noexcept{
+		int timeout_ms=-1;
+		if(deadline!=Deadline::max()){
+			auto left=deadline-Clock::now();
+			timeout_ms=left.count()<=0?0:(int)std::chrono::duration_cast<std::chrono::milliseconds>(
+					left+std::chrono::milliseconds(1)-Clock::duration(1)).count();
+		}
+		int rv=usbasp_uart_read_wait(&state_->uart, buff.data(), buff.size(), timeout_ms);
+		if(rv<0){
+			ec=transferError(rv);
+			return 0;
+		}
+		ec.clear();
+		return rv;
+	}
+
+	size_t read(span<uint8_t> buff, Deadline deadline){
+		std::error_code ec;
+		size_t n=read(buff, deadline, ec);
+		if(ec){ throw Error(ec, "usbasp read"); }
+		return n;
+	}
+
+	template<class Rep, class Period>
+	size_t read(span<uint8_t> buff, std::chrono::duration<Rep, Period> timeout){
+		return read(buff, Clock::now()+timeout);
+	}
+
+	// Sends all of data, waiting for room in firmware buffer as needed.
+	size_t write(span<const uint8_t> data, std::error_code& ec) noexcept{
+		size_t done=0;
+		while(done<data.size()){
+			size_t n=data.size()-done;
+			if(n>(1u<<30)){ n=1u<<30; }
+			int rv=usbasp_uart_write_all(&state_->uart,
+					const_cast<uint8_t*>(data.data()+done), (int)n);
+			if(rv<0){
+				ec=transferError(rv);
+				return done;
+			}
+			done+=rv;
+		}
+		ec.clear();
+		return done;
+	}
+
+	size_t write(span<const uint8_t> data){
+		std::error_code ec;
+		size_t n=write(data, ec);
+		if(ec){ throw Error(ec, "usbasp write"); }
+		return n;
+	}
+
+	void configure(const Config& config, std::error_code& ec) noexcept{
+		int rv=usbasp_uart_config(&state_->uart, config.baud, config.flags());
+		if(rv<0){
+			ec=configError(rv);
+			return;
+		}
+		state_->config=config;
+		ec.clear();
+	}
+
+	void configure(const Config& config){
+		std::error_code ec;
+		configure(config, ec);
+		if(ec){ throw Error(ec, "usbasp configure"); }
+	}
+
+	void flushRx() noexcept{ usbasp_uart_flushrx(&state_->uart); }
+	void flushTx() noexcept{ usbasp_uart_flushtx(&state_->uart); }
+
+private:
+	// select is kept here, library reads it again on reconnect.
+	struct State{
+		USBasp_UART uart;
+		std::string select;
+		Config config;
+	};
+	struct Closer{
+		void operator()(State* state) const noexcept{
+			usbasp_uart_disable(&state->uart);
+			delete state;
+		}
+	};
+
+	void open(const Config& config, const std::string& select, std::error_code& ec){
+		std::unique_ptr<State, Closer> state(new State());
+		state->uart=USBasp_UART();
+		state->select=select;
+		state->uart.select=state->select.empty()?nullptr:state->select.c_str();
+		int rv=usbasp_uart_config(&state->uart, config.baud, config.flags());
+		if(rv<0){
+			ec=configError(rv);
+			return;
+		}
+		state->config=config;
+		state_=std::move(state);
+		ec.clear();
+	}
+
+	std::unique_ptr<State, Closer> state_;
+};
+
+}
+
+namespace std{
+template<> struct is_error_code_enum<usbasp::Errc>: true_type{};
+}
+
+#endif